@@ -1113,30 +1113,229 @@ LUALIB_API void luaL_checkversion_ (lua_State *L, lua_Number ver, size_t sz) {
 // use clonefunction
 
 #include "spinlock.h"
+#include "atomic.h"
+
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+** Shared code cache. Every file is loaded once into its own owner state
+** and its protos are shared; lua states clone the main function.
+** Entries are keyed by filename and stat stamp (mtime, size, inode), so a
+** changed file gets a new entry and the old one is retired. A hit stats
+** the file at most once a second.
+** Lookup is lock free: readers announce themselves in the reader counter
+** of the current epoch, and a writer that unlinks entries flips the epoch
+** and waits for the readers of the old one before dropping its reference.
+** Each state that cloned an entry holds one reference until it is closed
+** (shared strings and protos may be referenced from anywhere in it), so the
+** owner state is closed once the entry is retired and the last user exits.
+*/
+
+#define CODECACHE_SLOTS 4096
+
+struct codecache_entry {
+	ATOM_POINTER next;
+	struct codecache_entry *retire;	/* list of entries unlinked by a writer */
+	ATOM_INT ref;	/* one for the cache while linked, one per state using it */
+	ATOM_INT checked;	/* time of the last stat that matched */
+	unsigned int hash;
+	time_t mtime;
+	off_t size;
+	ino_t ino;
+	lua_State *L;	/* owner of the shared protos */
+	const void *proto;
+	size_t bytes;
+	char filename[1];
+};
 
 struct codecache {
-	struct spinlock lock;
-	lua_State *L;
+	struct spinlock lock;	/* writers only */
+	ATOM_INT epoch;
+	ATOM_INT reader[2];
+	int n;	/* linked entries, updated under lock */
+	size_t bytes;
+	ATOM_INT stale;	/* retired entries still used by some state */
+	ATOM_SIZET stale_bytes;
+	ATOM_POINTER slot[CODECACHE_SLOTS];
 };
 
 static struct codecache CC;
 
+/* per state: entries it holds a reference of, and bytes it loaded itself */
+struct codecache_refs {
+	int n;
+	int cap;
+	struct codecache_entry **e;
+	size_t private_bytes;
+};
+
+static int cache_refs_key = 0;
+
+static unsigned int
+cache_hash(const char *filename) {
+	unsigned int h = 2166136261u;
+	for (; *filename; filename++)
+		h = (h ^ (unsigned char)*filename) * 16777619u;
+	return h;
+}
+
+static int
+cache_enter(void) {
+	for (;;) {
+		int e = ATOM_LOAD(&CC.epoch);
+		ATOM_FINC(&CC.reader[e & 1]);
+		if (ATOM_LOAD(&CC.epoch) == e)
+			return e;
+		ATOM_FDEC(&CC.reader[e & 1]);
+	}
+}
+
+static void
+cache_leave(int e) {
+	ATOM_FDEC(&CC.reader[e & 1]);
+}
+
+/* called by a writer (under lock) after unlinking: wait until no reader can see the entries */
+static void
+cache_synchronize(void) {
+	int e = ATOM_LOAD(&CC.epoch);
+	ATOM_STORE(&CC.epoch, e + 1);
+	while (ATOM_LOAD(&CC.reader[e & 1]) != 0) {}
+}
+
 static void
-clearcache(void) {
-	if (CC.L == NULL)
-		return;
+entry_release(struct codecache_entry *e) {
+	if (ATOM_FDEC(&e->ref) == 1) {
+		/* linked entries are held by the cache, so this one is retired */
+		ATOM_FDEC(&CC.stale);
+		ATOM_FSUB(&CC.stale_bytes, e->bytes);
+		lua_close(e->L);
+		free(e);
+	}
+}
+
+static int
+entry_match(const struct codecache_entry *e, unsigned int hash, const char *filename) {
+	return e->hash == hash && strcmp(e->filename, filename) == 0;
+}
+
+static int
+entry_fresh(const struct codecache_entry *e, const struct stat *st) {
+	return e->mtime == st->st_mtime && e->size == st->st_size && e->ino == st->st_ino;
+}
+
+/*
+** returns the entry with a reference taken for the caller, or NULL if it is
+** missing or changed on disk. *stated is set when st is filled by stat.
+*/
+static struct codecache_entry *
+cache_lookup(const char *filename, unsigned int hash, struct stat *st, int *stated) {
+	struct codecache_entry *e;
+	int now = (int)time(NULL);
+	int epoch = cache_enter();
+	e = (struct codecache_entry *)ATOM_LOAD(&CC.slot[hash % CODECACHE_SLOTS]);
+	while (e && !entry_match(e, hash, filename))
+		e = (struct codecache_entry *)ATOM_LOAD(&e->next);
+	if (e && ATOM_LOAD(&e->checked) != now) {
+		if (!*stated) {
+			*stated = 1;
+			if (stat(filename, st) != 0)
+				e = NULL;
+		}
+		if (e && entry_fresh(e, st))
+			ATOM_STORE(&e->checked, now);
+		else
+			e = NULL;
+	}
+	if (e)
+		ATOM_FINC(&e->ref);
+	cache_leave(epoch);
+	return e;
+}
+
+/* unlink all the entries in the chain of filename (all chains if NULL), must hold the lock */
+static struct codecache_entry *
+cache_unlink(const char *filename, unsigned int hash, struct codecache_entry *retire) {
+	int i;
+	for (i = 0; i < CODECACHE_SLOTS; i++) {
+		ATOM_POINTER *prev;
+		struct codecache_entry *e;
+		if (filename)
+			i = hash % CODECACHE_SLOTS;
+		prev = &CC.slot[i];
+		while ((e = (struct codecache_entry *)ATOM_LOAD(prev)) != NULL) {
+			if (filename == NULL || entry_match(e, hash, filename)) {
+				ATOM_STORE(prev, ATOM_LOAD(&e->next));
+				CC.n--;
+				CC.bytes -= e->bytes;
+				ATOM_FINC(&CC.stale);
+				ATOM_FADD(&CC.stale_bytes, e->bytes);
+				e->retire = retire;
+				retire = e;
+			} else {
+				prev = &e->next;
+			}
+		}
+		if (filename)
+			break;
+	}
+	return retire;
+}
+
+static void
+cache_retire(struct codecache_entry *retire) {
+	while (retire) {
+		struct codecache_entry *next = retire->retire;
+		entry_release(retire);
+		retire = next;
+	}
+}
+
+/*
+** link a new entry (ref 1, owned by the cache), replacing older versions
+** of the same file. returns the entry to use with a reference for the caller,
+** which may be an identical one linked by another state meanwhile.
+*/
+static struct codecache_entry *
+cache_insert(struct codecache_entry *n) {
+	struct codecache_entry *e;
+	struct codecache_entry *retire = NULL;
+	ATOM_POINTER *slot = &CC.slot[n->hash % CODECACHE_SLOTS];
 	SPIN_LOCK(&CC)
-		lua_close(CC.L);
-		CC.L = luaL_newstate();
+	for (e = (struct codecache_entry *)ATOM_LOAD(slot); e; e = (struct codecache_entry *)ATOM_LOAD(&e->next)) {
+		if (entry_match(e, n->hash, n->filename) && e->mtime == n->mtime && e->size == n->size && e->ino == n->ino) {
+			ATOM_FINC(&e->ref);
+			SPIN_UNLOCK(&CC)
+			lua_close(n->L);
+			free(n);
+			return e;
+		}
+	}
+	retire = cache_unlink(n->filename, n->hash, NULL);
+	ATOM_STORE(&n->ref, 2);
+	ATOM_STORE(&n->next, ATOM_LOAD(slot));
+	ATOM_STORE(slot, (uintptr_t)n);
+	CC.n++;
+	CC.bytes += n->bytes;
+	if (retire)
+		cache_synchronize();
 	SPIN_UNLOCK(&CC)
+	cache_retire(retire);
+	return n;
 }
 
 static void
-init(void) {
-	CC.L = luaL_newstate();
+clearcache(const char *filename) {
+	struct codecache_entry *retire;
+	SPIN_LOCK(&CC)
+	retire = cache_unlink(filename, filename ? cache_hash(filename) : 0, NULL);
+	if (retire)
+		cache_synchronize();
+	SPIN_UNLOCK(&CC)
+	cache_retire(retire);
 }
 
-
 void luaL_initcodecache(void);
 
 LUALIB_API void
@@ -1144,47 +1343,70 @@ luaL_initcodecache(void) {
 	SPIN_INIT(&CC);
 }
 
-static const void *
-load_proto(const char *key) {
-  lua_State *L;
-  const void * result;
-  if (CC.L == NULL)
-    return NULL;
-  SPIN_LOCK(&CC)
-    L = CC.L;
-    lua_pushstring(L, key);
-    lua_rawget(L, LUA_REGISTRYINDEX);
-    result = lua_touserdata(L, -1);
-    lua_pop(L, 1);
-  SPIN_UNLOCK(&CC)
+static int
+cache_refs_gc(lua_State *L) {
+	struct codecache_refs *r = (struct codecache_refs *)lua_touserdata(L, 1);
+	int i;
+	for (i = 0; i < r->n; i++)
+		entry_release(r->e[i]);
+	free(r->e);
+	r->e = NULL;
+	r->n = r->cap = 0;
+	return 0;
+}
 
-  return result;
+/*
+** created on the first load of a state, so its finalizer runs after all the
+** finalizers set by code loaded through the cache when the state is closed
+*/
+static struct codecache_refs *
+cache_refs(lua_State *L) {
+	struct codecache_refs *r;
+	if (lua_rawgetp(L, LUA_REGISTRYINDEX, &cache_refs_key) == LUA_TUSERDATA) {
+		r = (struct codecache_refs *)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		return r;
+	}
+	lua_pop(L, 1);
+	r = (struct codecache_refs *)lua_newuserdatauv(L, sizeof(*r), 0);
+	memset(r, 0, sizeof(*r));
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, cache_refs_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &cache_refs_key);
+	return r;
 }
 
-static const void *
-save_proto(const char *key, const void * proto) {
-  lua_State *L;
-  const void * result = NULL;
+static int
+cache_reserve(struct codecache_refs *r) {
+	if (r->n == r->cap) {
+		int cap = r->cap ? r->cap * 2 : 16;
+		struct codecache_entry **e = (struct codecache_entry **)realloc(r->e, cap * sizeof(*e));
+		if (e == NULL)
+			return 0;
+		r->e = e;
+		r->cap = cap;
+	}
+	return 1;
+}
 
-  SPIN_LOCK(&CC)
-    if (CC.L == NULL) {
-      init();
-    }
-    L = CC.L;
-    lua_pushstring(L, key);
-    lua_pushvalue(L, -1);
-    lua_rawget(L, LUA_REGISTRYINDEX);
-    result = lua_touserdata(L, -1); /* stack: key oldvalue */
-    if (result == NULL) {
-      lua_pop(L,1);
-      lua_pushlightuserdata(L, (void *)proto);
-      lua_rawset(L, LUA_REGISTRYINDEX);
-    } else {
-      lua_pop(L,2);
-    }
+/* keep the reference of e in the state, one per entry */
+static void
+cache_bind(struct codecache_refs *r, struct codecache_entry *e) {
+	int i;
+	for (i = r->n - 1; i >= 0; i--) {
+		if (r->e[i] == e) {
+			entry_release(e);
+			return;
+		}
+	}
+	r->e[r->n++] = e;
+}
 
-  SPIN_UNLOCK(&CC)
-  return result;
+static size_t
+state_bytes(lua_State *L) {
+	return (size_t)lua_gc(L, LUA_GCCOUNT) * 1024 + (size_t)lua_gc(L, LUA_GCCOUNTB);
 }
 
 #define CACHE_OFF 0
@@ -1233,21 +1455,37 @@ static int cache_mode(lua_State *L) {
 LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
                                              const char *mode) {
   int level = cache_level(L);
-  const void * proto;
+  struct codecache_refs *refs;
+  struct codecache_entry *e;
+  struct stat st;
+  int stated = 0;
   lua_State * eL;
   int err;
-  const void * oldv;
+  size_t sz;
   if (level == CACHE_OFF || filename == NULL) {
     return luaL_loadfilex_(L, filename, mode);
   }
-  proto = load_proto(filename);
-  if (proto) {
-    lua_clonefunction(L, proto);
+  refs = cache_refs(L);
+  if (!cache_reserve(refs)) {
+    return luaL_loadfilex_(L, filename, mode);
+  }
+  e = cache_lookup(filename, cache_hash(filename), &st, &stated);
+  if (e) {
+    cache_bind(refs, e);
+    lua_clonefunction(L, e->proto);
     return LUA_OK;
   }
-  if (level == CACHE_EXIST) {
+  if (!stated && stat(filename, &st) != 0) {
+    /* let the normal loader report the error */
     return luaL_loadfilex_(L, filename, mode);
   }
+  if (level == CACHE_EXIST) {
+    size_t before = state_bytes(L);
+    err = luaL_loadfilex_(L, filename, mode);
+    if (err == LUA_OK && state_bytes(L) > before)
+      refs->private_bytes += state_bytes(L) - before;
+    return err;
+  }
   eL = luaL_newstate();
   if (eL == NULL) {
     lua_pushliteral(L, "New state failed");
@@ -1255,39 +1493,79 @@ LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
   }
   err = luaL_loadfilex_(eL, filename, mode);
   if (err != LUA_OK) {
-    size_t sz = 0;
     const char * msg = lua_tolstring(eL, -1, &sz);
     lua_pushlstring(L, msg, sz);
     lua_close(eL);
     return err;
   }
   lua_sharefunction(eL, -1);
-  proto = lua_topointer(eL, -1);
-  oldv = save_proto(filename, proto);
-  if (oldv) {
+  sz = strlen(filename);
+  e = (struct codecache_entry *)malloc(sizeof(*e) + sz);
+  if (e == NULL) {
     lua_close(eL);
-    lua_clonefunction(L, oldv);
-  } else {
-    lua_clonefunction(L, proto);
-    /* Never close it. notice: memory leak */
+    lua_pushliteral(L, "New cache entry failed");
+    return LUA_ERRMEM;
   }
-
+  ATOM_INIT(&e->next, 0);
+  e->retire = NULL;
+  ATOM_INIT(&e->ref, 1);
+  ATOM_INIT(&e->checked, (int)time(NULL));
+  e->hash = cache_hash(filename);
+  e->mtime = st.st_mtime;
+  e->size = st.st_size;
+  e->ino = st.st_ino;
+  e->L = eL;
+  e->proto = lua_topointer(eL, -1);
+  e->bytes = state_bytes(eL);
+  memcpy(e->filename, filename, sz + 1);
+  e = cache_insert(e);
+  cache_bind(refs, e);
+  lua_clonefunction(L, e->proto);
   return LUA_OK;
 }
 
 static int
 cache_clear(lua_State *L) {
-	(void)(L);
-	clearcache();
+	clearcache(luaL_optstring(L, 1, NULL));
 	return 0;
 }
 
+static int
+cache_info(lua_State *L) {
+	struct codecache_refs *r = cache_refs(L);
+	size_t bound = 0, bytes;
+	int i, n;
+	SPIN_LOCK(&CC)
+	n = CC.n;
+	bytes = CC.bytes;
+	SPIN_UNLOCK(&CC)
+	lua_createtable(L, 0, 7);
+	lua_pushinteger(L, n);
+	lua_setfield(L, -2, "count");
+	lua_pushinteger(L, (lua_Integer)bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushinteger(L, ATOM_LOAD(&CC.stale));
+	lua_setfield(L, -2, "stale");
+	lua_pushinteger(L, (lua_Integer)ATOM_LOAD(&CC.stale_bytes));
+	lua_setfield(L, -2, "stale_bytes");
+	for (i = 0; i < r->n; i++)
+		bound += r->e[i]->bytes;
+	lua_pushinteger(L, r->n);
+	lua_setfield(L, -2, "used");
+	lua_pushinteger(L, (lua_Integer)bound);
+	lua_setfield(L, -2, "shared");
+	lua_pushinteger(L, (lua_Integer)r->private_bytes);
+	lua_setfield(L, -2, "private");
+	return 1;
+}
+
 int luaopen_cache(lua_State *L);
 
 LUAMOD_API int luaopen_cache(lua_State *L) {
 	luaL_Reg l[] = {
 		{ "clear", cache_clear },
 		{ "mode", cache_mode },
+		{ "info", cache_info },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L,l);
@@ -311,8 +311,8 @@ static inline int
 filter_data(lua_State *L, int fd, uint8_t * buffer, int size) {
 	int ret = filter_data_(L, fd, buffer, size);
 	// buffer is the data of socket message, it malloc at socket_server.c : function forward_message .
-	// it should be free before return,
-	skynet_free(buffer);
+	// it should be free before return, and it may be reused by the read buffer pool
+	skynet_socket_free_buffer(buffer, size);
 	return ret;
 }
 
@@ -4,7 +4,10 @@
 
 #define LUA_LIB
 
+#include "skynet.h"
 #include "skynet_malloc.h"
+#include "spinlock.h"
+#include "atomic.h"
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -12,6 +15,7 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <pthread.h>
 
 #define TYPE_NIL 0
 #define TYPE_BOOLEAN 1
@@ -30,89 +34,256 @@
 // hibits 0~31 : len
 #define TYPE_LONG_STRING 5
 #define TYPE_TABLE 6
+// 只有字符串 key 的 table ，key 集合登记为进程内的 shape ，消息里只有 shape id（uint16）和按 shape 顺序排列的 value
+#define TYPE_SHAPE 7
 
 #define MAX_COOKIE 32
 #define COMBINE_TYPE(t,v) ((t) | (v) << 3)
 
-#define BLOCK_SIZE 128
 #define MAX_DEPTH 32
-
-struct block {
-	struct block * next;
-	char buffer[BLOCK_SIZE];
-};
-
+// 每个线程缓存的写缓冲区初始大小，以及超过多大就不再缓存（直接交给消息）
+#define SCRATCH_INIT 1024
+#define SCRATCH_KEEP (64 * 1024)
+
+// shape 最多的 key 数量，以及进程内最多登记的 shape 数量（id 从 1 开始）
+#define MAX_SHAPE_KEYS 16
+#define MAX_SHAPE 65535
+#define SHAPE_SLOTS (1 << 17)
+// 同一个 key 集合出现 SHAPE_HITS 次才登记，用 key 集合 hash 计数，避免用名字、id 做 key 的 map 占满登记表
+#define SHAPE_HITS 8
+#define SHAPE_PENDING (1 << 12)
+
+/* 打包时写入一块连续的缓冲区，容量不够时翻倍 */
 struct write_block {
-	struct block * head;
-	struct block * current;
+	char * buffer;
 	int len;
-	int ptr;
+	int cap;
+	int shape;		// 是否使用 shape 编码（skynet.packshape）
+};
+
+/* 每个线程一个，打包时取走里面的缓冲区，打包完放回（嵌套打包时另外分配） */
+struct scratch {
+	char * buffer;
+	int cap;
 };
 
 struct read_block {
 	char * buffer;
 	int len;
 	int ptr;
+	int shape_cache;	// shape 的 key 字符串缓存表在栈上的位置，没有用到时为 0
+};
+
+/* 登记后不再修改也不释放，读取不需要加锁 */
+struct shape {
+	uint32_t hash;
+	int id;
+	int n;
+	int len[MAX_SHAPE_KEYS];
+	const char * key[MAX_SHAPE_KEYS];	// 指向 data 中的位置
+	char data[1];
 };
 
-inline static struct block *
-blk_alloc(void) {
-	struct block *b = skynet_malloc(sizeof(struct block));
-	b->next = NULL;
-	return b;
+/* 进程内的 shape 登记表，同一进程内的所有服务共用，所以 shape 编码的消息不能发到其它进程 */
+static struct {
+	struct spinlock lock;
+	int n;
+	ATOM_POINTER slot[SHAPE_SLOTS];		// 按 key 集合的 hash 开放寻址
+	ATOM_POINTER id[MAX_SHAPE+1];
+	ATOM_INT pending[SHAPE_PENDING];	// 还没登记的 key 集合：高位是 hash ，低 4 位是出现次数
+	ATOM_INT full;
+} S;
+
+static pthread_once_t shape_once = PTHREAD_ONCE_INIT;
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void
+scratch_key_init(void) {
+	// 不设析构函数：skynet.so 可能在线程退出前被 dlclose ，缓存随进程退出释放
+	pthread_key_create(&scratch_key, NULL);
 }
 
-inline static void
-wb_push(struct write_block *b, const void *buf, int sz) {
-	const char * buffer = buf;
-	if (b->ptr == BLOCK_SIZE) {
-_again:
-		b->current = b->current->next = blk_alloc();
-		b->ptr = 0;
-	}
-	if (b->ptr <= BLOCK_SIZE - sz) {
-		memcpy(b->current->buffer + b->ptr, buffer, sz);
-		b->ptr+=sz;
-		b->len+=sz;
-	} else {
-		int copy = BLOCK_SIZE - b->ptr;
-		memcpy(b->current->buffer + b->ptr, buffer, copy);
-		buffer += copy;
-		b->len += copy;
-		sz -= copy;
-		goto _again;
-	}
+static struct scratch *
+scratch_get(void) {
+	pthread_once(&scratch_once, scratch_key_init);
+	struct scratch *s = pthread_getspecific(scratch_key);
+	if (s == NULL) {
+		s = skynet_malloc(sizeof(*s));
+		s->buffer = NULL;
+		s->cap = 0;
+		pthread_setspecific(scratch_key, s);
+	}
+	return s;
 }
 
 static void
-wb_init(struct write_block *wb , struct block *b) {
-	wb->head = b;
-	assert(b->next == NULL);
+wb_init(struct write_block *wb) {
+	struct scratch *s = scratch_get();
+	if (s->buffer) {
+		wb->buffer = s->buffer;
+		wb->cap = s->cap;
+		s->buffer = NULL;
+		s->cap = 0;
+	} else {
+		wb->buffer = skynet_malloc(SCRATCH_INIT);
+		wb->cap = SCRATCH_INIT;
+	}
 	wb->len = 0;
-	wb->current = wb->head;
-	wb->ptr = 0;
+	wb->shape = 0;
 }
 
+// 把缓冲区还给线程缓存，太大的或者缓存里已经有了（嵌套打包）就释放掉
 static void
 wb_free(struct write_block *wb) {
-	struct block *blk = wb->head;
-	blk = blk->next;	// the first block is on stack
-	while (blk) {
-		struct block * next = blk->next;
-		skynet_free(blk);
-		blk = next;
-	}
-	wb->head = NULL;
-	wb->current = NULL;
-	wb->ptr = 0;
+	if (wb->buffer == NULL)
+		return;
+	struct scratch *s = scratch_get();
+	if (s->buffer == NULL && wb->cap <= SCRATCH_KEEP) {
+		s->buffer = wb->buffer;
+		s->cap = wb->cap;
+	} else {
+		skynet_free(wb->buffer);
+	}
+	wb->buffer = NULL;
+	wb->cap = 0;
 	wb->len = 0;
 }
 
+static void
+wb_grow(struct write_block *b, int sz) {
+	int cap = b->cap * 2;
+	while (cap < b->len + sz) {
+		cap *= 2;
+	}
+	b->buffer = skynet_realloc(b->buffer, cap);
+	b->cap = cap;
+}
+
+inline static void
+wb_push(struct write_block *b, const void *buf, int sz) {
+	if (b->len + sz > b->cap) {
+		wb_grow(b, sz);
+	}
+	memcpy(b->buffer + b->len, buf, sz);
+	b->len += sz;
+}
+
+static void
+shape_init(void) {
+	spinlock_init(&S.lock);
+}
+
+static uint32_t
+shape_hash(int n, const char **key, const int *len) {
+	uint32_t h = 2166136261u ^ (uint32_t)n;
+	int i,j;
+	for (i=0;i<n;i++) {
+		for (j=0;j<len[i];j++) {
+			h = (h ^ (uint8_t)key[i][j]) * 16777619u;
+		}
+		h = (h ^ (uint32_t)len[i]) * 16777619u;
+	}
+	// FNV 的低位混合得不够，登记表和计数都用低位做下标
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	return h;
+}
+
+static int
+shape_equal(const struct shape *s, uint32_t hash, int n, const char **key, const int *len) {
+	if (s->hash != hash || s->n != n)
+		return 0;
+	int i;
+	for (i=0;i<n;i++) {
+		if (s->len[i] != len[i] || memcmp(s->key[i], key[i], len[i]) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+// 加锁后重新查找一遍，找不到再登记；登记表满了返回 0
+static int
+shape_register(uint32_t hash, int n, const char **key, const int *len) {
+	pthread_once(&shape_once, shape_init);
+	spinlock_lock(&S.lock);
+	int slot = hash & (SHAPE_SLOTS-1);
+	struct shape *s;
+	while ((s = (struct shape *)ATOM_LOAD(&S.slot[slot])) != NULL) {
+		if (shape_equal(s, hash, n, key, len)) {
+			spinlock_unlock(&S.lock);
+			return s->id;
+		}
+		slot = (slot + 1) & (SHAPE_SLOTS-1);
+	}
+	if (S.n >= MAX_SHAPE) {
+		spinlock_unlock(&S.lock);
+		if (ATOM_CAS(&S.full, 0, 1)) {
+			skynet_error(NULL, "serialize: shape table is full, packshape falls back to pack");
+		}
+		return 0;
+	}
+	int i;
+	size_t sz = 0;
+	for (i=0;i<n;i++) {
+		sz += len[i];
+	}
+	s = skynet_malloc(sizeof(*s) + sz);
+	s->hash = hash;
+	s->id = ++S.n;
+	s->n = n;
+	char *p = s->data;
+	for (i=0;i<n;i++) {
+		memcpy(p, key[i], len[i]);
+		s->len[i] = len[i];
+		s->key[i] = p;
+		p += len[i];
+	}
+	ATOM_STORE(&S.id[s->id], (uintptr_t)s);
+	ATOM_STORE(&S.slot[slot], (uintptr_t)s);
+	spinlock_unlock(&S.lock);
+	return s->id;
+}
+
+// 记一次出现，够 SHAPE_HITS 次返回 1 ；同一个位置换成别的 key 集合时重新计数
+static int
+shape_hit(uint32_t hash) {
+	ATOM_INT *p = &S.pending[hash & (SHAPE_PENDING-1)];
+	int tag = (int)(hash & ~0xfu);
+	for (;;) {
+		int v = ATOM_LOAD(p);
+		int nv = (v & ~0xf) == tag ? v + 1 : tag + 1;
+		if ((nv & 0xf) >= SHAPE_HITS)
+			return 1;
+		if (ATOM_CAS(p, v, nv))
+			return 0;
+	}
+}
+
+// 按 key 集合（含顺序）查找 shape id ，命中时不加锁；还没有登记并且出现次数不够时返回 0
+static int
+shape_id(int n, const char **key, const int *len) {
+	uint32_t hash = shape_hash(n, key, len);
+	int slot = hash & (SHAPE_SLOTS-1);
+	struct shape *s;
+	while ((s = (struct shape *)ATOM_LOAD(&S.slot[slot])) != NULL) {
+		if (shape_equal(s, hash, n, key, len))
+			return s->id;
+		slot = (slot + 1) & (SHAPE_SLOTS-1);
+	}
+	if (ATOM_LOAD(&S.full) || !shape_hit(hash))
+		return 0;
+	return shape_register(hash, n, key, len);
+}
+
 static void
 rball_init(struct read_block * rb, char * buffer, int size) {
 	rb->buffer = buffer;
 	rb->len = size;
 	rb->ptr = 0;
+	rb->shape_cache = 0;
 }
 
 static const void *
@@ -282,6 +453,44 @@ wb_table_metapairs(lua_State *L, struct write_block *wb, int index, int depth) {
 	return 0;
 }
 
+/* 先只遍历 key ，value 按顺序留在栈上，确定有 shape id 后再打包 value ；
+ 有非字符串的 key 、key 太多、还没登记或者登记表满了，什么都不写并返回 0 */
+static int
+wb_table_shape(lua_State *L, struct write_block *wb, int index, int depth) {
+	const char * key[MAX_SHAPE_KEYS];
+	int len[MAX_SHAPE_KEYS];
+	int n = 0;
+	luaL_checkstack(L, MAX_SHAPE_KEYS + 2, NULL);
+	lua_pushnil(L);
+	while (lua_next(L, index) != 0) {
+		if (n >= MAX_SHAPE_KEYS || lua_type(L,-2) != LUA_TSTRING) {
+			lua_pop(L, n + 2);
+			return 0;
+		}
+		size_t sz;
+		// key 在遍历期间一直被 table 引用
+		key[n] = lua_tolstring(L, -2, &sz);
+		len[n] = (int)sz;
+		++n;
+		lua_insert(L, -2);
+	}
+	int id = n > 0 ? shape_id(n, key, len) : 0;
+	if (id == 0) {
+		lua_pop(L, n);
+		return 0;
+	}
+	uint8_t head[3] = { COMBINE_TYPE(TYPE_SHAPE, 0), 0, 0 };
+	uint16_t v = (uint16_t)id;
+	memcpy(head + 1, &v, sizeof(v));
+	wb_push(wb, head, sizeof(head));
+	int i;
+	for (i=0;i<n;i++) {
+		pack_one(L, wb, i - n, depth);
+	}
+	lua_pop(L, n);
+	return 1;
+}
+
 static int
 wb_table(lua_State *L, struct write_block *wb, int index, int depth) {
 	if (!lua_checkstack(L, LUA_MINSTACK)) {
@@ -294,6 +503,9 @@ wb_table(lua_State *L, struct write_block *wb, int index, int depth) {
 	if (luaL_getmetafield(L, index, "__pairs") != LUA_TNIL) {
 		return wb_table_metapairs(L, wb, index, depth);
 	} else {
+		if (wb->shape && lua_rawlen(L, index) == 0 && wb_table_shape(L, wb, index, depth)) {
+			return 0;
+		}
 		int array_size = wb_table_array(L, wb, index, depth);
 		wb_table_hash(L, wb, index, depth, array_size);
 		return 0;
@@ -440,6 +652,7 @@ get_buffer(lua_State *L, struct read_block *rb, int len) {
 }
 
 static void unpack_one(lua_State *L, struct read_block *rb);
+static void unpack_shape(lua_State *L, struct read_block *rb);
 
 static void
 unpack_table(lua_State *L, struct read_block *rb, int array_size) {
@@ -523,6 +736,10 @@ push_value(lua_State *L, struct read_block *rb, int type, int cookie) {
 		unpack_table(L,rb,cookie);
 		break;
 	}
+	case TYPE_SHAPE: {
+		unpack_shape(L,rb);
+		break;
+	}
 	default: {
 		invalid_stream(L,rb);
 		break;
@@ -530,6 +747,50 @@ push_value(lua_State *L, struct read_block *rb, int type, int cookie) {
 	}
 }
 
+static void
+unpack_shape(lua_State *L, struct read_block *rb) {
+	uint16_t id;
+	const void * p = rb_read(rb, sizeof(id));
+	if (p == NULL) {
+		invalid_stream(L, rb);
+	}
+	memcpy(&id, p, sizeof(id));
+	struct shape *s = (struct shape *)ATOM_LOAD(&S.id[id]);
+	if (s == NULL) {
+		luaL_error(L, "Invalid serialize shape %d", (int)id);
+	}
+	luaL_checkstack(L, LUA_MINSTACK, NULL);
+	if (rb->shape_cache == 0) {
+		// 每个 lua 虚拟机缓存 shape 的 key 字符串，放在参数后面（unpack 只用负数索引）
+		if (lua_getfield(L, LUA_REGISTRYINDEX, "SKYNET_SHAPE") != LUA_TTABLE) {
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_pushvalue(L, -1);
+			lua_setfield(L, LUA_REGISTRYINDEX, "SKYNET_SHAPE");
+		}
+		lua_insert(L, 2);
+		rb->shape_cache = 2;
+	}
+	int i;
+	if (lua_rawgeti(L, rb->shape_cache, id) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_createtable(L, s->n, 0);
+		for (i=0;i<s->n;i++) {
+			lua_pushlstring(L, s->key[i], s->len[i]);
+			lua_rawseti(L, -2, i+1);
+		}
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, rb->shape_cache, id);
+	}
+	lua_createtable(L, 0, s->n);
+	for (i=0;i<s->n;i++) {
+		lua_rawgeti(L, -2, i+1);
+		unpack_one(L, rb);
+		lua_rawset(L, -3);
+	}
+	lua_remove(L, -2);
+}
+
 static void
 unpack_one(lua_State *L, struct read_block *rb) {
 	uint8_t type;
@@ -542,21 +803,18 @@ unpack_one(lua_State *L, struct read_block *rb) {
 }
 
 static void
-seri(lua_State *L, struct block *b, int len) {
-	uint8_t * buffer = skynet_malloc(len);
-	uint8_t * ptr = buffer;
-	int sz = len;
-	while(len>0) {
-		if (len >= BLOCK_SIZE) {
-			memcpy(ptr, b->buffer, BLOCK_SIZE);
-			ptr += BLOCK_SIZE;
-			len -= BLOCK_SIZE;
-			b = b->next;
-		} else {
-			memcpy(ptr, b->buffer, len);
-			break;
-		}
+seri(lua_State *L, struct write_block *wb) {
+	int sz = wb->len;
+	void * buffer;
+	if (wb->cap > SCRATCH_KEEP) {
+		// 大消息直接把写缓冲区交出去，省掉一次复制
+		buffer = skynet_realloc(wb->buffer, sz > 0 ? sz : 1);
+		wb->buffer = NULL;
+	} else {
+		buffer = skynet_malloc(sz);
+		memcpy(buffer, wb->buffer, sz);
 	}
+	wb_free(wb);
 	
 	lua_pushlightuserdata(L, buffer);
 	lua_pushinteger(L, sz);
@@ -603,20 +861,26 @@ luaseri_unpack(lua_State *L) {
 
 	// Need not free buffer
 
-	return lua_gettop(L) - 1;
+	return lua_gettop(L) - (rb.shape_cache ? 2 : 1);
 }
 
 LUAMOD_API int
 luaseri_pack(lua_State *L) {
-	struct block temp;
-	temp.next = NULL;
 	struct write_block wb;
-	wb_init(&wb, &temp);
+	wb_init(&wb);
 	pack_from(L,&wb,0);
-	assert(wb.head == &temp);
-	seri(L, &temp, wb.len);
+	seri(L, &wb);
 
-	wb_free(&wb);
+	return 2;
+}
+
+LUAMOD_API int
+luaseri_packshape(lua_State *L) {
+	struct write_block wb;
+	wb_init(&wb);
+	wb.shape = 1;
+	pack_from(L,&wb,0);
+	seri(L, &wb);
 
 	return 2;
 }
@@ -5,5 +5,6 @@
 
 int luaseri_pack(lua_State *L);
 int luaseri_unpack(lua_State *L);
+int luaseri_packshape(lua_State *L);
 
 #endif
@@ -5,6 +5,12 @@
 #include <lualib.h>
 
 #include "lgc.h"
+#include "skynet.h"
+#include "skynet_malloc.h"
+#include "atomic.h"
+#include "lua-seri.h"
+
+#include <string.h>
 
 #ifdef makeshared
 
@@ -240,6 +246,414 @@ matrix_from_file(lua_State *L) {
 	return box_state(L, mL);
 }
 
+/*
+	服务间按引用传递的只读 table（skynet.sendshared/callshared）
+	table 复制到一个独立的虚拟机中并标记为 shared ，每个持有者（一个虚拟机里的所有代理或者发出未处理的消息）占一个引用，
+	引用计数归零时关闭这个虚拟机。只能在同一进程内传递。
+ */
+
+#define SHARED_MAX_DEPTH 32
+// 两次因为共享对象而做的完整 gc 之间至少间隔的时间（1/100 秒）
+#define SHARED_GC_INTERVAL 100
+
+struct shared_object {
+	ATOM_INT ref;
+	lua_State *L;
+	const void *root;
+	int kb;		// 虚拟机占用的内存（KB）
+};
+
+// 进程内还没有关闭的共享对象数量和占用的内存（KB）
+static ATOM_INT shared_count = 0;
+static ATOM_INT shared_kb = 0;
+
+static void copy_table(lua_State *L, lua_State *mL, int index, int depth);
+
+static void
+copy_value(lua_State *L, lua_State *mL, int index, int depth) {
+	switch (lua_type(L, index)) {
+	case LUA_TBOOLEAN:
+		lua_pushboolean(mL, lua_toboolean(L, index));
+		break;
+	case LUA_TNUMBER:
+		if (lua_isinteger(L, index)) {
+			lua_pushinteger(mL, lua_tointeger(L, index));
+		} else {
+			lua_pushnumber(mL, lua_tonumber(L, index));
+		}
+		break;
+	case LUA_TSTRING: {
+		size_t sz;
+		const char * str = lua_tolstring(L, index, &sz);
+		lua_pushlstring(mL, str, sz);
+		break;
+	}
+	case LUA_TLIGHTUSERDATA:
+		lua_pushlightuserdata(mL, lua_touserdata(L, index));
+		break;
+	case LUA_TTABLE:
+		copy_table(L, mL, index, depth + 1);
+		break;
+	default:
+		luaL_error(mL, "Invalid type [%s]", lua_typename(L, lua_type(L, index)));
+		break;
+	}
+}
+
+// 错误都抛在 mL 上（由 share_object 里的 lua_pcall 接住），L 上只做不会出错的操作
+static void
+copy_table(lua_State *L, lua_State *mL, int index, int depth) {
+	if (depth > SHARED_MAX_DEPTH) {
+		luaL_error(mL, "Table is too deep (or has a cycle)");
+	}
+	if (!lua_checkstack(L, 3)) {
+		luaL_error(mL, "Stack overflow");
+	}
+	luaL_checkstack(mL, 4, NULL);
+	if (lua_getmetatable(L, index)) {
+		lua_pop(L, 1);
+		luaL_error(mL, "Can't share metatable");
+	}
+	lua_createtable(mL, (int)lua_rawlen(L, index), 0);
+	lua_pushnil(L);
+	while (lua_next(L, index) != 0) {
+		int top = lua_gettop(L);
+		copy_value(L, mL, top - 1, depth);
+		copy_value(L, mL, top, depth);
+		lua_rawset(mL, -3);
+		lua_pop(L, 1);
+	}
+}
+
+static int
+load_shared(lua_State *mL) {
+	lua_State *L = (lua_State *)lua_touserdata(mL, 1);
+	// 和 make_matrix 一样，标记为 shared 的对象不能再被 gc 扫描
+	lua_gc(mL, LUA_GCSTOP, 0);
+	copy_table(L, mL, 1, 0);
+	mark_shared(mL);
+	return 1;
+}
+
+static void
+shared_release(struct shared_object *obj) {
+	if (ATOM_FDEC(&obj->ref) == 1) {
+		ATOM_FDEC(&shared_count);
+		ATOM_FSUB(&shared_kb, obj->kb);
+		lua_close(obj->L);
+		skynet_free(obj);
+	}
+}
+
+static int
+shared_gc(lua_State *L) {
+	struct shared_object **h = (struct shared_object **)luaL_checkudata(L, 1, "SKYNETSHAREDOBJECT");
+	if (*h) {
+		shared_release(*h);
+		*h = NULL;
+	}
+	return 0;
+}
+
+/*
+	代理是 userdata ，读到的字符串复制一份放到调用者的虚拟机里，子 table 也包装成代理，
+	共享虚拟机里的对象不会直接落到调用者手上，所以代理都被回收后可以安全地关闭共享虚拟机。
+	每个代理的 user value 是持有引用的 SKYNETSHAREDOBJECT ，子 table 的代理每次访问时新建，不做缓存。
+ */
+#define SHARED_PROXY "SKYNETSHAREDPROXY"
+
+struct shared_proxy {
+	struct shared_object *obj;
+	const void *tbl;
+};
+
+static void
+proxy_table(lua_State *L, int proxy, const void *tbl) {
+	struct shared_proxy *p = (struct shared_proxy *)lua_touserdata(L, proxy);
+	struct shared_proxy *np = (struct shared_proxy *)lua_newuserdatauv(L, sizeof(*np), 1);
+	np->obj = p->obj;
+	np->tbl = tbl;
+	lua_getiuservalue(L, proxy, 1);
+	lua_setiuservalue(L, -2, 1);
+	luaL_setmetatable(L, SHARED_PROXY);
+}
+
+// 把共享虚拟机里的值转换成调用者自己的值压栈
+static void
+proxy_value(lua_State *L, int proxy, int index) {
+	switch (lua_type(L, index)) {
+	case LUA_TSTRING: {
+		size_t sz;
+		const char * str = lua_tolstring(L, index, &sz);
+		lua_pushlstring(L, str, sz);
+		break;
+	}
+	case LUA_TTABLE:
+		proxy_table(L, proxy, lua_topointer(L, index));
+		break;
+	default:
+		lua_pushvalue(L, index);
+		break;
+	}
+}
+
+static int
+proxy_index(lua_State *L) {
+	struct shared_proxy *p = (struct shared_proxy *)lua_touserdata(L, 1);
+	lua_settop(L, 2);
+	lua_clonetable(L, p->tbl);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, 3);
+	proxy_value(L, 1, 4);
+	return 1;
+}
+
+static int
+proxy_len(lua_State *L) {
+	struct shared_proxy *p = (struct shared_proxy *)lua_touserdata(L, 1);
+	lua_clonetable(L, p->tbl);
+	lua_pushinteger(L, (lua_Integer)lua_rawlen(L, -1));
+	return 1;
+}
+
+static int
+proxy_next(lua_State *L) {
+	struct shared_proxy *p = (struct shared_proxy *)luaL_checkudata(L, 1, SHARED_PROXY);
+	lua_settop(L, 2);
+	lua_clonetable(L, p->tbl);
+	lua_pushvalue(L, 2);
+	if (lua_next(L, 3) == 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+	proxy_value(L, 1, 4);
+	proxy_value(L, 1, 5);
+	return 2;
+}
+
+static int
+proxy_pairs(lua_State *L) {
+	lua_pushcfunction(L, proxy_next);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+static int
+proxy_readonly(lua_State *L) {
+	return luaL_error(L, "Shared object is read-only");
+}
+
+/*
+	共享对象的内存不算在持有者的虚拟机里，gc 不会因为它们而加快。
+	累计拿到的共享对象大小，超过虚拟机自身的内存时做一次完整的 gc ，让不再引用的代理及时释放。
+	内存很小的服务不停地收到大对象时，完整的 gc 最多 SHARED_GC_INTERVAL 做一次
+ */
+static int shared_debt_key = 0;
+
+struct shared_debt {
+	lua_Integer kb;
+	uint64_t last;
+};
+
+static void
+shared_debt(lua_State *L, int kb) {
+	struct shared_debt *d;
+	if (lua_rawgetp(L, LUA_REGISTRYINDEX, &shared_debt_key) == LUA_TUSERDATA) {
+		d = (struct shared_debt *)lua_touserdata(L, -1);
+	} else {
+		d = (struct shared_debt *)lua_newuserdatauv(L, sizeof(*d), 0);
+		d->kb = 0;
+		d->last = 0;
+		lua_pushvalue(L, -1);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &shared_debt_key);
+		lua_replace(L, -2);
+	}
+	lua_pop(L, 1);
+	d->kb += kb;
+	if (d->kb > lua_gc(L, LUA_GCCOUNT, 0)) {
+		uint64_t now = skynet_now();
+		if (now - d->last >= SHARED_GC_INTERVAL) {
+			d->kb = 0;
+			d->last = now;
+			lua_gc(L, LUA_GCCOLLECT, 0);
+		}
+	}
+}
+
+// 为一个引用创建根代理，引用归代理所有
+static int
+shared_proxy(lua_State *L, struct shared_object *obj) {
+	luaL_checkstack(L, 6, NULL);
+	shared_debt(L, obj->kb);
+	struct shared_object **h = (struct shared_object **)lua_newuserdatauv(L, sizeof(*h), 0);
+	*h = obj;
+	if (luaL_newmetatable(L, "SKYNETSHAREDOBJECT")) {
+		lua_pushcfunction(L, shared_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	struct shared_proxy *p = (struct shared_proxy *)lua_newuserdatauv(L, sizeof(*p), 1);
+	p->obj = obj;
+	p->tbl = obj->root;
+	lua_pushvalue(L, -2);
+	lua_setiuservalue(L, -2, 1);
+	if (luaL_newmetatable(L, SHARED_PROXY)) {
+		luaL_Reg l[] = {
+			{ "__index", proxy_index },
+			{ "__len", proxy_len },
+			{ "__pairs", proxy_pairs },
+			{ "__newindex", proxy_readonly },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+	}
+	lua_setmetatable(L, -2);
+	lua_replace(L, -2);
+	return 1;
+}
+
+// 只有根代理可以发送
+static struct shared_object *
+shared_check(lua_State *L, int index) {
+	struct shared_proxy *p = (struct shared_proxy *)luaL_testudata(L, index, SHARED_PROXY);
+	if (p == NULL || p->tbl != p->obj->root) {
+		return NULL;
+	}
+	return p->obj;
+}
+
+static int
+share_object(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+	lua_State *mL = luaL_newstate();
+	if (mL == NULL) {
+		return luaL_error(L, "luaL_newstate failed");
+	}
+	lua_pushcfunction(mL, load_shared);
+	lua_pushlightuserdata(mL, L);
+	if (lua_pcall(mL, 1, 1, 0) != LUA_OK) {
+		lua_settop(L, 1);
+		lua_pushstring(L, lua_tostring(mL, -1));
+		lua_close(mL);
+		return lua_error(L);
+	}
+	struct shared_object *obj = (struct shared_object *)skynet_malloc(sizeof(*obj));
+	ATOM_INIT(&obj->ref, 1);
+	obj->L = mL;
+	obj->root = lua_topointer(mL, 1);
+	obj->kb = lua_gc(mL, LUA_GCCOUNT, 0);
+	ATOM_FINC(&shared_count);
+	ATOM_FADD(&shared_kb, obj->kb);
+	return shared_proxy(L, obj);
+}
+
+/*
+	PTYPE_SHARED 消息的格式：头部是消息持有的引用 { n, obj[1..n] }（按指针大小对齐），后面是 skynet.pack 打包的参数，
+	参数中的共享对象打包成指针（lightuserdata）。接收方解包时取走引用并清空头部对应的位置；
+	消息没有被处理（目标服务已经退出、不是 lua 服务、发送失败）时，框架释放消息前调用 shared_free 释放剩下的引用。
+ */
+static void
+shared_free(void *msg, size_t sz) {
+	uintptr_t *h = (uintptr_t *)msg;
+	if (sz < sizeof(uintptr_t) || sz < (h[0] + 1) * sizeof(uintptr_t))
+		return;
+	uintptr_t i;
+	for (i=1;i<=h[0];i++) {
+		if (h[i]) {
+			shared_release((struct shared_object *)h[i]);
+			h[i] = 0;
+		}
+	}
+}
+
+// 打包 sendshared/callshared 的参数，userdata 只能是共享对象的根代理，为消息各加一个引用
+static int
+pack_objects(lua_State *L) {
+	int n = lua_gettop(L);
+	int i, count = 0;
+	for (i=1;i<=n;i++) {
+		if (lua_type(L, i) == LUA_TUSERDATA) {
+			if (shared_check(L, i) == NULL) {
+				return luaL_error(L, "Only the root of a shared object can be sent");
+			}
+			++count;
+		}
+	}
+	luaL_checkstack(L, 3, NULL);
+	size_t hsz = (count + 1) * sizeof(uintptr_t);
+	uintptr_t *h = (uintptr_t *)lua_newuserdatauv(L, hsz, 0);
+	lua_insert(L, 1);
+	h[0] = count;
+	count = 0;
+	for (i=2;i<=n+1;i++) {
+		if (lua_type(L, i) == LUA_TUSERDATA) {
+			struct shared_object *obj = shared_check(L, i);
+			h[++count] = (uintptr_t)obj;
+			lua_pushlightuserdata(L, obj);
+			lua_replace(L, i);
+		}
+	}
+	lua_pushcfunction(L, luaseri_pack);
+	lua_insert(L, 2);
+	lua_call(L, n, 2);
+	// 打包成功后才加引用，调用者的参数在这期间一直引用着这些对象
+	void *payload = lua_touserdata(L, 2);
+	size_t psz = (size_t)lua_tointeger(L, 3);
+	char *msg = (char *)skynet_malloc(hsz + psz);
+	memcpy(msg, h, hsz);
+	memcpy(msg + hsz, payload, psz);
+	skynet_free(payload);
+	for (i=1;i<=count;i++) {
+		ATOM_FINC(&((struct shared_object *)h[i])->ref);
+	}
+	lua_pushlightuserdata(L, msg);
+	lua_pushinteger(L, (lua_Integer)(hsz + psz));
+	return 2;
+}
+
+// 解包 PTYPE_SHARED 消息，把头部登记过的指针换成代理，消息的引用转给代理
+static int
+unpack_objects(lua_State *L) {
+	uintptr_t *h = (uintptr_t *)lua_touserdata(L, 1);
+	size_t sz = (size_t)luaL_checkinteger(L, 2);
+	if (h == NULL || sz < sizeof(uintptr_t) || sz < (h[0] + 1) * sizeof(uintptr_t)) {
+		return luaL_error(L, "Invalid shared message");
+	}
+	uintptr_t n = h[0];
+	size_t hsz = (n + 1) * sizeof(uintptr_t);
+	lua_settop(L, 0);
+	lua_pushcfunction(L, luaseri_unpack);
+	lua_pushlightuserdata(L, (char *)h + hsz);
+	lua_pushinteger(L, (lua_Integer)(sz - hsz));
+	lua_call(L, 2, LUA_MULTRET);
+	int top = lua_gettop(L);
+	int i;
+	for (i=1;i<=top;i++) {
+		if (lua_type(L, i) == LUA_TLIGHTUSERDATA) {
+			uintptr_t p = (uintptr_t)lua_touserdata(L, i);
+			uintptr_t j;
+			for (j=1;j<=n;j++) {
+				if (h[j] == p) {
+					h[j] = 0;
+					shared_proxy(L, (struct shared_object *)p);
+					lua_replace(L, i);
+					break;
+				}
+			}
+		}
+	}
+	return top;
+}
+
+static int
+shared_info(lua_State *L) {
+	lua_pushinteger(L, ATOM_LOAD(&shared_count));
+	lua_pushinteger(L, ATOM_LOAD(&shared_kb));
+	return 2;
+}
+
 LUAMOD_API int
 luaopen_skynet_sharetable_core(lua_State *L) {
 	luaL_checkversion(L);
@@ -248,8 +662,14 @@ luaopen_skynet_sharetable_core(lua_State *L) {
 		{ "stackvalues", lco_stackvalues }, 
 		{ "matrix", matrix_from_file },
 		{ "is_sharedtable", lis_sharedtable },
+		{ "share", share_object },
+		{ "pack", pack_objects },
+		{ "unpack", unpack_objects },
+		{ "info", shared_info },
 		{ NULL, NULL },
 	};
+	// 只有发送者会创建 PTYPE_SHARED 消息，发送前一定已经加载了这个模块
+	skynet_free_hook(PTYPE_RESERVED_SHARED, shared_free);
 	luaL_newlib(L, l);
 	return 1;
 }
@@ -233,6 +233,34 @@ lgenid(lua_State *L) {
 	return 1;
 }
 
+/// @brief 注册一个可以取消的定时器 c.timeout(ti [, ms])，ms 为 true 时 ti 的单位是毫秒
+/// @return session, timer id（立即到期时 id 为 0）
+static int
+ltimeout(lua_State *L) {
+	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
+	int ti = (int)luaL_checkinteger(L, 1);
+	int session;
+	int64_t id;
+	if (lua_toboolean(L, 2)) {
+		id = skynet_settimeout_ms(context, ti, &session);
+	} else {
+		id = skynet_settimeout(context, ti, &session);
+	}
+	lua_pushinteger(L, session);
+	lua_pushinteger(L, id);
+	return 2;
+}
+
+/// @brief 取消 c.timeout 注册的定时器 c.canceltimeout(id)
+/// @return true 表示定时器在到期前被取消，对应的 session 不会再收到回应
+static int
+lcanceltimeout(lua_State *L) {
+	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
+	int64_t id = (int64_t)luaL_checkinteger(L, 1);
+	lua_pushboolean(L, skynet_canceltimeout(context, id));
+	return 1;
+}
+
 static const char *
 get_dest_string(lua_State *L, int index) {
 	const char * dest_string = lua_tostring(L, index);
@@ -334,6 +362,63 @@ lredirect(lua_State *L) {
 	return send_message(L, source, 3);
 }
 
+/*
+	table addresses (array of uint32 address)
+	integer source_address (0 for self)
+	integer type
+	integer session
+	string message
+	 lightuserdata message_ptr
+	 integer len
+ */
+static int
+lsendbatch(lua_State *L) {
+	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
+	luaL_checktype(L, 1, LUA_TTABLE);
+	uint32_t source = (uint32_t)luaL_checkinteger(L, 2);
+	int type = luaL_checkinteger(L, 3);
+	int session = luaL_checkinteger(L, 4);
+	int n = lua_rawlen(L, 1);
+	uint32_t * dest = (uint32_t *)lua_newuserdatauv(L, n * sizeof(uint32_t), 0);
+	int i;
+	for (i=0;i<n;i++) {
+		lua_rawgeti(L, 1, i+1);
+		int isnum;
+		dest[i] = (uint32_t)lua_tointegerx(L, -1, &isnum);
+		if (!isnum || dest[i] == 0) {
+			return luaL_error(L, "Invalid service address at [%d]", i+1);
+		}
+		lua_pop(L, 1);
+	}
+	int r;
+	switch (lua_type(L, 5)) {
+	case LUA_TSTRING: {
+		size_t len = 0;
+		void * msg = (void *)lua_tolstring(L, 5, &len);
+		if (len == 0) {
+			msg = NULL;
+		}
+		r = skynet_send_batch(context, source, dest, n, type, session, msg, len);
+		break;
+	}
+	case LUA_TLIGHTUSERDATA: {
+		void * msg = lua_touserdata(L, 5);
+		int size = luaL_checkinteger(L, 6);
+		r = skynet_send_batch(context, source, dest, n, type | PTYPE_TAG_DONTCOPY, session, msg, size);
+		break;
+	}
+	default:
+		return luaL_error(L, "invalid param %s", lua_typename(L, lua_type(L,5)));
+	}
+	if (r < 0) {
+		// package is too large, or the message holds references and can't be copied
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	lua_pushinteger(L, r);
+	return 1;
+}
+
 static int
 lerror(lua_State *L) {
 	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
@@ -502,7 +587,10 @@ luaopen_skynet_core(lua_State *L) {
 	luaL_Reg l[] = {
 		{ "send" , lsend },
 		{ "genid", lgenid },
+		{ "timeout", ltimeout },
+		{ "canceltimeout", lcanceltimeout },
 		{ "redirect", lredirect },
+		{ "sendbatch", lsendbatch },
 		{ "command" , lcommand },
 		{ "intcommand", lintcommand },
 		{ "addresscommand", laddresscommand },
@@ -518,6 +606,7 @@ luaopen_skynet_core(lua_State *L) {
 		{ "tostring", ltostring },
 		{ "pack", luaseri_pack },
 		{ "unpack", luaseri_unpack },
+		{ "packshape", luaseri_packshape },
 		{ "packstring", lpackstring },
 		{ "trash" , ltrash },
 		{ "now", lnow },
@@ -16,6 +16,9 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include "skynet.h"
 #include "skynet_socket.h"
@@ -164,7 +167,8 @@ return_free_node(lua_State *L, int pool, struct socket_buffer *sb) {
 	lua_rawgeti(L,pool,1);
 	free_node->next = lua_touserdata(L,-1);
 	lua_pop(L,1);
-	skynet_free(free_node->msg);
+	// 数据缓冲区放回 socket 线程的读缓冲区缓存池
+	skynet_socket_free_buffer(free_node->msg, free_node->sz);
 	free_node->msg = NULL;
 
 	free_node->sz = 0;
@@ -487,8 +491,9 @@ llisten(lua_State *L) {
 	const char * host = luaL_checkstring(L,1);
 	int port = luaL_checkinteger(L,2);
 	int backlog = luaL_optinteger(L,3,BACKLOG);
+	int reuseport = lua_toboolean(L,4);	// 每个 socket 线程一个 SO_REUSEPORT 监听套接字
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
-	int id = skynet_socket_listen(ctx, host,port,backlog);
+	int id = reuseport ? skynet_socket_listen_reuseport(ctx, host, port, backlog) : skynet_socket_listen(ctx, host,port,backlog);
 	if (id < 0) {
 		return luaL_error(L, "Listen error");
 	}
@@ -602,6 +607,44 @@ lsendlow(lua_State *L) {
 	return 1;
 }
 
+/*
+	integer id
+	string filename / integer fd
+	integer offset (default 0)
+	integer size (default to the end of file)
+ */
+static int
+lsendfile(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	// 先检查完所有参数再打开文件，参数错误抛出异常时不会泄漏 fd
+	int isfd = lua_type(L, 2) == LUA_TNUMBER;
+	lua_Integer src = 0;
+	const char * filename = NULL;
+	if (isfd) {
+		src = luaL_checkinteger(L, 2);
+	} else {
+		filename = luaL_checkstring(L, 2);
+	}
+	lua_Integer offset = luaL_optinteger(L, 3, 0);
+	lua_Integer sz = luaL_optinteger(L, 4, -1);
+	int fd;
+	if (isfd) {
+		// 调用者的 fd 仍由调用者关闭，socket 线程使用复制出来的 fd
+		fd = dup((int)src);
+	} else {
+		fd = open(filename, O_RDONLY | O_CLOEXEC);
+	}
+	if (fd < 0) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	int err = skynet_socket_sendfile(ctx, id, fd, offset, sz);
+	lua_pushboolean(L, !err);
+	return 1;
+}
+
 static int
 lbind(lua_State *L) {
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
@@ -635,6 +678,24 @@ lnodelay(lua_State *L) {
 	return 0;
 }
 
+static int
+lwatermark(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	lua_Integer high = luaL_optinteger(L, 2, 0);
+	lua_Integer low = luaL_optinteger(L, 3, high / 2);
+	skynet_socket_watermark(ctx, id, high, low);
+	return 0;
+}
+
+static int
+loverflow(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	lua_pushboolean(L, skynet_socket_overflow(ctx, id));
+	return 1;
+}
+
 static int
 ludp(lua_State *L) {
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
@@ -764,6 +825,14 @@ getinfo(lua_State *L, struct socket_info *si) {
 	lua_setfield(L, -2, "rtime");
 	lua_pushinteger(L, si->wtime);
 	lua_setfield(L, -2, "wtime");
+	lua_pushinteger(L, si->wcall);
+	lua_setfield(L, -2, "wcall");
+	lua_pushinteger(L, si->wbuf);
+	lua_setfield(L, -2, "wbuf");
+	lua_pushinteger(L, si->rhit);
+	lua_setfield(L, -2, "rhit");
+	lua_pushinteger(L, si->rmiss);
+	lua_setfield(L, -2, "rmiss");
 	lua_pushboolean(L, si->reading);
 	lua_setfield(L, -2, "reading");
 	lua_pushboolean(L, si->writing);
@@ -843,10 +912,13 @@ luaopen_skynet_socketdriver(lua_State *L) {
 		{ "listen", llisten },
 		{ "send", lsend },
 		{ "lsend", lsendlow },
+		{ "sendfile", lsendfile },
 		{ "bind", lbind },
 		{ "start", lstart },
 		{ "pause", lpause },
 		{ "nodelay", lnodelay },
+		{ "watermark", lwatermark },
+		{ "overflow", loverflow },
 		{ "udp", ludp },
 		{ "udp_connect", ludp_connect },
 		{ "udp_send", ludp_send },
@@ -43,6 +43,7 @@ local skynet = {
 	PTYPE_LUA = 10,
 	PTYPE_SNAX = 11,
 	PTYPE_TRACE = 12,	-- use for debug trace
+	PTYPE_SHARED = 13,	-- skynet.sendshared/callshared ，按引用传递只读 table
 }
 
 -- code cache
@@ -66,6 +67,17 @@ local unresponse = {}
 
 local wakeup_queue = {}
 local sleep_session = {}
+local timer_session = {}	-- session -> timer id , for cancel the timer in core
+
+-- remove the timer of session in core, return true if it's removed before timeout (no response will come)
+local function cancel_timer(session)
+	local id = timer_session[session]
+	if id then
+		timer_session[session] = nil
+		return c.canceltimeout(id)
+	end
+	return false
+end
 
 local watching_session = {}
 local error_queue = {}
@@ -106,6 +118,7 @@ do ---- request/select
 		while true do
 			local succ, msg, sz, session = coroutine_yield "SUSPEND"
 			if session == self._timeout then
+				timer_session[session] = nil
 				self._timeout = nil
 				self.timeout = true
 			else
@@ -177,7 +190,11 @@ do ---- request/select
 			self._request = 0
 		end
 		if self._timeout then
-			session_id_coroutine[self._timeout] = "BREAK"
+			if cancel_timer(self._timeout) then
+				session_id_coroutine[self._timeout] = nil
+			else
+				session_id_coroutine[self._timeout] = "BREAK"
+			end
 			self._timeout = nil
 		end
 	end
@@ -190,7 +207,9 @@ do ---- request/select
 		self._error = send_requests(self)
 		self._resp = {}
 		if timeout then
-			self._timeout = c.intcommand("TIMEOUT",timeout)
+			local session, id = c.timeout(timeout)
+			self._timeout = session
+			timer_session[session] = id
 			session_id_coroutine[self._timeout] = self._thread
 		end
 
@@ -301,7 +320,12 @@ local function dispatch_wakeup()
 				local co = session_id_coroutine[session]
 				local tag = session_coroutine_tracetag[co]
 				if tag then c.trace(tag, "resume") end
-				session_id_coroutine[session] = "BREAK"
+				if cancel_timer(session) then
+					-- the timer is removed, no response will come
+					session_id_coroutine[session] = nil
+				else
+					session_id_coroutine[session] = "BREAK"
+				end
 				return suspend(co, coroutine_resume(co, false, "BREAK", nil, session))
 			end
 		else
@@ -383,6 +407,15 @@ function skynet.timeout(ti, func)
 	return co	-- for debug
 end
 
+-- 时间单位为毫秒，timer_resolution 不是 "ms" 时向上取整到 centisecond
+function skynet.timeout_ms(ms, func)
+	local session = c.timeout(ms, true)
+	local co = co_create_for_timeout(func, ms)
+	assert(session_id_coroutine[session] == nil)
+	session_id_coroutine[session] = co
+	return co	-- for debug
+end
+
 local function suspend_sleep(session, token)
 	local tag = session_coroutine_tracetag[running_thread]
 	if tag then c.trace(tag, "sleep", 2) end
@@ -393,12 +426,14 @@ local function suspend_sleep(session, token)
 	return coroutine_yield "SUSPEND"
 end
 
-function skynet.sleep(ti, token)
-	local session = c.intcommand("TIMEOUT",ti)
-	assert(session)
+local function sleep_session_timer(session, id, token)
+	if id ~= 0 then
+		timer_session[session] = id
+	end
 	token = token or coroutine.running()
 	local succ, ret = suspend_sleep(session, token)
 	sleep_session[token] = nil
+	timer_session[session] = nil
 	if succ then
 		return
 	end
@@ -409,6 +444,17 @@ function skynet.sleep(ti, token)
 	end
 end
 
+function skynet.sleep(ti, token)
+	local session, id = c.timeout(ti)
+	return sleep_session_timer(session, id, token)
+end
+
+-- 时间单位为毫秒，timer_resolution 不是 "ms" 时向上取整到 centisecond
+function skynet.sleep_ms(ms, token)
+	local session, id = c.timeout(ms, true)
+	return sleep_session_timer(session, id, token)
+end
+
 function skynet.yield()
 	return skynet.sleep(0)
 end
@@ -467,6 +513,7 @@ function skynet.killthread(thread)
 		session_id_coroutine[session] = "BREAK"
 		watching_session[session] = nil
 	else
+		cancel_timer(session)
 		session_id_coroutine[session] = nil
 	end
 	for k,v in pairs(sleep_session) do
@@ -583,17 +630,29 @@ function skynet.rawsend(addr, typename, msg, sz)
 	return c.send(addr, p.id, 0 , msg, sz)
 end
 
+-- 把同一条消息发给一组服务（addrs 为地址数组），返回成功投递的数量
+function skynet.send_batch(addrs, typename, ...)
+	local p = proto[typename]
+	return c.sendbatch(addrs, 0, p.id, 0, p.pack(...))
+end
+
 skynet.genid = assert(c.genid)
 
 skynet.redirect = function(dest,source,typename,...)
 	return c.redirect(dest, source, proto[typename].id, ...)
 end
 
+skynet.redirect_batch = function(addrs,source,typename,...)
+	return c.sendbatch(addrs, source, proto[typename].id, ...)
+end
+
 skynet.pack = assert(c.pack)				-- 数据打包，lua table -> 二进制数据
 skynet.packstring = assert(c.packstring)
 skynet.unpack = assert(c.unpack)			-- 数据解包，二进制数据 -> lua table
 skynet.tostring = assert(c.tostring)
 skynet.trash = assert(c.trash)
+-- 字符串 key 的 table 只写 shape id 和 value ，key 集合登记在进程内，所以结果不能发到其它进程（harbor 远程地址、落盘等）
+skynet.packshape = assert(c.packshape)
 
 local function yield_call(service, session)
 	watching_session[session] = service
@@ -623,6 +682,90 @@ function skynet.call(addr, typename, ...)
 	return p.unpack(yield_call(addr, session))
 end
 
+-- 按 lua 协议发送，本进程内的地址用 packshape 打包，harbor 远程地址和全局名字退回 skynet.pack
+-- cluster 代理这类把消息原样转发到其它进程的服务不能作为目标
+local function shape_pack(addr, ...)
+	if type(addr) == "number" then
+		local _, remote = c.harbor(addr)
+		if remote then
+			return skynet.pack(...)
+		end
+	elseif addr:byte(1) ~= 46 then	-- '.'
+		return skynet.pack(...)
+	end
+	return skynet.packshape(...)
+end
+
+function skynet.sendshape(addr, ...)
+	return c.send(addr, skynet.PTYPE_LUA, 0, shape_pack(addr, ...))
+end
+
+function skynet.callshape(addr, ...)
+	local tag = session_coroutine_tracetag[running_thread]
+	if tag then
+		c.trace(tag, "call", 2)
+		c.send(addr, skynet.PTYPE_TRACE, 0, tag)
+	end
+	local session = c.send(addr, skynet.PTYPE_LUA, nil, shape_pack(addr, ...))
+	if session == nil then
+		error("call to invalid address " .. skynet.address(addr))
+	end
+	return skynet.unpack(yield_call(addr, session))
+end
+
+----- shared object
+-- skynet.shared(t) 把 t 复制成一个只读的共享对象（只复制一次），返回代理（userdata ，支持索引、# 和 pairs）
+-- 通过代理读到的字符串是复制出来的，子 table 也是代理，所以可以随意保存
+-- skynet.sendshared/callshared 的参数中的共享对象只传引用，其它参数按 lua 协议打包，只能发给本进程内的服务
+-- 接收方默认用 lua 协议的 dispatch 处理
+local shared_core
+
+local function shared_init()
+	shared_core = shared_core or require "skynet.sharetable.core"
+	return shared_core
+end
+
+function skynet.shared(t)
+	return shared_init().share(t)
+end
+
+-- 返回进程内还没有释放的共享对象数量和占用的内存（KB）
+function skynet.sharedinfo()
+	return shared_init().info()
+end
+
+-- 消息持有的引用由消息自己释放：没有被处理的消息（目标已经退出、不是 lua 服务、发送失败）由框架在释放消息时一起释放
+local function shared_pack(addr, ...)
+	if type(addr) == "number" then
+		local _, remote = c.harbor(addr)
+		assert(not remote, "Can't send shared object to remote service")
+	else
+		assert(type(addr) == "string" and addr:byte(1) == 46, "Can't send shared object to global name")	-- '.'
+	end
+	return shared_init().pack(...)
+end
+
+local function shared_unpack(msg, sz)
+	return shared_init().unpack(msg, sz)
+end
+
+function skynet.sendshared(addr, ...)
+	return c.send(addr, skynet.PTYPE_SHARED, 0, shared_pack(addr, ...))
+end
+
+function skynet.callshared(addr, ...)
+	local tag = session_coroutine_tracetag[running_thread]
+	if tag then
+		c.trace(tag, "call", 2)
+		c.send(addr, skynet.PTYPE_TRACE, 0, tag)
+	end
+	local session = c.send(addr, skynet.PTYPE_SHARED, nil, shared_pack(addr, ...))
+	if not session then
+		error("call to invalid address " .. skynet.address(addr))
+	end
+	return skynet.unpack(yield_call(addr, session))
+end
+
 function skynet.rawcall(addr, typename, msg, sz)
 	local tag = session_coroutine_tracetag[running_thread]
 	if tag then
@@ -945,6 +1088,19 @@ do
 		id = skynet.PTYPE_RESPONSE,
 	}
 
+	REG {
+		name = "shared",
+		id = skynet.PTYPE_SHARED,
+		unpack = shared_unpack,
+		dispatch = function(...)
+			local f = proto["lua"].dispatch
+			if f == nil then
+				error "No lua dispatch for shared message"
+			end
+			return f(...)
+		end,
+	}
+
 	REG {
 		name = "error",
 		id = skynet.PTYPE_ERROR,
@@ -995,6 +1151,14 @@ function skynet.stat(what)
 	return c.intcommand("STAT", what)
 end
 
+-- level : "high", "normal" or "low" ; nil for query
+function skynet.priority(level)
+	if level == nil then
+		return c.command "PRIORITY"
+	end
+	return (assert(c.command("PRIORITY", level), "Invalid priority"))
+end
+
 function skynet.task(ret)
 	if ret == nil then
 		local t = 0
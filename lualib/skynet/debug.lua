@@ -41,6 +41,7 @@ local function init(skynet, export)
 			stat.mqlen = skynet.stat "mqlen"
 			stat.cpu = skynet.stat "cpu"
 			stat.message = skynet.stat "message"
+			stat.priority = skynet.priority()
 			skynet.ret(skynet.pack(stat))
 		end
 
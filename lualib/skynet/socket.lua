@@ -27,6 +27,17 @@ local function wakeup(s)
 	end
 end
 
+-- wakeup the coroutines blocked in socket.write by the write watermark
+local function wakeup_writer(s)
+	local writer = s.writer
+	if writer then
+		s.writer = nil
+		for _, co in ipairs(writer) do
+			skynet.wakeup(co)
+		end
+	end
+end
+
 local function pause_socket(s, size)
 	if s.pause ~= nil then
 		return
@@ -125,6 +136,7 @@ socket_message[3] = function(id)
 	if s then
 		s.connected = false
 		wakeup(s)
+		wakeup_writer(s)
 	else
 		driver.close(id)
 	end
@@ -166,6 +178,7 @@ socket_message[5] = function(id, _, err)
 	driver.shutdown(id)
 
 	wakeup(s)
+	wakeup_writer(s)
 end
 
 -- SKYNET_SOCKET_TYPE_UDP = 6
@@ -193,6 +206,13 @@ end
 socket_message[7] = function(id, size)
 	local s = socket_pool[id]
 	if s then
+		if s.watermark then
+			-- size > 0 : reach the high watermark, size == 0 : fall to the low watermark
+			s.overflow = size > 0 or nil
+			if not s.overflow then
+				wakeup_writer(s)
+			end
+		end
 		local warning = s.on_warning or default_warning
 		warning(id, size)
 	end
@@ -300,6 +320,7 @@ function socket.close(id)
 		s.connected = false
 	end
 	socket_pool[id] = nil
+	wakeup_writer(s)
 end
 
 function socket.read(id, sz)
@@ -391,8 +412,27 @@ function socket.block(id)
 	return s.connected
 end
 
-socket.write = assert(driver.send)
+local driver_send = assert(driver.send)
+function socket.write(id, ...)
+	local s = socket_pool[id]
+	if s and s.watermark == "block" and (s.overflow or driver.overflow(id)) then
+		-- the write queue reached the high watermark, wait until it falls to the low watermark.
+		-- the SOCKET_WARNING messages may be still in the queue, so ask the socket thread directly.
+		s.overflow = true
+		local co = coroutine.running()
+		local writer = s.writer
+		if writer then
+			writer[#writer+1] = co
+		else
+			s.writer = { co }
+		end
+		skynet.wait(co)
+	end
+	return driver_send(id, ...)
+end
 socket.lwrite = assert(driver.lsend)
+-- socket.sendfile(id, filename_or_fd, offset, size) : the socket thread streams the file, keeping order with socket.write
+socket.sendfile = assert(driver.sendfile)
 socket.header = assert(driver.header)
 
 function socket.invalid(id)
@@ -406,12 +446,13 @@ function socket.disconnected(id)
 	end
 end
 
-function socket.listen(host, port, backlog)
+-- reuseport: open one SO_REUSEPORT listener per socket thread, the kernel spreads new connections among them
+function socket.listen(host, port, backlog, reuseport)
 	if port == nil then
 		host, port = string.match(host, "([^:]+):(.+)$")
 		port = tonumber(port)
 	end
-	local id = driver.listen(host, port, backlog)
+	local id = driver.listen(host, port, backlog, reuseport)
 	local s = {
 		id = id,
 		connected = false,
@@ -482,6 +523,20 @@ function socket.warning(id, callback)
 	obj.on_warning = callback
 end
 
+-- high/low : the watermarks of unsent bytes, high == 0 turns it off. low defaults to high/2
+-- block : socket.write yields between reaching high and falling to low
+function socket.watermark(id, high, low, block)
+	local s = assert(socket_pool[id])
+	if high and high > 0 then
+		s.watermark = block and "block" or true
+	else
+		s.watermark = nil
+		s.overflow = nil
+		wakeup_writer(s)
+	end
+	driver.watermark(id, high or 0, low)
+end
+
 function socket.onclose(id, callback)
 	socket_onclose[id] = callback
 end
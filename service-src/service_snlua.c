@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
+#include <pthread.h>
 
 #if defined(__APPLE__)
 #include <mach/task.h>
@@ -23,6 +24,9 @@
 
 #define MEMORY_WARNING_REPORT (1024 * 1024 * 32)		// 32 MBytes
 
+// 预热池的最大容量（配置项 snlua_pool）
+#define POOL_MAX 1024
+
 // 1.写lua代码
 // 2.lua虚拟机词法分析、生成指令集 .byte
 // 3.lua虚拟机执行指令集
@@ -36,8 +40,24 @@ struct snlua {
 	size_t mem_limit;				// 内存使用上限
 	lua_State * activeL;			// 目前正在运行的状态机（lua 协程）
 	ATOM_INT trap;					// 打断状态（可以接受外部信号打断其运行状态）
+	int warm;						// 已经做完和服务无关的初始化（从预热池中取出）
 }; // lua Actor 隔离环境
 
+/*
+	预热池：预先创建好 lua 虚拟机，打开标准库、装好 profile/codecache 并编译好 loader ，
+	snlua_create （在 launcher 里串行执行）直接取用，launch 时只需要绑定服务并运行 loader 。
+	池子由一个单独的线程在后台补满，取走一个就唤醒它补一个，不占用服务启动的时间。
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;			// 池子不满时唤醒补充线程
+	int size;						// 目标容量，0 表示不使用预热池
+	int n;
+	struct snlua * slot[POOL_MAX];
+} POOL;
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
 // LUA_CACHELIB may defined in patched lua for shared proto
 #ifdef LUA_CACHELIB
 
@@ -55,6 +75,7 @@ codecache(lua_State *L) {
 	luaL_Reg l[] = {
 		{ "clear", cleardummy },
 		{ "mode", cleardummy },
+		{ "info", cleardummy },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L,l);
@@ -389,17 +410,12 @@ optstring(struct skynet_context *ctx, const char *key, const char * str) {
 	return ret;
 }
 
-/// @brief 对 snlua 实例真正进行初始化的函数
-/// @param l 
-/// @param ctx 
-/// @param args 
-/// @param sz 
-/// @return 
+/// @brief 和具体服务无关的初始化（标准库、profile 、codecache 、编译 loader ），预热池里的实例已经做过
+/// @return 成功时栈上留下 traceback 和 loader 函数
 static int
-init_cb(struct snlua *l, struct skynet_context *ctx, const char * args, size_t sz) {
+prepare_state(struct snlua *l, struct skynet_context *ctx) {
 	lua_State *L = l->L;
-	l->ctx = ctx;
-	lua_gc(L, LUA_GCSTOP, 0);		// 停止垃圾回收器
+	lua_gc(L, LUA_GCSTOP, 0);		// 停止垃圾回收器，到 init_cb 结束时再打开
 
 	// 将 lua 状态机的注册表中的 LUA_NOENV 变量 设置为 true （通过将LUA_NOENV设置为true，限制lua代码的访问范围，增加安全性）
 	// 当LUA_NOENV = true时，lua的环境变量将不会被加载，即在执行lua代码时，无法通过环境变量访问到外部的全局变量、函数等。
@@ -425,10 +441,6 @@ init_cb(struct snlua *l, struct skynet_context *ctx, const char * args, size_t s
 	// 移除栈顶table（模块注册信息是保存在全局环境中，这里pop掉，注册的模块仍然生效）
 	lua_settop(L, profile_lib-1);
 
-	// 在 lua 状态机的注册表中新增 skynet_context 变量，其值为C层服务上下文的指针
-	lua_pushlightuserdata(L, ctx);		// 压入轻量级用户数据，服务上下文指针
-	lua_setfield(L, LUA_REGISTRYINDEX, "skynet_context");
-
 	// 加载一个 C 库并将其注册为一个名为 "skynet.codecache" 的 lua 模块
 	luaL_requiref(L, "skynet.codecache", codecache , 0);
 	lua_pop(L,1);
@@ -436,6 +448,104 @@ init_cb(struct snlua *l, struct skynet_context *ctx, const char * args, size_t s
 	// 启动 Lua 的垃圾回收器执行一次增量式垃圾回收，并显式地触发老生代的垃圾回收（参数 `0` 表示对所有对象进行垃圾回收）
 	lua_gc(L, LUA_GCGEN, 0, 0);
 
+	lua_pushcfunction(L, traceback);
+	assert(lua_gettop(L) == 1);
+
+	// 加载 loader.lua 的代码，将其编译成 Lua 函数（loader 的作用是去各项代码目录查找指定的lua文件，找到后 loadfile 并执行(等效于 dofile)）
+	const char * loader = optstring(ctx, "lualoader", "./lualib/loader.lua");
+	int r = luaL_loadfile(L,loader);
+	if (r != LUA_OK) {
+		skynet_error(ctx, "Can't load %s : %s", loader, lua_tostring(L, -1));
+		return 1;
+	}
+	l->warm = 1;
+	return 0;
+}
+
+static struct snlua * snlua_new(void);
+void snlua_release(struct snlua *l);
+
+// 补充线程：把池子补到目标容量后等待，准备虚拟机时不持有锁
+static void *
+pool_thread(void *p) {
+	for (;;) {
+		pthread_mutex_lock(&POOL.lock);
+		while (POOL.n >= POOL.size) {
+			pthread_cond_wait(&POOL.cond, &POOL.lock);
+		}
+		pthread_mutex_unlock(&POOL.lock);
+		struct snlua *l = snlua_new();
+		if (prepare_state(l, NULL)) {
+			// loader 加载失败，之后的服务也会失败，不再预热
+			snlua_release(l);
+			pthread_mutex_lock(&POOL.lock);
+			POOL.size = 0;
+			pthread_mutex_unlock(&POOL.lock);
+			return NULL;
+		}
+		pthread_mutex_lock(&POOL.lock);
+		POOL.slot[POOL.n++] = l;
+		pthread_mutex_unlock(&POOL.lock);
+	}
+	return NULL;
+}
+
+static void
+pool_init(void) {
+	pthread_mutex_init(&POOL.lock, NULL);
+	pthread_cond_init(&POOL.cond, NULL);
+	const char * size = skynet_command(NULL, "GETENV", "snlua_pool");
+	int n = size ? atoi(size) : 0;
+	if (n < 0) {
+		n = 0;
+	} else if (n > POOL_MAX) {
+		n = POOL_MAX;
+	}
+	POOL.size = n;
+	POOL.n = 0;
+	if (n > 0) {
+		pthread_t pid;
+		if (pthread_create(&pid, NULL, pool_thread, NULL)) {
+			skynet_error(NULL, "Create snlua pool thread failed");
+			POOL.size = 0;
+			return;
+		}
+		pthread_detach(pid);
+	}
+}
+
+static struct snlua *
+pool_pop(void) {
+	pthread_once(&pool_once, pool_init);
+	struct snlua *l = NULL;
+	pthread_mutex_lock(&POOL.lock);
+	if (POOL.n > 0) {
+		l = POOL.slot[--POOL.n];
+		pthread_cond_signal(&POOL.cond);
+	}
+	pthread_mutex_unlock(&POOL.lock);
+	return l;
+}
+
+/// @brief 对 snlua 实例真正进行初始化的函数
+/// @param l 
+/// @param ctx 
+/// @param args 
+/// @param sz 
+/// @return 
+static int
+init_cb(struct snlua *l, struct skynet_context *ctx, const char * args, size_t sz) {
+	lua_State *L = l->L;
+	l->ctx = ctx;
+	if (!l->warm && prepare_state(l, ctx)) {
+		report_launcher_error(ctx);
+		return 1;
+	}
+
+	// 在 lua 状态机的注册表中新增 skynet_context 变量，其值为C层服务上下文的指针
+	lua_pushlightuserdata(L, ctx);		// 压入轻量级用户数据，服务上下文指针
+	lua_setfield(L, LUA_REGISTRYINDEX, "skynet_context");
+
 	// 设置相关配置的全局变量
 	const char *path = optstring(ctx, "lua_path","./lualib/?.lua;./lualib/?/init.lua");
 	lua_pushstring(L, path);
@@ -450,21 +560,11 @@ init_cb(struct snlua *l, struct skynet_context *ctx, const char * args, size_t s
 	lua_pushstring(L, preload);
 	lua_setglobal(L, "LUA_PRELOAD");
 
-	lua_pushcfunction(L, traceback);
-	assert(lua_gettop(L) == 1);
-
-	// 加载 loader.lua 的代码，将其编译成 Lua 函数（loader 的作用是去各项代码目录查找指定的lua文件，找到后 loadfile 并执行(等效于 dofile)）
-	const char * loader = optstring(ctx, "lualoader", "./lualib/loader.lua");
-	int r = luaL_loadfile(L,loader);
-	if (r != LUA_OK) {
-		skynet_error(ctx, "Can't load %s : %s", loader, lua_tostring(L, -1));
-		report_launcher_error(ctx);
-		return 1;
-	}
+	assert(lua_gettop(L) == 2);
 
 	// 通过 loader 加载指定的服务文件（args 即要查找并执行的lua文件名，如 "bootstrap"）
 	lua_pushlstring(L, args, sz);
-	r = lua_pcall(L,1,0,1);
+	int r = lua_pcall(L,1,0,1);
 	if (r != LUA_OK) {
 		skynet_error(ctx, "lua loader error : %s", lua_tostring(L, -1));
 		report_launcher_error(ctx);
@@ -547,9 +647,8 @@ lalloc(void * ud, void *ptr, size_t osize, size_t nsize) {
 	return skynet_lalloc(ptr, osize, nsize);
 }
 
-/// @brief 创建 snlua 实例
-struct snlua *
-snlua_create(void) {
+static struct snlua *
+snlua_new(void) {
 	struct snlua * l = skynet_malloc(sizeof(*l));
 	memset(l,0,sizeof(*l));
 	l->mem_report = MEMORY_WARNING_REPORT;
@@ -557,6 +656,17 @@ snlua_create(void) {
 	l->L = lua_newstate(lalloc, l);	// 创建lua虚拟机，生成沙盒环境（使用自定义的内存分配方法）
 	l->activeL = NULL;
 	ATOM_INIT(&l->trap , 0);
+	l->warm = 0;
+	return l;
+}
+
+/// @brief 创建 snlua 实例，预热池里有就直接取用
+struct snlua *
+snlua_create(void) {
+	struct snlua * l = pool_pop();
+	if (l == NULL) {
+		l = snlua_new();
+	}
 	return l;
 }
 
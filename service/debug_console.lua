@@ -146,7 +146,8 @@ function COMMAND.help()
 		gc = "gc : force every lua service do garbage collect",
 		start = "lanuch a new lua service",
 		snax = "lanuch a new snax service",
-		clearcache = "clear lua code cache",
+		clearcache = "clearcache [filename] : clear lua code cache",
+		cacheinfo = "cacheinfo : show lua code cache status",
 		service = "List unique service",
 		task = "task address : show service task detail",
 		uniqtask = "task address : show service unique task detail",
@@ -169,8 +170,12 @@ function COMMAND.help()
 	}
 end
 
-function COMMAND.clearcache()
-	codecache.clear()
+function COMMAND.clearcache(filename)
+	codecache.clear(filename)
+end
+
+function COMMAND.cacheinfo()
+	return codecache.info()
 end
 
 function COMMAND.start(...)
@@ -446,6 +451,9 @@ local function convert_stat(info)
 	info.wbuffer = bytes(info.wbuffer)
 	info.rtime = time(info.rtime)
 	info.wtime = time(info.wtime)
+	if info.wcall and info.wcall > 0 then
+		info.wbatch = string.format("%.2f", info.wbuf / info.wcall)
+	end
 end
 
 function COMMAND.netstat()
@@ -85,10 +85,12 @@ local function publish(c , source, pack, size)
 	end
 	local msg = skynet.tostring(pack, size)	-- copy (pack,size) to a string
 	mc.bind(pack, channel_n[c])	-- mc.bind will free the pack(struct mc_package **)
+	local addrs = {}
 	for k in pairs(group) do
-		-- the msg is a pointer to the real message, publish pointer in local is ok.
-		skynet.redirect(k, source, "multicast", c , msg)
+		addrs[#addrs+1] = k
 	end
+	-- the msg is a pointer to the real message, publish pointer in local is ok.
+	skynet.redirect_batch(addrs, source, "multicast", c , msg)
 end
 
 skynet.register_protocol {
@@ -179,6 +179,24 @@ mallctl_opt(const char* name, int* newval) {
 	return v;
 }
 
+// 创建一个新的 arena ，返回 arena 编号，失败返回 -1
+int
+malloc_create_arena(void) {
+	unsigned arena = 0;
+	size_t len = sizeof(arena);
+	if (je_mallctl("arenas.create", &arena, &len, NULL, 0)) {
+		return -1;
+	}
+	return (int)arena;
+}
+
+// 把当前线程绑定到指定的 arena ，之后本线程的内存分配都来自这个 arena
+int
+malloc_bind_arena(int arena) {
+	unsigned v = (unsigned)arena;
+	return je_mallctl("thread.arena", NULL, NULL, &v, sizeof(v));
+}
+
 // hook : malloc, realloc, free, calloc
 
 void *
@@ -269,6 +287,16 @@ mallctl_cmd(const char* name) {
 	return 0;
 }
 
+int
+malloc_create_arena(void) {
+	return -1;
+}
+
+int
+malloc_bind_arena(int arena) {
+	return -1;
+}
+
 #endif
 
 size_t
@@ -15,6 +15,8 @@ extern int    mallctl_cmd(const char* name);
 extern void   dump_c_mem(void);
 extern int    dump_mem_lua(lua_State *L);
 extern size_t malloc_current_memory(void);
+extern int    malloc_create_arena(void);
+extern int    malloc_bind_arena(int arena);
 
 #endif /* SKYNET_MALLOC_HOOK_H */
 
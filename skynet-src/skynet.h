@@ -20,6 +20,8 @@
 #define PTYPE_RESERVED_DEBUG 9
 #define PTYPE_RESERVED_LUA 10
 #define PTYPE_RESERVED_SNAX 11
+// read lualib/skynet.lua lualib-src/lua-sharetable.c
+#define PTYPE_RESERVED_SHARED 13
 
 #define PTYPE_TAG_DONTCOPY 0x10000
 #define PTYPE_TAG_ALLOCSESSION 0x20000
@@ -29,7 +31,14 @@ struct skynet_context;
 void skynet_error(struct skynet_context * context, const char *msg, ...);
 const char * skynet_command(struct skynet_context * context, const char * cmd , const char * parm);
 uint32_t skynet_queryname(struct skynet_context * context, const char * name);
+// like command TIMEOUT, returns the session in *session and a timer id for skynet_canceltimeout (0 if the response is sent at once)
+int64_t skynet_settimeout(struct skynet_context * context, int time, int * session);
+// like skynet_settimeout, time in millisecond
+int64_t skynet_settimeout_ms(struct skynet_context * context, int ms, int * session);
+// return 1 if the timer is removed before it fires (the response will never come)
+int skynet_canceltimeout(struct skynet_context * context, int64_t id);
 int skynet_send(struct skynet_context * context, uint32_t source, uint32_t destination , int type, int session, void * msg, size_t sz);
+int skynet_send_batch(struct skynet_context * context, uint32_t source, const uint32_t * destination, int n, int type, int session, void * msg, size_t sz);
 int skynet_sendname(struct skynet_context * context, uint32_t source, const char * destination , int type, int session, void * msg, size_t sz);
 
 int skynet_isremote(struct skynet_context *, uint32_t handle, int * harbor);
@@ -37,6 +46,10 @@ int skynet_isremote(struct skynet_context *, uint32_t handle, int * harbor);
 typedef int (*skynet_cb)(struct skynet_context * context, void *ud, int type, int session, uint32_t source , const void * msg, size_t sz);
 void skynet_callback(struct skynet_context * context, void *ud, skynet_cb cb);
 
+// called before the framework frees a delivered message of this type : dropped with the receiver's queue, or not reserved by the callback
+typedef void (*skynet_free_cb)(void * msg, size_t sz);
+void skynet_free_hook(int type, skynet_free_cb cb);
+
 uint32_t skynet_current_handle(void);
 uint64_t skynet_now(void);
 void skynet_debug_memory(const char *info);	// for debug use, output current service memory to stderr
@@ -13,6 +13,18 @@ struct skynet_config {
 	const char * logger;		/* 控制 skynet 内建的 skynet_error 这个 C API 将信息输出到什么位置。如果 logger 配置为 nil ，将输出到标准输出。不为 nil 则输出到指定文件中 */
 	const char * logservice;	/* 默认为 "logger" ，你可以配置为你定制的 log 服务（比如加上时间戳等更多信息）。可以参考 service_logger.c 来实现它。
 	注：如果你希望用 lua 来编写这个服务，可以在这里填写 snlua ，然后在 logger 配置具体的 lua 服务的名字。在 examples 目录下，有 config.userlog 这个范例可供参考 */
+	int spin;					/* worker 线程没有消息可处理时，休眠前自旋重试的次数，默认为 0 */
+	const char * dispatch;		/* 每次调度处理的消息数量策略：默认 "weight" 按 worker 线程的固定权重表；"adaptive" 按队列长度、服务的平均消息耗时和时间片计算（需要开启 profile） */
+	int timeslice;				/* adaptive 策略下每次调度的目标时间片，单位微秒，默认 1000 */
+	int timer_shard;			/* 定时器时间轮的分片数量，服务按 handle 散列到分片上，默认（0）与 worker 线程数相同 */
+	const char * timer_resolution;	/* 定时器精度："cs"（默认，1/100 秒）或 "ms"（1/1000 秒，timeout 的单位仍然是 1/100 秒） */
+	int socket_thread;			/* socket 线程数量，每个线程一个独立的 socket_server 分片，默认 1 */
+	int max_socket;				/* 整个节点的 socket 数量上限，平均分到各个分片，slot 表按需分页分配；默认（0）每个分片 65536 */
+	const char * scheduler;		/* 调度模式：默认 "global" 所有 worker 线程共享一个全局队列；"steal" 每个 worker 线程一个本地队列，空闲时从其他 worker 偷取 */
+	const char * worker_cpu;	/* worker 线程绑定的 cpu 列表，如 "0-7,16-23"，每个 worker 线程依次绑定到其中一个 cpu ，默认不绑定 */
+	const char * socket_cpu;	/* socket 线程绑定的 cpu 列表，默认不绑定 */
+	const char * timer_cpu;		/* timer 线程绑定的 cpu 列表，默认不绑定 */
+	int numa;					/* NUMA 模式：服务优先在创建它的节点上调度，每个节点的线程使用独立的 jemalloc arena（需要 scheduler = "steal"） */
 };
 
 
@@ -163,6 +163,18 @@ main(int argc, char *argv[]) {
 	config.logger = optstring("logger", NULL);
 	config.logservice = optstring("logservice", "logger");
 	config.profile = optboolean("profile", 1);
+	config.scheduler = optstring("scheduler", "global");
+	config.spin = optint("spin", 0);
+	config.dispatch = optstring("dispatch", "weight");
+	config.timeslice = optint("timeslice", 1000);
+	config.timer_shard = optint("timer_shard", 0);
+	config.timer_resolution = optstring("timer_resolution", "cs");
+	config.socket_thread = optint("socket_thread", 1);
+	config.max_socket = optint("max_socket", 0);
+	config.worker_cpu = optstring("worker_cpu", NULL);
+	config.socket_cpu = optstring("socket_cpu", NULL);
+	config.timer_cpu = optstring("timer_cpu", NULL);
+	config.numa = optboolean("numa", 0);
 
 	lua_close(L);	// 配置加载完毕，关闭这个 lua 虚拟机
 
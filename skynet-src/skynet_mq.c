@@ -1,13 +1,17 @@
 #include "skynet.h"
 #include "skynet_mq.h"
 #include "skynet_handle.h"
+#include "skynet_park.h"
 #include "spinlock.h"
+#include "atomic.h"
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <time.h>
 
 #define DEFAULT_QUEUE_SIZE 64	// 
 #define MAX_GLOBAL_MQ 0x10000
@@ -18,70 +22,663 @@
 #define MQ_IN_GLOBAL 1
 #define MQ_OVERLOAD 1024
 
+#ifdef USE_MPSC_QUEUE
+
+#include "atomic.h"
+
+#ifndef atomic_pause_
+#define atomic_pause_() ((void)0)
+#endif
+
+#define MQ_BLOCK_CAP 63
+#define MQ_BLOCK_LAP (MQ_BLOCK_CAP + 1)	// 每个 block 占用的索引数，最后一个索引是切换 block 时的哨兵
+
+struct mq_slot {
+	ATOM_INT ready;					// 生产者写完消息后置 1
+	struct skynet_message msg;
+};
+
+/* 固定大小的消息块，多个 block 串成链表，消费完一个 block 后回收 */
+struct mq_block {
+	ATOM_POINTER next;
+	struct mq_slot slot[MQ_BLOCK_CAP];
+};
+
+/* 服务消息队列（多生产者/单消费者无锁实现）
+ 生产者通过 CAS 推进 tail 抢占一个 slot，消费者（当前处理该服务的 worker 线程）独占 head ，不需要加锁 */
+struct message_queue {
+	// 生产者（任意线程）访问的部分
+	ATOM_SIZET tail;				// 下一个可写入的索引（跨 block 连续递增）
+	ATOM_POINTER tail_block;		// tail 所在的 block
+	ATOM_POINTER spare;				// 消费者回收的空闲 block ，供生产者复用，避免每 63 条消息 malloc/free 一次
+	ATOM_INT in_global;				// 标记是否在全局队列中（当被放到全局队列中时，值为MQ_IN_GLOBAL）
+	ATOM_INT release;				// 标记是否已经被释放
+	int priority;					// 调度优先级（MQ_PRIORITY_*）
+	uint64_t activate_time;			// 最近一次放入全局队列的时间（nanosec），用于统计排队延迟
+	char padding[64];				// 隔开生产者和消费者访问的字段，避免伪共享
+	// 消费者访问的部分
+	size_t head;					// 下一条要读取的消息索引
+	struct mq_block *head_block;	// head 所在的 block
+	uint32_t handle;				// 拥有该消息队列的服务的handle
+	int node;						// 创建服务时所在的 NUMA 节点（numa 模式下优先在这个节点上调度），-1 表示不限
+	int overload;					// 现在的负载
+	int overload_threshold;			// 超载警告的阈值
+	struct message_queue *next;		// 下一个消息队列，链表结构
+};
+
+#else
+
 /* 服务消息队列（对应 actor 模型中的mailbox） */
 struct message_queue {
 	struct spinlock lock;
 	uint32_t handle;				// 拥有该消息队列的服务的handle
+	int node;						// 创建服务时所在的 NUMA 节点（numa 模式下优先在这个节点上调度），-1 表示不限
 	int cap;						// 容量（queue数组的大小）
 	int head;						// 消息的头指针（队列中最早的一条消息的索引值）
 	int tail;						// 消息的尾指针（队列中最晚的一条消息的索引值）
 	int release;					// 标记是否已经被释放
 	int in_global;					// 标记是否在全局队列中（当被放到全局队列中时，值为MQ_IN_GLOBAL）
+	int priority;					// 调度优先级（MQ_PRIORITY_*）
+	uint64_t activate_time;			// 最近一次放入全局队列的时间（nanosec），用于统计排队延迟
 	int overload;					// 现在的负载
 	int overload_threshold;			// 超载警告的阈值（取消息时检测，如果overload超过该值，会输出一条服务负载过重的警告日志）
 	struct skynet_message *queue;	// 消息队列数组（动态数组，当不足时会自动扩容queue数组，每次扩大2倍）
 	struct message_queue *next;		// 下一个消息队列，链表结构
 };
 
-/* 全局队列，一个链表，一个节点对应一个服务的私有消息队列
+#endif
+
+/* 全局队列，每个优先级一个链表，一个节点对应一个服务的私有消息队列
  只有当服务的消息队列中有待处理的消息时，才会被加入到全局消息队列中 */
 struct global_queue {
-	struct message_queue *head;
-	struct message_queue *tail;
+	struct message_queue *head[MQ_PRIORITY_CLASS];
+	struct message_queue *tail[MQ_PRIORITY_CLASS];
+	unsigned turn;						// 加权轮转的位置
 	struct spinlock lock;
+	// 排队延迟统计（在锁内更新）
+	uint64_t count[MQ_PRIORITY_CLASS];	// 出队次数
+	uint64_t delay[MQ_PRIORITY_CLASS];	// 排队延迟总和（nanosec）
+	uint64_t max[MQ_PRIORITY_CLASS];	// 最大排队延迟（nanosec）
+};
+
+/* 加权轮转表：各优先级都有服务排队时，high/normal/low 按 4:2:1 的比例被取出，低优先级不会被饿死
+ 轮到的优先级没有服务时，按优先级从高到低取 */
+static const int PRIORITY_TURN[] = {
+	MQ_PRIORITY_HIGH, MQ_PRIORITY_NORMAL, MQ_PRIORITY_HIGH, MQ_PRIORITY_LOW,
+	MQ_PRIORITY_HIGH, MQ_PRIORITY_NORMAL, MQ_PRIORITY_HIGH,
+};
+
+#define PRIORITY_TURN_SIZE (sizeof(PRIORITY_TURN) / sizeof(PRIORITY_TURN[0]))
+
+#define CACHELINE_SIZE 64
+
+/* worker 本地队列（steal 模式下每个 worker 线程独占一个，按 cache line 对齐避免伪共享） */
+union worker_queue {
+	struct global_queue q;
+	char padding[(sizeof(struct global_queue) + CACHELINE_SIZE - 1) / CACHELINE_SIZE * CACHELINE_SIZE];
+};
+
+/* 调度器：在 global 模式下只使用全局队列 Q；
+ 在 steal 模式下 worker 线程优先使用自己的本地队列，本地为空时再取全局队列，最后去其他 worker 的本地队列里偷 */
+struct scheduler {
+	int mode;						// MQ_SCHEDULE_GLOBAL 或 MQ_SCHEDULE_STEAL
+	int count;						// worker 线程数量（本地队列数量）
+	pthread_key_t worker_key;		// 线程本地数据：worker id + 1，非 worker 线程为 0
+	union worker_queue *local;		// 每个 worker 线程的本地队列
+	// numa 模式
+	int numa;						// 是否开启 numa 模式
+	int *node;						// 每个 worker 线程所在的 NUMA 节点
+	int *steal;						// 每个 worker 偷取的顺序（count-1 个一组），同节点的 worker 排在前面
+	int nnode;						// 节点数量（最大节点编号 + 1）
+	struct numa_node *nodes;		// 每个节点上的 worker 列表
+};
+
+/* 一个 NUMA 节点上的 worker 线程 */
+struct numa_node {
+	int count;
+	int *worker;
+	ATOM_INT rr;					// 从非本节点投递时轮流选择 worker
 };
 
 static struct global_queue *Q = NULL;
+static struct scheduler *S = NULL;
 
-void 
-skynet_globalmq_push(struct message_queue * queue) {
-	struct global_queue *q= Q;
+static inline uint64_t
+nanotime(void) {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * 1000000000 + ti.tv_nsec;
+}
 
+// 在锁内把服务队列接到对应优先级链表的尾部
+static inline void
+queue_link(struct global_queue *q, struct message_queue * queue, uint64_t now) {
+	int p = queue->priority;
+	queue->activate_time = now;
+	if(q->tail[p]) {
+		q->tail[p]->next = queue;
+		q->tail[p] = queue;
+	} else {
+		q->head[p] = q->tail[p] = queue;
+	}
+}
+
+static inline void
+queue_push(struct global_queue *q, struct message_queue * queue) {
+	uint64_t now = nanotime();
 	SPIN_LOCK(q)
 	assert(queue->next == NULL);
-	if(q->tail) {
-		q->tail->next = queue;
-		q->tail = queue;
+	queue_link(q, queue, now);
+	SPIN_UNLOCK(q)
+}
+
+static inline struct message_queue *
+queue_pop_locked(struct global_queue *q) {
+	int p = PRIORITY_TURN[q->turn % PRIORITY_TURN_SIZE];
+	if (q->head[p] == NULL) {
+		for (p=0;p<MQ_PRIORITY_CLASS;p++) {
+			if (q->head[p])
+				break;
+		}
+		if (p == MQ_PRIORITY_CLASS)
+			return NULL;
+	}
+	++q->turn;
+	struct message_queue *mq = q->head[p];
+	q->head[p] = mq->next;
+	if(q->head[p] == NULL) {
+		assert(mq == q->tail[p]);
+		q->tail[p] = NULL;
+	}
+	mq->next = NULL;
+
+	uint64_t now = nanotime();
+	uint64_t delay = now > mq->activate_time ? now - mq->activate_time : 0;
+	++q->count[p];
+	q->delay[p] += delay;
+	if (delay > q->max[p]) {
+		q->max[p] = delay;
+	}
+	return mq;
+}
+
+static inline struct message_queue *
+queue_pop(struct global_queue *q) {
+	SPIN_LOCK(q)
+	struct message_queue *mq = queue_pop_locked(q);
+	SPIN_UNLOCK(q)
+	return mq;
+}
+
+/// @brief 从其他 worker 的本地队列里偷一个服务队列
+/// @param id 当前 worker id，从 id+1 开始轮询，避免所有 worker 都去偷同一个
+/// @param wait 休眠前的最后一次检查要等待对方的锁，不能跳过，否则对方队列里的服务可能没人处理
+static struct message_queue *
+queue_steal(struct scheduler *s, int id, int wait) {
+	int i;
+	for (i=1;i<s->count;i++) {
+		// numa 模式下按预先排好的顺序偷，优先偷同节点的 worker
+		int victim = s->numa ? s->steal[id * (s->count - 1) + i - 1] : (id + i) % s->count;
+		struct global_queue *q = &s->local[victim].q;
+		if (wait) {
+			SPIN_LOCK(q)
+		} else if (!spinlock_trylock(&q->lock)) {
+			// 对方正在操作自己的队列时直接跳过，不在这里自旋
+			continue;
+		}
+		struct message_queue *mq = queue_pop_locked(q);
+		SPIN_UNLOCK(q)
+		if (mq)
+			return mq;
+	}
+	return NULL;
+}
+
+// 返回当前线程绑定的 worker id ，非 worker 线程（socket/timer/main 等）返回 -1
+static inline int
+current_worker(struct scheduler *s) {
+	return (int)(uintptr_t)pthread_getspecific(s->worker_key) - 1;
+}
+
+// numa 模式下，服务队列被其他节点激活时，转投到服务所在节点的某个 worker 上
+static inline int
+target_worker(struct scheduler *s, struct message_queue *queue, int id) {
+	if (s->numa && queue->node >= 0 && (id < 0 || s->node[id] != queue->node)) {
+		struct numa_node *n = &s->nodes[queue->node];
+		if (n->count > 0) {
+			return n->worker[(unsigned)ATOM_FINC(&n->rr) % n->count];
+		}
+	}
+	return id;
+}
+
+void 
+skynet_globalmq_push(struct message_queue * queue) {
+	struct scheduler *s = S;
+	int id = -1;
+	if (s->mode == MQ_SCHEDULE_STEAL) {
+		id = target_worker(s, queue, current_worker(s));
+	}
+	if (id >= 0) {
+		// 由 worker 线程激活的服务队列，放进发送者所在 worker 的本地队列
+		queue_push(&s->local[id].q, queue);
 	} else {
-		q->head = q->tail = queue;
+		queue_push(Q, queue);
+	}
+	// 有新的服务队列可以处理，唤醒一个休眠中的 worker
+	skynet_park_wakeup();
+}
+
+// 把一串已经用 next 链好的服务队列在一次加锁内接到各自优先级的链表尾部，返回服务队列的数量
+static inline int
+queue_push_list(struct global_queue *q, struct message_queue *head, struct message_queue *tail) {
+	uint64_t now = nanotime();
+	int n = 0;
+	SPIN_LOCK(q)
+	assert(tail->next == NULL);
+	while (head) {
+		struct message_queue *next = head->next;
+		head->next = NULL;
+		queue_link(q, head, now);
+		head = next;
+		++n;
 	}
 	SPIN_UNLOCK(q)
+	return n;
+}
+
+// 一次放入 n 个服务队列，唤醒 min(n, 休眠数) 个 worker
+static inline void
+wakeup_n(int n) {
+	while (n-- > 0 && skynet_park_wakeup()) {}
+}
+
+static void
+globalmq_push_list(struct message_queue *head, struct message_queue *tail) {
+	struct scheduler *s = S;
+	int id = -1;
+	int n = 0;
+	if (s->mode == MQ_SCHEDULE_STEAL) {
+		id = current_worker(s);
+		if (s->numa) {
+			// 每个服务队列可能属于不同的节点，逐个投递
+			while (head) {
+				struct message_queue *next = head->next;
+				head->next = NULL;
+				int target = target_worker(s, head, id);
+				queue_push(target >= 0 ? &s->local[target].q : Q, head);
+				head = next;
+				++n;
+			}
+			wakeup_n(n);
+			return;
+		}
+	}
+	if (id >= 0) {
+		n = queue_push_list(&s->local[id].q, head, tail);
+	} else {
+		n = queue_push_list(Q, head, tail);
+	}
+	wakeup_n(n);
 }
 
 /// @brief 全局队列是一个由服务消息队列组成的链表，这里取链表头的那个服务消息队列
+/// steal 模式下依次尝试：本地队列 -> 全局队列 -> 其他 worker 的本地队列
 struct message_queue * 
 skynet_globalmq_pop() {
-	struct global_queue *q = Q;
+	struct scheduler *s = S;
+	if (s->mode == MQ_SCHEDULE_STEAL) {
+		int id = current_worker(s);
+		if (id >= 0) {
+			struct message_queue *mq = queue_pop(&s->local[id].q);
+			if (mq)
+				return mq;
+			mq = queue_pop(Q);
+			if (mq)
+				return mq;
+			return queue_steal(s, id, 0);
+		}
+	}
+	return queue_pop(Q);
+}
 
-	SPIN_LOCK(q)
-	struct message_queue *mq = q->head;
-	if(mq) {
-		q->head = mq->next;
-		if(q->head == NULL) {
-			assert(mq == q->tail);
-			q->tail = NULL;
+// worker 休眠前的最后一次检查，和 skynet_globalmq_pop 一样，但偷取时不跳过正被加锁的本地队列
+struct message_queue *
+skynet_globalmq_recheck() {
+	struct scheduler *s = S;
+	if (s->mode == MQ_SCHEDULE_STEAL) {
+		int id = current_worker(s);
+		if (id >= 0) {
+			struct message_queue *mq = queue_pop(&s->local[id].q);
+			if (mq)
+				return mq;
+			mq = queue_pop(Q);
+			if (mq)
+				return mq;
+			return queue_steal(s, id, 1);
 		}
-		mq->next = NULL;
 	}
-	SPIN_UNLOCK(q)
+	return queue_pop(Q);
+}
 
-	return mq;
+static int
+current_node(struct scheduler *s) {
+	if (s->numa) {
+		int id = current_worker(s);
+		if (id >= 0) {
+			return s->node[id];
+		}
+	}
+	return -1;
+}
+
+void
+skynet_globalmq_numa(const int *node) {
+	struct scheduler *s = S;
+	assert(s->mode == MQ_SCHEDULE_STEAL);
+	int n = s->count;
+	int i,j;
+	s->node = skynet_malloc(n * sizeof(int));
+	s->nnode = 0;
+	for (i=0;i<n;i++) {
+		s->node[i] = node[i] < 0 ? 0 : node[i];
+		if (s->node[i] >= s->nnode) {
+			s->nnode = s->node[i] + 1;
+		}
+	}
+	s->nodes = skynet_malloc(s->nnode * sizeof(struct numa_node));
+	for (i=0;i<s->nnode;i++) {
+		struct numa_node *nn = &s->nodes[i];
+		nn->count = 0;
+		nn->worker = skynet_malloc(n * sizeof(int));
+		ATOM_INIT(&nn->rr, 0);
+	}
+	for (i=0;i<n;i++) {
+		struct numa_node *nn = &s->nodes[s->node[i]];
+		nn->worker[nn->count++] = i;
+	}
+	// 偷取顺序：先同节点，再其他节点，各自从 id+1 开始轮询
+	s->steal = skynet_malloc(n * (n > 1 ? n - 1 : 1) * sizeof(int));
+	for (i=0;i<n;i++) {
+		int *order = &s->steal[i * (n - 1)];
+		int k = 0;
+		for (j=1;j<n;j++) {
+			int v = (i + j) % n;
+			if (s->node[v] == s->node[i])
+				order[k++] = v;
+		}
+		for (j=1;j<n;j++) {
+			int v = (i + j) % n;
+			if (s->node[v] != s->node[i])
+				order[k++] = v;
+		}
+	}
+	s->numa = 1;
+}
+
+// 汇总全局队列和所有本地队列的统计，读取时不加锁，结果可能有少许误差
+void
+skynet_globalmq_delay(int priority, uint64_t *count, uint64_t *total, uint64_t *max) {
+	struct scheduler *s = S;
+	uint64_t c = Q->count[priority], t = Q->delay[priority], m = Q->max[priority];
+	int i;
+	for (i=0;i<s->count;i++) {
+		struct global_queue *q = &s->local[i].q;
+		c += q->count[priority];
+		t += q->delay[priority];
+		if (q->max[priority] > m) {
+			m = q->max[priority];
+		}
+	}
+	*count = c;
+	*total = t / 1000;
+	*max = m / 1000;
+}
+
+void
+skynet_globalmq_bind(int id) {
+	struct scheduler *s = S;
+	if (s->mode == MQ_SCHEDULE_STEAL) {
+		assert(id >= 0 && id < s->count);
+		pthread_setspecific(s->worker_key, (void *)(uintptr_t)(id + 1));
+	}
+}
+
+void
+skynet_mq_priority(struct message_queue *q, int priority) {
+	assert(priority >= 0 && priority < MQ_PRIORITY_CLASS);
+	// 已经在全局队列中的服务，下次激活时才会放入新的优先级链表
+	q->priority = priority;
+}
+
+int
+skynet_mq_get_priority(struct message_queue *q) {
+	return q->priority;
+}
+
+#ifdef USE_MPSC_QUEUE
+
+static struct mq_block *
+block_new(struct message_queue *q) {
+	struct mq_block *b = (struct mq_block *)ATOM_LOAD(&q->spare);
+	if (b == NULL || !ATOM_CAS_POINTER(&q->spare, (uintptr_t)b, (uintptr_t)NULL)) {
+		b = skynet_malloc(sizeof(*b));
+	}
+	memset(b, 0, sizeof(*b));
+	return b;
+}
+
+static void
+block_free(struct message_queue *q, struct mq_block *b) {
+	if (!ATOM_CAS_POINTER(&q->spare, (uintptr_t)NULL, (uintptr_t)b)) {
+		skynet_free(b);
+	}
+}
+
+// in_global 从 0 切换到 MQ_IN_GLOBAL，成功的一方负责把队列放进全局队列
+static inline int
+activate(struct message_queue *q) {
+	while (ATOM_LOAD(&q->in_global) == 0) {
+		if (ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL))
+			return 1;
+	}
+	return 0;
 }
 
 struct message_queue * 
 skynet_mq_create(uint32_t handle) {
 	struct message_queue *q = skynet_malloc(sizeof(*q));
+	memset(q, 0, sizeof(*q));
 	q->handle = handle;
+	q->node = current_node(S);
+	q->priority = MQ_PRIORITY_NORMAL;
+	ATOM_INIT(&q->spare, (uintptr_t)NULL);
+	struct mq_block *b = block_new(q);
+	q->head = 0;
+	q->head_block = b;
+	ATOM_INIT(&q->tail, 0);
+	ATOM_INIT(&q->tail_block, (uintptr_t)b);
+	// When the queue is create (always between service create and service init) ,
+	// set in_global flag to avoid push it to global queue .
+	// If the service init success, skynet_context_new will call skynet_mq_push to push it to global queue.
+	ATOM_INIT(&q->in_global, MQ_IN_GLOBAL);
+	ATOM_INIT(&q->release, 0);
+	q->overload = 0;
+	q->overload_threshold = MQ_OVERLOAD;
+	q->next = NULL;
+
+	return q;
+}
+
+static void 
+_release(struct message_queue *q) {
+	assert(q->next == NULL);
+	struct mq_block *b = q->head_block;
+	while (b) {
+		struct mq_block *next = (struct mq_block *)ATOM_LOAD(&b->next);
+		skynet_free(b);
+		b = next;
+	}
+	skynet_free((void *)ATOM_LOAD(&q->spare));
+	skynet_free(q);
+}
+
+uint32_t 
+skynet_mq_handle(struct message_queue *q) {
+	return q->handle;
+}
+
+static inline int
+queue_length(size_t head, size_t tail) {
+	// 扣除中间跨过的哨兵索引
+	return (int)((tail - head) - (tail / MQ_BLOCK_LAP - head / MQ_BLOCK_LAP));
+}
+
+int
+skynet_mq_length(struct message_queue *q) {
+	return queue_length(q->head, ATOM_LOAD(&q->tail));
+}
+
+int
+skynet_mq_overload(struct message_queue *q) {
+	if (q->overload) {
+		int overload = q->overload;
+		q->overload = 0;
+		return overload;
+	} 
+	return 0;
+}
+
+int
+skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
+	size_t head = q->head;
+	size_t tail = ATOM_LOAD(&q->tail);
+	if (head == tail) {
+		// reset overload_threshold when queue is empty
+		q->overload_threshold = MQ_OVERLOAD;
+		ATOM_STORE(&q->in_global, 0);
+		// 清除标记后必须再检查一次：生产者可能在上面的检查之后写入消息，却看到 in_global 仍然为 MQ_IN_GLOBAL 而没有把队列放回全局队列
+		tail = ATOM_LOAD(&q->tail);
+		if (head == tail || !activate(q)) {
+			// 队列确实为空，或者生产者已经把队列放回了全局队列（此后不能再访问消费者字段）
+			return 1;
+		}
+	}
+
+	int offset = head % MQ_BLOCK_LAP;
+	struct mq_block *b = q->head_block;
+	struct mq_slot *slot = &b->slot[offset];
+	// 生产者已经抢占了 slot ，但可能还没写完
+	while (!ATOM_LOAD(&slot->ready)) {
+		atomic_pause_();
+	}
+	*message = slot->msg;
+
+	if (offset + 1 == MQ_BLOCK_CAP) {
+		// 这个 block 已经读完，跳过哨兵索引进入下一个 block
+		q->head_block = (struct mq_block *)ATOM_LOAD(&b->next);
+		q->head = head = head + 2;
+		block_free(q, b);
+	} else {
+		q->head = head = head + 1;
+	}
+
+	int length = queue_length(head, tail);
+	while (length > q->overload_threshold) {
+		q->overload = length;
+		q->overload_threshold *= 2;
+	}
+
+	return 0;
+}
+
+static void
+mq_enqueue(struct message_queue *q, struct skynet_message *message) {
+	struct mq_block *next = NULL;
+	for (;;) {
+		size_t tail = ATOM_LOAD(&q->tail);
+		int offset = tail % MQ_BLOCK_LAP;
+		if (offset == MQ_BLOCK_CAP) {
+			// 其他生产者正在安装下一个 block
+			atomic_pause_();
+			continue;
+		}
+		if (offset + 1 == MQ_BLOCK_CAP && next == NULL) {
+			// 将要占用 block 的最后一个 slot ，先准备好下一个 block
+			next = block_new(q);
+		}
+		struct mq_block *b = (struct mq_block *)ATOM_LOAD(&q->tail_block);
+		if (ATOM_CAS_SIZET(&q->tail, tail, tail + 1)) {
+			if (offset + 1 == MQ_BLOCK_CAP) {
+				ATOM_STORE(&b->next, (uintptr_t)next);
+				ATOM_STORE(&q->tail_block, (uintptr_t)next);
+				ATOM_STORE(&q->tail, tail + 2);
+				next = NULL;
+			}
+			struct mq_slot *slot = &b->slot[offset];
+			slot->msg = *message;
+			ATOM_STORE(&slot->ready, 1);
+			break;
+		}
+	}
+	if (next) {
+		block_free(q, next);
+	}
+}
+
+void 
+skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
+	assert(message);
+	mq_enqueue(q, message);
+
+	if (activate(q)) {
+		skynet_globalmq_push(q);
+	}
+}
+
+void
+skynet_mq_push_batch(struct message_queue *q, struct skynet_message *message, int n) {
+	int i;
+	for (i=0;i<n;i++) {
+		mq_enqueue(q, &message[i]);
+	}
+
+	if (n > 0 && activate(q)) {
+		skynet_globalmq_push(q);
+	}
+}
+
+void
+skynet_mq_push_multi(struct message_queue **q, struct skynet_message *message, int n) {
+	struct message_queue *head = NULL;
+	struct message_queue *tail = NULL;
+	int i;
+	for (i=0;i<n;i++) {
+		struct message_queue *mq = q[i];
+		mq_enqueue(mq, &message[i]);
+		if (activate(mq)) {
+			assert(mq->next == NULL);
+			if (tail) {
+				tail->next = mq;
+			} else {
+				head = mq;
+			}
+			tail = mq;
+		}
+	}
+	if (head) {
+		globalmq_push_list(head, tail);
+	}
+}
+
+#else
+
+struct message_queue * 
+skynet_mq_create(uint32_t handle) {
+	struct message_queue *q = skynet_malloc(sizeof(*q));
+	q->handle = handle;
+	q->node = current_node(S);
+	q->priority = MQ_PRIORITY_NORMAL;
 	q->cap = DEFAULT_QUEUE_SIZE;
 	q->head = 0;
 	q->tail = 0;
@@ -194,11 +791,8 @@ expand_queue(struct message_queue *q) {
 	q->queue = new_queue;
 }
 
-void 
-skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
-	assert(message);
-	SPIN_LOCK(q)
-
+static inline void
+mq_enqueue(struct message_queue *q, struct skynet_message *message) {
 	q->queue[q->tail] = *message;
 	if (++ q->tail >= q->cap) {
 		q->tail = 0;
@@ -207,32 +801,107 @@ skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
 	if (q->head == q->tail) {
 		expand_queue(q);
 	}
+}
 
+void 
+skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
+	assert(message);
+	SPIN_LOCK(q)
+
+	mq_enqueue(q, message);
+
+	int activate = 0;
 	if (q->in_global == 0) {
 		q->in_global = MQ_IN_GLOBAL;
-		skynet_globalmq_push(q);
+		activate = 1;
 	}
 	
 	SPIN_UNLOCK(q)
+
+	// in_global 已经置位，其他生产者不会重复放入，可以在锁外放入全局队列（可能需要唤醒 worker）
+	if (activate) {
+		skynet_globalmq_push(q);
+	}
+}
+
+/// @brief 一次加锁把 n 条消息压入同一个服务队列，最多激活一次全局队列
+void
+skynet_mq_push_batch(struct message_queue *q, struct skynet_message *message, int n) {
+	if (n <= 0)
+		return;
+	SPIN_LOCK(q)
+
+	int i;
+	for (i=0;i<n;i++) {
+		mq_enqueue(q, &message[i]);
+	}
+
+	int activate = 0;
+	if (q->in_global == 0) {
+		q->in_global = MQ_IN_GLOBAL;
+		activate = 1;
+	}
+
+	SPIN_UNLOCK(q)
+
+	if (activate) {
+		skynet_globalmq_push(q);
+	}
+}
+
+/// @brief 把 message[i] 压入 q[i]，新激活的服务队列先串成链表，最后只加一次锁放入全局队列
+void
+skynet_mq_push_multi(struct message_queue **q, struct skynet_message *message, int n) {
+	struct message_queue *head = NULL;
+	struct message_queue *tail = NULL;
+	int i;
+	for (i=0;i<n;i++) {
+		struct message_queue *mq = q[i];
+		SPIN_LOCK(mq)
+		mq_enqueue(mq, &message[i]);
+		if (mq->in_global == 0) {
+			mq->in_global = MQ_IN_GLOBAL;
+			assert(mq->next == NULL);
+			if (tail) {
+				tail->next = mq;
+			} else {
+				head = mq;
+			}
+			tail = mq;
+		}
+		SPIN_UNLOCK(mq)
+	}
+	if (head) {
+		globalmq_push_list(head, tail);
+	}
 }
 
+#endif
+
 void 
-skynet_mq_init() {
+skynet_mq_init(int worker, int mode) {
 	struct global_queue *q = skynet_malloc(sizeof(*q));
 	memset(q,0,sizeof(*q));
 	SPIN_INIT(q);
 	Q=q;
-}
 
-void 
-skynet_mq_mark_release(struct message_queue *q) {
-	SPIN_LOCK(q)
-	assert(q->release == 0);
-	q->release = 1;
-	if (q->in_global != MQ_IN_GLOBAL) {
-		skynet_globalmq_push(q);
+	struct scheduler *s = skynet_malloc(sizeof(*s));
+	memset(s,0,sizeof(*s));
+	s->mode = mode;
+	if (mode == MQ_SCHEDULE_STEAL) {
+		if (pthread_key_create(&s->worker_key, NULL)) {
+			fprintf(stderr, "pthread_key_create failed");
+			exit(1);
+		}
+		s->count = worker;
+		s->local = skynet_malloc(worker * sizeof(union worker_queue));
+		memset(s->local, 0, worker * sizeof(union worker_queue));
+		int i;
+		for (i=0;i<worker;i++) {
+			SPIN_INIT(&s->local[i].q);
+		}
 	}
-	SPIN_UNLOCK(q)
+	S=s;
 }
 
 static void
@@ -244,6 +913,39 @@ _drop_queue(struct message_queue *q, message_drop drop_func, void *ud) {
 	_release(q);
 }
 
+#ifdef USE_MPSC_QUEUE
+
+void 
+skynet_mq_mark_release(struct message_queue *q) {
+	assert(ATOM_LOAD(&q->release) == 0);
+	ATOM_STORE(&q->release, 1);
+	if (activate(q)) {
+		skynet_globalmq_push(q);
+	}
+}
+
+void 
+skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud) {
+	if (ATOM_LOAD(&q->release)) {
+		_drop_queue(q, drop_func, ud);
+	} else {
+		skynet_globalmq_push(q);
+	}
+}
+
+#else
+
+void 
+skynet_mq_mark_release(struct message_queue *q) {
+	SPIN_LOCK(q)
+	assert(q->release == 0);
+	q->release = 1;
+	if (q->in_global != MQ_IN_GLOBAL) {
+		skynet_globalmq_push(q);
+	}
+	SPIN_UNLOCK(q)
+}
+
 void 
 skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud) {
 	SPIN_LOCK(q)
@@ -256,3 +958,5 @@ skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud) {
 		SPIN_UNLOCK(q)
 	}
 }
+
+#endif
@@ -17,8 +17,23 @@ struct skynet_message {
 
 struct message_queue;
 
+// 调度模式（config 中的 scheduler 项）
+#define MQ_SCHEDULE_GLOBAL 0	// 所有 worker 共享一个全局队列
+#define MQ_SCHEDULE_STEAL 1		// 每个 worker 一个本地队列，空闲时从其他 worker 偷
+
+// 服务调度优先级
+#define MQ_PRIORITY_HIGH 0
+#define MQ_PRIORITY_NORMAL 1		// 默认
+#define MQ_PRIORITY_LOW 2
+#define MQ_PRIORITY_CLASS 3
+
 void skynet_globalmq_push(struct message_queue * queue);
 struct message_queue * skynet_globalmq_pop(void);
+struct message_queue * skynet_globalmq_recheck(void);	// like pop, but don't skip locked local queues (before parking)
+void skynet_globalmq_bind(int worker_id);	// bind current thread to worker's local queue
+void skynet_globalmq_numa(const int *node);	// numa node of each worker, steal mode only
+// queueing delay (microsec) of a priority class in global queues
+void skynet_globalmq_delay(int priority, uint64_t *count, uint64_t *total, uint64_t *max);
 
 struct message_queue * skynet_mq_create(uint32_t handle);
 void skynet_mq_mark_release(struct message_queue *q);
@@ -27,15 +42,21 @@ typedef void (*message_drop)(struct skynet_message *, void *);
 
 void skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud);
 uint32_t skynet_mq_handle(struct message_queue *);
+void skynet_mq_priority(struct message_queue *q, int priority);
+int skynet_mq_get_priority(struct message_queue *q);
 
 // 0 for success
 int skynet_mq_pop(struct message_queue *q, struct skynet_message *message);
 void skynet_mq_push(struct message_queue *q, struct skynet_message *message);
+// push n messages to one queue with a single lock and at most one global queue activation
+void skynet_mq_push_batch(struct message_queue *q, struct skynet_message *message, int n);
+// push message[i] to q[i], activated queues are linked to global queue at once
+void skynet_mq_push_multi(struct message_queue **q, struct skynet_message *message, int n);
 
 // return the length of message queue, for debug
 int skynet_mq_length(struct message_queue *q);
 int skynet_mq_overload(struct message_queue *q);
 
-void skynet_mq_init();
+void skynet_mq_init(int worker, int mode);
 
 #endif
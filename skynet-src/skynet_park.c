@@ -0,0 +1,255 @@
+#include "skynet.h"
+#include "skynet_park.h"
+#include "atomic.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__linux__)
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define USE_FUTEX
+
+#else
+
+#include <pthread.h>
+
+#endif
+
+/* worker 线程的休眠槽位状态
+ RUNNING -> WAITING : worker 准备休眠（skynet_park_prepare）
+ WAITING -> CLAIMED : 唤醒者抢到了这个槽位，正在写唤醒时间
+ CLAIMED -> NOTIFIED : 唤醒者写完唤醒时间，唤醒 worker
+ WAITING/NOTIFIED -> RUNNING : worker 恢复运行 */
+#define PARK_RUNNING 0
+#define PARK_WAITING 1
+#define PARK_CLAIMED 2
+#define PARK_NOTIFIED 3
+
+#define CACHELINE_SIZE 64
+
+/* 每个 worker 线程一个休眠槽位，唤醒者可以精确地只唤醒一个空闲 worker */
+struct park_slot {
+	ATOM_INT state;
+	uint64_t notify_time;	// 唤醒者发出唤醒的时间（nanosec）
+	// 以下统计只由所属的 worker 线程写
+	uint64_t count;			// 被唤醒的次数
+	uint64_t total;			// 唤醒延迟总和（nanosec）
+	uint64_t max;			// 最大唤醒延迟（nanosec）
+#ifndef USE_FUTEX
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+#endif
+};
+
+union park_slot_aligned {
+	struct park_slot s;
+	char padding[CACHELINE_SIZE * 2];
+};
+
+struct park {
+	int count;					// worker 线程数量
+	int spin;					// 休眠前自旋重试的次数
+	ATOM_INT parked;			// 处于休眠流程中的 worker 数量，为 0 时唤醒者直接返回
+	union park_slot_aligned *slot;
+};
+
+static struct park *P = NULL;
+
+static inline uint64_t
+nanotime(void) {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * 1000000000 + ti.tv_nsec;
+}
+
+#ifdef USE_FUTEX
+
+static inline void
+slot_sleep(struct park_slot *s, int state) {
+	syscall(SYS_futex, (int *)&s->state, FUTEX_WAIT_PRIVATE, state, NULL, NULL, 0);
+}
+
+static inline void
+slot_signal(struct park_slot *s) {
+	syscall(SYS_futex, (int *)&s->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+#else
+
+static inline void
+slot_sleep(struct park_slot *s, int state) {
+	pthread_mutex_lock(&s->mutex);
+	if (ATOM_LOAD(&s->state) == state) {
+		pthread_cond_wait(&s->cond, &s->mutex);
+	}
+	pthread_mutex_unlock(&s->mutex);
+}
+
+static inline void
+slot_signal(struct park_slot *s) {
+	pthread_mutex_lock(&s->mutex);
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->mutex);
+}
+
+#endif
+
+void
+skynet_park_init(int worker, int spin) {
+	struct park *p = skynet_malloc(sizeof(*p));
+	memset(p, 0, sizeof(*p));
+	p->count = worker;
+	p->spin = spin < 0 ? 0 : spin;
+	ATOM_INIT(&p->parked, 0);
+	p->slot = skynet_malloc(worker * sizeof(union park_slot_aligned));
+	memset(p->slot, 0, worker * sizeof(union park_slot_aligned));
+	int i;
+	for (i=0;i<worker;i++) {
+		struct park_slot *s = &p->slot[i].s;
+		ATOM_INIT(&s->state, PARK_RUNNING);
+#ifndef USE_FUTEX
+		if (pthread_mutex_init(&s->mutex, NULL) || pthread_cond_init(&s->cond, NULL)) {
+			fprintf(stderr, "Init park slot error");
+			exit(1);
+		}
+#endif
+	}
+	P = p;
+}
+
+void
+skynet_park_free(void) {
+	struct park *p = P;
+	P = NULL;
+#ifndef USE_FUTEX
+	int i;
+	for (i=0;i<p->count;i++) {
+		pthread_mutex_destroy(&p->slot[i].s.mutex);
+		pthread_cond_destroy(&p->slot[i].s.cond);
+	}
+#endif
+	skynet_free(p->slot);
+	skynet_free(p);
+}
+
+int
+skynet_park_spin(void) {
+	return P->spin;
+}
+
+void
+skynet_park_prepare(int id) {
+	struct park *p = P;
+	struct park_slot *s = &p->slot[id].s;
+	ATOM_STORE(&s->state, PARK_WAITING);
+	ATOM_FINC(&p->parked);
+	// 和 skynet_park_wakeup 中的 fence 配对：要么 worker 再次检查队列时能看到新的服务队列，要么唤醒者能看到 WAITING
+	ATOM_FENCE();
+}
+
+// 等待唤醒者写完唤醒时间，然后恢复运行
+static void
+resume(struct park *p, struct park_slot *s) {
+	while (ATOM_LOAD(&s->state) == PARK_CLAIMED) {
+		slot_sleep(s, PARK_CLAIMED);
+	}
+	if (ATOM_LOAD(&s->state) == PARK_NOTIFIED) {
+		uint64_t now = nanotime();
+		uint64_t latency = now > s->notify_time ? now - s->notify_time : 0;
+		++s->count;
+		s->total += latency;
+		if (latency > s->max) {
+			s->max = latency;
+		}
+	}
+	ATOM_STORE(&s->state, PARK_RUNNING);
+	ATOM_FDEC(&p->parked);
+}
+
+void
+skynet_park_cancel(int id) {
+	struct park *p = P;
+	struct park_slot *s = &p->slot[id].s;
+	if (ATOM_CAS(&s->state, PARK_WAITING, PARK_RUNNING)) {
+		ATOM_FDEC(&p->parked);
+		return;
+	}
+	// 已经被唤醒者抢到，这次唤醒浪费掉了，但必须等它完成
+	resume(p, s);
+}
+
+void
+skynet_park_wait(int id) {
+	struct park *p = P;
+	struct park_slot *s = &p->slot[id].s;
+	while (ATOM_LOAD(&s->state) == PARK_WAITING) {
+		// "spurious wakeup" is harmless
+		slot_sleep(s, PARK_WAITING);
+	}
+	resume(p, s);
+}
+
+static int
+notify(struct park_slot *s, uint64_t now) {
+	if (ATOM_LOAD(&s->state) == PARK_WAITING && ATOM_CAS(&s->state, PARK_WAITING, PARK_CLAIMED)) {
+		s->notify_time = now;
+		ATOM_STORE(&s->state, PARK_NOTIFIED);
+		slot_signal(s);
+		return 1;
+	}
+	return 0;
+}
+
+int
+skynet_park_wakeup(void) {
+	struct park *p = P;
+	if (p == NULL)
+		return 0;
+	// 和 skynet_park_prepare 中的 fence 配对，保证先放入队列再检查休眠者
+	ATOM_FENCE();
+	if (ATOM_LOAD(&p->parked) == 0)
+		return 0;
+	uint64_t now = nanotime();
+	int i;
+	for (i=0;i<p->count;i++) {
+		if (notify(&p->slot[i].s, now))
+			return 1;
+	}
+	return 0;
+}
+
+void
+skynet_park_wakeall(void) {
+	struct park *p = P;
+	ATOM_FENCE();
+	uint64_t now = nanotime();
+	int i;
+	for (i=0;i<p->count;i++) {
+		notify(&p->slot[i].s, now);
+	}
+}
+
+void
+skynet_park_stat(uint64_t *count, uint64_t *total, uint64_t *max) {
+	struct park *p = P;
+	uint64_t c = 0, t = 0, m = 0;
+	if (p) {
+		int i;
+		for (i=0;i<p->count;i++) {
+			struct park_slot *s = &p->slot[i].s;
+			c += s->count;
+			t += s->total;
+			if (s->max > m) {
+				m = s->max;
+			}
+		}
+	}
+	*count = c;
+	*total = t / 1000;
+	*max = m / 1000;
+}
@@ -0,0 +1,22 @@
+#ifndef SKYNET_PARK_H
+#define SKYNET_PARK_H
+
+#include <stdint.h>
+
+void skynet_park_init(int worker, int spin);
+void skynet_park_free(void);
+int skynet_park_spin(void);
+
+// worker side : prepare, check the queue again, then cancel (found work) or wait
+void skynet_park_prepare(int id);
+void skynet_park_cancel(int id);
+void skynet_park_wait(int id);
+
+// return 1 if a parked worker is woken
+int skynet_park_wakeup(void);
+void skynet_park_wakeall(void);
+
+// wakeup latency, in microsec
+void skynet_park_stat(uint64_t *count, uint64_t *total, uint64_t *max);
+
+#endif
@@ -10,6 +10,7 @@
 #include "skynet_monitor.h"
 #include "skynet_imp.h"
 #include "skynet_log.h"
+#include "skynet_park.h"
 #include "spinlock.h"
 #include "atomic.h"
 
@@ -18,6 +19,7 @@
 #include <string.h>
 #include <assert.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdbool.h>
 
@@ -74,6 +76,7 @@ struct skynet_node {
 	uint32_t monitor_exit;
 	pthread_key_t handle_key;	// 线程本地数据的key
 	bool profile;	// default is on
+	int timeslice;	// in microsec, 0 means use the weight of worker thread
 };
 
 static struct skynet_node G_NODE;
@@ -116,6 +119,24 @@ id_to_hex(char * str, uint32_t id) {
 	str[9] = '\0';
 }
 
+// 按消息类型登记的释放钩子，消息没有被服务保留时，释放前调用（例如释放消息里带着的引用）
+static ATOM_POINTER FREE_HOOK[256];
+
+void
+skynet_free_hook(int type, skynet_free_cb cb) {
+	assert(type >= 0 && type < 256);
+	ATOM_STORE(&FREE_HOOK[type], (uintptr_t)cb);
+}
+
+static void
+message_free(void *data, int type, size_t sz) {
+	skynet_free_cb cb = (skynet_free_cb)ATOM_LOAD(&FREE_HOOK[type]);
+	if (cb && data) {
+		cb(data, sz);
+	}
+	skynet_free(data);
+}
+
 struct drop_t {
 	uint32_t handle;
 };
@@ -123,7 +144,7 @@ struct drop_t {
 static void
 drop_message(struct skynet_message *msg, void *ud) {
 	struct drop_t *d = ud;
-	skynet_free(msg->data);
+	message_free(msg->data, msg->sz >> MESSAGE_TYPE_SHIFT, msg->sz & MESSAGE_TYPE_MASK);
 	uint32_t source = d->handle;
 	assert(source);
 	// report error to the message source
@@ -260,6 +281,20 @@ skynet_context_push(uint32_t handle, struct skynet_message *message) {
 	return 0;
 }
 
+/// @brief 把 n 条消息一次性压入同一个服务的消息队列
+/// @return 0 成功；-1 服务不存在（消息不会被释放，由调用者处理）
+int
+skynet_context_push_batch(uint32_t handle, struct skynet_message *message, int n) {
+	struct skynet_context * ctx = skynet_handle_grab(handle);
+	if (ctx == NULL) {
+		return -1;
+	}
+	skynet_mq_push_batch(ctx->queue, message, n);
+	skynet_context_release(ctx);
+
+	return 0;
+}
+
 void 
 skynet_context_endless(uint32_t handle) {
 	struct skynet_context * ctx = skynet_handle_grab(handle);
@@ -301,7 +336,7 @@ dispatch_message(struct skynet_context *ctx, struct skynet_message *msg) {
 		reserve_msg = ctx->cb(ctx, ctx->cb_ud, type, msg->session, msg->source, msg->data, sz);
 	}
 	if (!reserve_msg) {
-		skynet_free(msg->data);
+		message_free(msg->data, type, sz);
 	}
 	CHECKCALLING_END(ctx)
 }
@@ -316,10 +351,27 @@ skynet_context_dispatchall(struct skynet_context * ctx) {
 	}
 }
 
+/// @brief 按服务的平均单条消息 cpu 耗时和目标时间片计算本次要处理的消息数量（至少 1 条，最多为队列长度）
+static int
+adaptive_batch(struct skynet_context *ctx, int length) {
+	int n = length;
+	if (ctx->message_count > 0) {
+		uint64_t cost = ctx->cpu_cost / (uint64_t)ctx->message_count;	// microsec per message
+		if (cost == 0) {
+			cost = 1;
+		}
+		uint64_t budget = (uint64_t)G_NODE.timeslice / cost;
+		if (budget < (uint64_t)n) {
+			n = (int)budget;
+		}
+	}
+	return n > 0 ? n : 1;
+}
+
 /// @brief 调度并处理消息
 /// @param sm 处理消息的worker线程的监控器
 /// @param q  指定要处理的服务消息队列，不指定则从全局队列中取一个
-/// @param weight 本次调度要处理的消息数量 (-1:1条; 0:全部; 1:1/2; 2:1/4 .....)
+/// @param weight 本次调度要处理的消息数量 (-1:1条; 0:全部; 1:1/2; 2:1/4 .....)，adaptive 策略下忽略
 /// @return 下一个待处理的消息队列，没有返回 NULL
 struct message_queue * 
 skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue *q, int weight) {
@@ -349,9 +401,14 @@ skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue
 			skynet_context_release(ctx);
 			return skynet_globalmq_pop();
 
-		} else if (i==0 && weight >= 0) {
-			n = skynet_mq_length(q);	// 消息队列总长度
-			n >>= weight;				// 按线程工作权重决定本次要处理的消息数量
+		} else if (i==0) {
+			if (G_NODE.timeslice > 0 && ctx->profile) {
+				// adaptive 策略：由队列长度、服务的平均消息耗时和时间片决定
+				n = adaptive_batch(ctx, skynet_mq_length(q));
+			} else if (weight >= 0) {
+				n = skynet_mq_length(q);	// 消息队列总长度
+				n >>= weight;				// 按线程工作权重决定本次要处理的消息数量
+			}
 		}
 		int overload = skynet_mq_overload(q);
 		if (overload) {
@@ -362,7 +419,7 @@ skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue
 		skynet_monitor_trigger(sm, msg.source , handle);
 
 		if (ctx->cb == NULL) {
-			skynet_free(msg.data);			// 没有回调处理函数，销毁消息
+			message_free(msg.data, msg.sz >> MESSAGE_TYPE_SHIFT, msg.sz & MESSAGE_TYPE_MASK);			// 没有回调处理函数，销毁消息
 		} else {
 			dispatch_message(ctx, &msg);	// 调用回调处理函数，处理消息
 		}
@@ -440,6 +497,25 @@ cmd_timeout(struct skynet_context * context, const char * param) {
 	return context->result;
 }
 
+int64_t
+skynet_settimeout(struct skynet_context * context, int time, int * session) {
+	*session = skynet_context_newsession(context);
+	int64_t id = skynet_timeout(context->handle, time, *session);
+	return id > 0 ? id : 0;
+}
+
+int64_t
+skynet_settimeout_ms(struct skynet_context * context, int ms, int * session) {
+	*session = skynet_context_newsession(context);
+	int64_t id = skynet_timeout_ms(context->handle, ms, *session);
+	return id > 0 ? id : 0;
+}
+
+int
+skynet_canceltimeout(struct skynet_context * context, int64_t id) {
+	return skynet_timeout_cancel(context->handle, id);
+}
+
 static const char *
 cmd_reg(struct skynet_context * context, const char * param) {
 	if (param == NULL || param[0] == '\0') {
@@ -585,6 +661,9 @@ cmd_monitor(struct skynet_context * context, const char * param) {
 	return NULL;
 }
 
+// 调度优先级的名字，下标为 MQ_PRIORITY_*
+static const char * PRIORITY_NAME[MQ_PRIORITY_CLASS] = { "high", "normal", "low" };
+
 static const char *
 cmd_stat(struct skynet_context * context, const char * param) {
 	if (strcmp(param, "mqlen") == 0) {
@@ -610,12 +689,70 @@ cmd_stat(struct skynet_context * context, const char * param) {
 		}
 	} else if (strcmp(param, "message") == 0) {
 		sprintf(context->result, "%d", context->message_count);
+	} else if (strncmp(param, "delay", 5) == 0) {
+		// 各优先级服务在全局队列中的排队延迟（全局）："delayhigh" "delaynormal" "delaylow" 平均延迟，加 "max" 后缀为最大延迟
+		const char * name = param + 5;
+		int p;
+		for (p=0;p<MQ_PRIORITY_CLASS;p++) {
+			size_t len = strlen(PRIORITY_NAME[p]);
+			if (strncmp(name, PRIORITY_NAME[p], len) == 0)
+				break;
+		}
+		if (p == MQ_PRIORITY_CLASS) {
+			context->result[0] = '\0';
+		} else {
+			uint64_t count, total, max;
+			skynet_globalmq_delay(p, &count, &total, &max);
+			const char * suffix = name + strlen(PRIORITY_NAME[p]);
+			if (strcmp(suffix, "") == 0) {
+				double t = count ? (double)total / count / 1000000.0 : 0;	// microsec
+				sprintf(context->result, "%lf", t);
+			} else if (strcmp(suffix, "max") == 0) {
+				double t = (double)max / 1000000.0;	// microsec
+				sprintf(context->result, "%lf", t);
+			} else {
+				context->result[0] = '\0';
+			}
+		}
+	} else if (strncmp(param, "wakeup", 6) == 0) {
+		// worker 线程的唤醒统计（全局）："wakeup" 唤醒次数，"wakeuptime" 平均唤醒延迟，"wakeupmax" 最大唤醒延迟
+		uint64_t count, total, max;
+		skynet_park_stat(&count, &total, &max);
+		if (strcmp(param + 6, "") == 0) {
+			sprintf(context->result, "%" PRIu64, count);
+		} else if (strcmp(param + 6, "time") == 0) {
+			double t = count ? (double)total / count / 1000000.0 : 0;	// microsec
+			sprintf(context->result, "%lf", t);
+		} else if (strcmp(param + 6, "max") == 0) {
+			double t = (double)max / 1000000.0;	// microsec
+			sprintf(context->result, "%lf", t);
+		} else {
+			context->result[0] = '\0';
+		}
 	} else {
 		context->result[0] = '\0';
 	}
 	return context->result;
 }
 
+/// @brief 设置服务的调度优先级（"high"、"normal"、"low"），param 为空时只查询
+/// @return 当前的优先级
+static const char *
+cmd_priority(struct skynet_context * context, const char * param) {
+	if (param && param[0]) {
+		int p;
+		for (p=0;p<MQ_PRIORITY_CLASS;p++) {
+			if (strcmp(param, PRIORITY_NAME[p]) == 0)
+				break;
+		}
+		if (p == MQ_PRIORITY_CLASS)
+			return NULL;
+		skynet_mq_priority(context->queue, p);
+	}
+	strcpy(context->result, PRIORITY_NAME[skynet_mq_get_priority(context->queue)]);
+	return context->result;
+}
+
 static const char *
 cmd_logon(struct skynet_context * context, const char * param) {
 	uint32_t handle = tohandle(context, param);
@@ -695,6 +832,7 @@ static struct command_func cmd_funcs[] = {
 	{ "LOGON", cmd_logon },
 	{ "LOGOFF", cmd_logoff },
 	{ "SIGNAL", cmd_signal },
+	{ "PRIORITY", cmd_priority },
 	{ NULL, NULL },
 };
 
@@ -747,7 +885,7 @@ skynet_send(struct skynet_context * context, uint32_t source, uint32_t destinati
 		// 消息类型超长
 		skynet_error(context, "The message to %x is too large", destination);
 		if (type & PTYPE_TAG_DONTCOPY) {
-			skynet_free(data);
+			message_free(data, type & 0xff, sz & MESSAGE_TYPE_MASK);
 		}
 		return -2;
 	}
@@ -760,7 +898,7 @@ skynet_send(struct skynet_context * context, uint32_t source, uint32_t destinati
 	if (destination == 0) {
 		if (data) {
 			skynet_error(context, "Destination address can't be 0");
-			skynet_free(data);
+			message_free(data, sz >> MESSAGE_TYPE_SHIFT, sz & MESSAGE_TYPE_MASK);
 			return -1;
 		}
 
@@ -782,13 +920,102 @@ skynet_send(struct skynet_context * context, uint32_t source, uint32_t destinati
 		smsg.sz = sz;
 
 		if (skynet_context_push(destination, &smsg)) {
-			skynet_free(data);
+			message_free(data, sz >> MESSAGE_TYPE_SHIFT, sz & MESSAGE_TYPE_MASK);
 			return -1;
 		}
 	}
 	return session;
 }
 
+#define SEND_BATCH 64
+
+/// @brief 把同一份消息发送给多个服务，每个目的服务各自得到一份拷贝
+/// 本节点内的目的服务按 SEND_BATCH 一组，一次性压入各自的消息队列，并只加一次全局队列的锁
+/// @param destination 目的服务 handle 数组（为 0 的会被忽略）
+/// @param n 目的服务数量
+/// @return 成功投递的目的服务数量，消息过大返回 -2 ，消息类型带有释放钩子（持有引用，不能拷贝）返回 -1
+int
+skynet_send_batch(struct skynet_context * context, uint32_t source, const uint32_t * destination, int n, int type, int session, void * data, size_t sz) {
+	int dontcopy = type & PTYPE_TAG_DONTCOPY;
+	int ptype = type & 0xff;
+	if ((sz & MESSAGE_TYPE_MASK) != sz) {
+		skynet_error(context, "The message to %d destinations is too large", n);
+		if (dontcopy) {
+			message_free(data, ptype, sz);
+		}
+		return -2;
+	}
+	if (ATOM_LOAD(&FREE_HOOK[ptype])) {
+		// 按字节拷贝不会增加消息持有的引用，每个接收方都释放一次就多释放了
+		skynet_error(context, "The message of type %d can't be sent to %d destinations", ptype, n);
+		if (dontcopy) {
+			message_free(data, ptype, sz);
+		}
+		return -1;
+	}
+	if (type & PTYPE_TAG_ALLOCSESSION) {
+		assert(session == 0);
+		session = skynet_context_newsession(context);
+	}
+	type = ptype;
+
+	if (source == 0) {
+		source = context->handle;
+	}
+
+	struct skynet_context * ctx[SEND_BATCH];
+	struct message_queue * queue[SEND_BATCH];
+	struct skynet_message smsg[SEND_BATCH];
+	int delivered = 0;
+	int i = 0;
+	while (i < n) {
+		int m = 0;
+		for (; i < n && m < SEND_BATCH; i++) {
+			uint32_t des = destination[i];
+			if (des == 0)
+				continue;
+			char * msg = NULL;
+			if (data) {
+				msg = skynet_malloc(sz+1);
+				memcpy(msg, data, sz);
+				msg[sz] = '\0';
+			}
+			if (skynet_harbor_message_isremote(des)) {
+				struct remote_message * rmsg = skynet_malloc(sizeof(*rmsg));
+				rmsg->destination.handle = des;
+				rmsg->message = msg;
+				rmsg->sz = sz;
+				rmsg->type = type;
+				skynet_harbor_send(rmsg, source, session);
+				++delivered;
+				continue;
+			}
+			struct skynet_context * dctx = skynet_handle_grab(des);
+			if (dctx == NULL) {
+				message_free(msg, type, sz);
+				continue;
+			}
+			ctx[m] = dctx;
+			queue[m] = dctx->queue;
+			smsg[m].source = source;
+			smsg[m].session = session;
+			smsg[m].data = msg;
+			smsg[m].sz = sz | (size_t)type << MESSAGE_TYPE_SHIFT;
+			++m;
+		}
+		skynet_mq_push_multi(queue, smsg, m);
+		int j;
+		for (j=0;j<m;j++) {
+			skynet_context_release(ctx[j]);
+		}
+		delivered += m;
+	}
+	if (dontcopy) {
+		message_free(data, type, sz);
+	}
+	return delivered;
+}
+
 int
 skynet_sendname(struct skynet_context * context, uint32_t source, const char * addr , int type, int session, void * data, size_t sz) {
 	if (source == 0) {
@@ -801,7 +1028,7 @@ skynet_sendname(struct skynet_context * context, uint32_t source, const char * a
 		des = skynet_handle_findname(addr + 1);
 		if (des == 0) {
 			if (type & PTYPE_TAG_DONTCOPY) {
-				skynet_free(data);
+				message_free(data, type & 0xff, sz);
 			}
 			return -1;
 		}
@@ -809,7 +1036,7 @@ skynet_sendname(struct skynet_context * context, uint32_t source, const char * a
 		if ((sz & MESSAGE_TYPE_MASK) != sz) {
 			skynet_error(context, "The message to %s is too large", addr);
 			if (type & PTYPE_TAG_DONTCOPY) {
-				skynet_free(data);
+				message_free(data, type & 0xff, sz & MESSAGE_TYPE_MASK);
 			}
 			return -2;
 		}
@@ -886,3 +1113,8 @@ void
 skynet_profile_enable(int enable) {
 	G_NODE.profile = (bool)enable;
 }
+
+void
+skynet_dispatch_timeslice(int timeslice) {
+	G_NODE.timeslice = timeslice > 0 ? timeslice : 0;
+}
@@ -5,41 +5,127 @@
 #include "skynet_server.h"
 #include "skynet_mq.h"
 #include "skynet_harbor.h"
+#include "atomic.h"
 
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdio.h>
 
-static struct socket_server * SOCKET_SERVER = NULL;
+// 投递给同一个服务的连续消息合并投递的最大条数
+#define FORWARD_BATCH 64
+
+/* 投递给同一个服务的连续消息，攒够一批、换了服务或者 socket 线程将要阻塞（SOCKET_IDLE）时一次压入服务的消息队列 */
+struct message_batch {
+	uint32_t handle;
+	int n;
+	struct skynet_message msg[FORWARD_BATCH];
+};
+
+/* 每个 socket 线程一个 socket_server 分片，socket id 的低 bits 位是分片编号 */
+struct socket_group {
+	int count;
+	int bits;
+	ATOM_INT rr;						// 新建的 socket（listen/connect/udp/bind）轮流分配到各个分片
+	struct socket_server **ss;
+	struct message_batch *batch;			// 每个分片一个，只在对应的 socket 线程中访问
+};
+
+static struct socket_group * SOCKET_SERVER = NULL;
+
+// socket id 所在的分片（无效的 id 也会映射到某个分片上，由它按无效 id 处理）
+static inline struct socket_server *
+id_server(int id) {
+	struct socket_group *g = SOCKET_SERVER;
+	return g->ss[((unsigned)id & ((1u << g->bits) - 1)) % g->count];
+}
+
+// 为新建的 socket 选择一个分片
+static inline struct socket_server *
+next_server() {
+	struct socket_group *g = SOCKET_SERVER;
+	if (g->count == 1)
+		return g->ss[0];
+	return g->ss[(unsigned)ATOM_FINC(&g->rr) % g->count];
+}
 
 void 
-skynet_socket_init() {
-	SOCKET_SERVER = socket_server_create(skynet_now());
+skynet_socket_init(int thread, int max_socket) {
+	struct socket_group *g = skynet_malloc(sizeof(*g));
+	g->count = thread > 0 ? thread : 1;
+	g->bits = 0;
+	while ((1 << g->bits) < g->count) {
+		++g->bits;
+	}
+	// 上限平均分到各个分片，每个分片取不小于它的 2 的幂
+	int slot_bits = 0;
+	if (max_socket > 0) {
+		int n = (max_socket + g->count - 1) / g->count;
+		while (slot_bits < 30 && (1 << slot_bits) < n) {
+			++slot_bits;
+		}
+	}
+	ATOM_INIT(&g->rr, 0);
+	g->ss = skynet_malloc(g->count * sizeof(struct socket_server *));
+	g->batch = skynet_malloc(g->count * sizeof(struct message_batch));
+	int i;
+	for (i=0;i<g->count;i++) {
+		g->batch[i].n = 0;
+		g->ss[i] = socket_server_create(skynet_now(), i, g->bits, slot_bits);
+		if (g->ss[i] == NULL) {
+			fprintf(stderr, "Create socket server failed\n");
+			exit(1);
+		}
+	}
+	socket_server_group(g->ss, g->count);
+	SOCKET_SERVER = g;
+}
+
+int
+skynet_socket_count() {
+	return SOCKET_SERVER->count;
 }
 
 void
 skynet_socket_exit() {
-	socket_server_exit(SOCKET_SERVER);
+	struct socket_group *g = SOCKET_SERVER;
+	int i;
+	for (i=0;i<g->count;i++) {
+		socket_server_exit(g->ss[i]);
+	}
 }
 
 void
 skynet_socket_free() {
-	socket_server_release(SOCKET_SERVER);
+	struct socket_group *g = SOCKET_SERVER;
+	int i;
+	for (i=0;i<g->count;i++) {
+		socket_server_release(g->ss[i]);
+	}
+	skynet_free(g->batch);
+	skynet_free(g->ss);
+	skynet_free(g);
 	SOCKET_SERVER = NULL;
 }
 
 void
 skynet_socket_updatetime() {
-	socket_server_updatetime(SOCKET_SERVER, skynet_now());
+	struct socket_group *g = SOCKET_SERVER;
+	uint64_t now = skynet_now();
+	int i;
+	for (i=0;i<g->count;i++) {
+		socket_server_updatetime(g->ss[i], now);
+	}
 }
 
-/// @brief 将触发的事件和事件的数据结果，打包成一条服务间的 skynet_message 消息，发送给指定的服务
+/// @brief 将触发的事件和事件的数据结果，打包成一条服务间的 skynet_message 消息
 /// @param type 消息类型
 /// @param padding 是否需要填充
 /// @param result 事件轮询器处理事件的数据结果
+/// @param message [out]打包好的消息
 static void
-forward_message(int type, bool padding, struct socket_message * result) {
+pack_message(int type, bool padding, struct socket_message * result, struct skynet_message *message) {
 	struct skynet_socket_message *sm;
 	size_t sz = sizeof(*sm);
 	if (padding) {
@@ -67,51 +153,84 @@ forward_message(int type, bool padding, struct socket_message * result) {
 	}
 
 	// 构造一条新的 skynet_message 消息
-	struct skynet_message message;
-	message.source = 0;
-	message.session = 0;
-	message.data = sm;
-	message.sz = sz | ((size_t)PTYPE_SOCKET << MESSAGE_TYPE_SHIFT);
-	
-	// push 到对应服务的消息队列中
-	if (skynet_context_push((uint32_t)result->opaque, &message)) {
+	message->source = 0;
+	message->session = 0;
+	message->data = sm;
+	message->sz = sz | ((size_t)PTYPE_SOCKET << MESSAGE_TYPE_SHIFT);
+}
+
+static inline void
+drop_message(struct skynet_message *message) {
+	struct skynet_socket_message *sm = message->data;
+	skynet_free(sm->buffer);
+	skynet_free(sm);
+}
+
+static void
+flush_message(struct message_batch *b) {
+	if (b->n == 0)
+		return;
+	if (skynet_context_push_batch(b->handle, b->msg, b->n)) {
 		// todo: report somewhere to close socket
 		// don't call skynet_socket_close here (It will block mainloop)
-		skynet_free(sm->buffer);
-		skynet_free(sm);
+		int i;
+		for (i=0;i<b->n;i++) {
+			drop_message(&b->msg[i]);
+		}
+	}
+	b->n = 0;
+}
+
+/// @brief 打包成 skynet_message 消息，攒下来发送给指定的服务，换了服务就先把之前的投递出去
+static void
+forward_message(struct message_batch *b, int type, bool padding, struct socket_message * result) {
+	uint32_t handle = (uint32_t)result->opaque;
+	if (b->n > 0 && b->handle != handle) {
+		flush_message(b);
+	}
+	b->handle = handle;
+	pack_message(type, padding, result, &b->msg[b->n++]);
+	if (b->n == FORWARD_BATCH) {
+		flush_message(b);
 	}
 }
 
 int 
-skynet_socket_poll() {
-	struct socket_server *ss = SOCKET_SERVER;
+skynet_socket_poll(int shard) {
+	struct socket_server *ss = SOCKET_SERVER->ss[shard];
 	assert(ss);
+	struct message_batch *batch = &SOCKET_SERVER->batch[shard];
 	struct socket_message result;
 	int more = 1;	// 还有剩余事件没处理完的标记
 	int type = socket_server_poll(ss, &result, &more);
 	switch (type) {
 	case SOCKET_EXIT:
+		flush_message(batch);
 		return 0;
 	case SOCKET_DATA:
-		forward_message(SKYNET_SOCKET_TYPE_DATA, false, &result);
+		forward_message(batch, SKYNET_SOCKET_TYPE_DATA, false, &result);
 		break;
 	case SOCKET_CLOSE:
-		forward_message(SKYNET_SOCKET_TYPE_CLOSE, false, &result);
+		forward_message(batch, SKYNET_SOCKET_TYPE_CLOSE, false, &result);
 		break;
 	case SOCKET_OPEN:
-		forward_message(SKYNET_SOCKET_TYPE_CONNECT, true, &result);
+		forward_message(batch, SKYNET_SOCKET_TYPE_CONNECT, true, &result);
 		break;
 	case SOCKET_ERR:
-		forward_message(SKYNET_SOCKET_TYPE_ERROR, true, &result);
+		forward_message(batch, SKYNET_SOCKET_TYPE_ERROR, true, &result);
 		break;
 	case SOCKET_ACCEPT:
-		forward_message(SKYNET_SOCKET_TYPE_ACCEPT, true, &result);
+		forward_message(batch, SKYNET_SOCKET_TYPE_ACCEPT, true, &result);
+		break;
+	case SOCKET_IDLE:
+		// 即将阻塞，投递攒下的消息
+		flush_message(batch);
 		break;
 	case SOCKET_UDP:
-		forward_message(SKYNET_SOCKET_TYPE_UDP, false, &result);
+		forward_message(batch, SKYNET_SOCKET_TYPE_UDP, false, &result);
 		break;
 	case SOCKET_WARNING:
-		forward_message(SKYNET_SOCKET_TYPE_WARNING, false, &result);
+		forward_message(batch, SKYNET_SOCKET_TYPE_WARNING, false, &result);
 		break;
 	default:
 		skynet_error(NULL, "Unknown socket message type %d.",type);
@@ -125,76 +244,97 @@ skynet_socket_poll() {
 
 int
 skynet_socket_sendbuffer(struct skynet_context *ctx, struct socket_sendbuffer *buffer) {
-	return socket_server_send(SOCKET_SERVER, buffer);
+	return socket_server_send(id_server(buffer->id), buffer);
 }
 
 int
 skynet_socket_sendbuffer_lowpriority(struct skynet_context *ctx, struct socket_sendbuffer *buffer) {
-	return socket_server_send_lowpriority(SOCKET_SERVER, buffer);
+	return socket_server_send_lowpriority(id_server(buffer->id), buffer);
+}
+
+int
+skynet_socket_sendfile(struct skynet_context *ctx, int id, int fd, int64_t offset, int64_t sz) {
+	return socket_server_sendfile(id_server(id), id, fd, offset, sz);
 }
 
 int 
 skynet_socket_listen(struct skynet_context *ctx, const char *host, int port, int backlog) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_listen(SOCKET_SERVER, source, host, port, backlog);
+	return socket_server_listen(next_server(), source, host, port, backlog);
+}
+
+int 
+skynet_socket_listen_reuseport(struct skynet_context *ctx, const char *host, int port, int backlog) {
+	uint32_t source = skynet_context_handle(ctx);
+	return socket_server_listen_reuseport(next_server(), source, host, port, backlog);
 }
 
 int 
 skynet_socket_connect(struct skynet_context *ctx, const char *host, int port) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_connect(SOCKET_SERVER, source, host, port);
+	return socket_server_connect(next_server(), source, host, port);
 }
 
 int 
 skynet_socket_bind(struct skynet_context *ctx, int fd) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_bind(SOCKET_SERVER, source, fd);
+	return socket_server_bind(next_server(), source, fd);
 }
 
 void 
 skynet_socket_close(struct skynet_context *ctx, int id) {
 	uint32_t source = skynet_context_handle(ctx);
-	socket_server_close(SOCKET_SERVER, source, id);
+	socket_server_close(id_server(id), source, id);
 }
 
 void 
 skynet_socket_shutdown(struct skynet_context *ctx, int id) {
 	uint32_t source = skynet_context_handle(ctx);
-	socket_server_shutdown(SOCKET_SERVER, source, id);
+	socket_server_shutdown(id_server(id), source, id);
 }
 
 void 
 skynet_socket_start(struct skynet_context *ctx, int id) {
 	uint32_t source = skynet_context_handle(ctx);
-	socket_server_start(SOCKET_SERVER, source, id);
+	socket_server_start(id_server(id), source, id);
 }
 
 void
 skynet_socket_pause(struct skynet_context *ctx, int id) {
 	uint32_t source = skynet_context_handle(ctx);
-	socket_server_pause(SOCKET_SERVER, source, id);
+	socket_server_pause(id_server(id), source, id);
 }
 
 
 void
 skynet_socket_nodelay(struct skynet_context *ctx, int id) {
-	socket_server_nodelay(SOCKET_SERVER, id);
+	socket_server_nodelay(id_server(id), id);
+}
+
+void
+skynet_socket_watermark(struct skynet_context *ctx, int id, int64_t high, int64_t low) {
+	socket_server_watermark(id_server(id), id, high, low);
+}
+
+int
+skynet_socket_overflow(struct skynet_context *ctx, int id) {
+	return socket_server_overflow(id_server(id), id);
 }
 
 int 
 skynet_socket_udp(struct skynet_context *ctx, const char * addr, int port) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_udp(SOCKET_SERVER, source, addr, port);
+	return socket_server_udp(next_server(), source, addr, port);
 }
 
 int 
 skynet_socket_udp_connect(struct skynet_context *ctx, int id, const char * addr, int port) {
-	return socket_server_udp_connect(SOCKET_SERVER, id, addr, port);
+	return socket_server_udp_connect(id_server(id), id, addr, port);
 }
 
 int 
 skynet_socket_udp_sendbuffer(struct skynet_context *ctx, const char * address, struct socket_sendbuffer *buffer) {
-	return socket_server_udp_send(SOCKET_SERVER, (const struct socket_udp_address *)address, buffer);
+	return socket_server_udp_send(id_server(buffer->id), (const struct socket_udp_address *)address, buffer);
 }
 
 const char *
@@ -207,10 +347,30 @@ skynet_socket_udp_address(struct skynet_socket_message *msg, int *addrsz) {
 	sm.opaque = 0;
 	sm.ud = msg->ud;
 	sm.data = msg->buffer;
-	return (const char *)socket_server_udp_address(SOCKET_SERVER, &sm, addrsz);
+	return (const char *)socket_server_udp_address(id_server(sm.id), &sm, addrsz);
 }
 
 struct socket_info *
 skynet_socket_info() {
-	return socket_server_info(SOCKET_SERVER);
+	struct socket_group *g = SOCKET_SERVER;
+	struct socket_info *si = NULL;
+	int i;
+	// 把各个分片的列表串起来
+	for (i=g->count-1;i>=0;i--) {
+		struct socket_info *list = socket_server_info(g->ss[i]);
+		if (list) {
+			struct socket_info *tail = list;
+			while (tail->next) {
+				tail = tail->next;
+			}
+			tail->next = si;
+			si = list;
+		}
+	}
+	return si;
+}
+
+void
+skynet_socket_free_buffer(void *buffer, int sz) {
+	socket_server_free_buffer(buffer, sz);
 }
@@ -21,15 +21,18 @@ struct skynet_socket_message {
 	char * buffer;
 };
 
-void skynet_socket_init();
+void skynet_socket_init(int thread, int max_socket);	// one socket server (shard) per socket thread, max_socket 0 means 65536 per shard
+int skynet_socket_count();
 void skynet_socket_exit();
 void skynet_socket_free();
-int skynet_socket_poll();
+int skynet_socket_poll(int shard);
 void skynet_socket_updatetime();
 
 int skynet_socket_sendbuffer(struct skynet_context *ctx, struct socket_sendbuffer *buffer);
 int skynet_socket_sendbuffer_lowpriority(struct skynet_context *ctx, struct socket_sendbuffer *buffer);
+int skynet_socket_sendfile(struct skynet_context *ctx, int id, int fd, int64_t offset, int64_t sz);
 int skynet_socket_listen(struct skynet_context *ctx, const char *host, int port, int backlog);
+int skynet_socket_listen_reuseport(struct skynet_context *ctx, const char *host, int port, int backlog);
 int skynet_socket_connect(struct skynet_context *ctx, const char *host, int port);
 int skynet_socket_bind(struct skynet_context *ctx, int fd);
 void skynet_socket_close(struct skynet_context *ctx, int id);
@@ -37,6 +40,8 @@ void skynet_socket_shutdown(struct skynet_context *ctx, int id);
 void skynet_socket_start(struct skynet_context *ctx, int id);
 void skynet_socket_pause(struct skynet_context *ctx, int id);
 void skynet_socket_nodelay(struct skynet_context *ctx, int id);
+void skynet_socket_watermark(struct skynet_context *ctx, int id, int64_t high, int64_t low);
+int skynet_socket_overflow(struct skynet_context *ctx, int id);
 
 int skynet_socket_udp(struct skynet_context *ctx, const char * addr, int port);
 int skynet_socket_udp_connect(struct skynet_context *ctx, int id, const char * addr, int port);
@@ -44,6 +49,8 @@ int skynet_socket_udp_sendbuffer(struct skynet_context *ctx, const char * addres
 const char * skynet_socket_udp_address(struct skynet_socket_message *, int *addrsz);
 
 struct socket_info * skynet_socket_info();
+// free the buffer of SKYNET_SOCKET_TYPE_DATA message (not UDP), it may be reused by later reads
+void skynet_socket_free_buffer(void *buffer, int sz);
 
 // legacy APIs
 
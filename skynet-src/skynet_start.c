@@ -1,3 +1,7 @@
+#if defined(__linux__)
+#define _GNU_SOURCE		// for pthread_setaffinity_np
+#endif
+
 #include "skynet.h"
 #include "skynet_server.h"
 #include "skynet_imp.h"
@@ -9,8 +13,12 @@
 #include "skynet_socket.h"
 #include "skynet_daemon.h"
 #include "skynet_harbor.h"
+#include "skynet_park.h"
+#include "malloc_hook.h"
 
 #include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <assert.h>
 #include <stdio.h>
@@ -18,15 +26,24 @@
 #include <string.h>
 #include <signal.h>
 
+#define MAX_CPU 1024
+
+/* 线程绑定的 cpu 集合（n 为 0 表示不绑定） */
+struct cpu_affinity {
+	int n;
+	int cpu[MAX_CPU];
+	int arena;						// numa 模式下线程绑定的 jemalloc arena ，-1 表示不绑定
+};
+
 /* 监控器，用于监控所有worker线程状态的结构体 */
 struct monitor {
 	int count;						// skynet的worker线程总量
 	struct skynet_monitor ** m;		// 次级监控器列表，一个监控器监控一个worker线程
-	pthread_cond_t cond;			// 唤醒 worker 线程用的全局条件
-	pthread_mutex_t mutex;
-	int sleep;						// 睡眠中的线程数数量
 	int quit;						// 退出标记
+	struct cpu_affinity socket_cpu;	// socket 线程绑定的 cpu
+	struct cpu_affinity timer_cpu;	// timer 线程绑定的 cpu
 };
+// worker 线程的休眠和唤醒由 skynet_park 管理：每个 worker 一个休眠槽位，服务队列放入全局队列时精确唤醒一个空闲 worker
 // 和 monitor 线程同名，但该结构体并不是 monitor 线程的专用数据，而是给所有需要调度 worker 线程的线程使用的。
 
 /* worker 线程入口函数的传入参数 */
@@ -34,6 +51,8 @@ struct worker_parm {
 	struct monitor *m;		// 全局的monitor实例地址（一个skynet进程只有一个monitor实例，由主线程管理其生命周期）
 	int id;					// worker 线程id
 	int weight;				// worker 线程每次处理的工作量权重
+	int cpu;				// 绑定的 cpu ，-1 表示不绑定
+	int arena;				// 绑定的 jemalloc arena ，-1 表示不绑定
 };
 // 每个 worker 线程都有一个属于自己的参数结构体 worker_parm，用来保存一些本线程的参数。
 
@@ -56,27 +75,110 @@ create_thread(pthread_t *thread, void *(*start_routine) (void *), void *arg) {
 	}
 }
 
+/// @brief 解析 cpu 列表，格式如 "0-3,8,10-11"
+/// @return 0 成功，-1 格式错误
+static int
+parse_cpulist(const char *str, struct cpu_affinity *a) {
+	a->n = 0;
+	a->arena = -1;
+	if (str == NULL)
+		return 0;
+	const char *p = str;
+	while (*p) {
+		char *end;
+		long from = strtol(p, &end, 10);
+		if (end == p || from < 0)
+			return -1;
+		long to = from;
+		p = end;
+		if (*p == '-') {
+			++p;
+			to = strtol(p, &end, 10);
+			if (end == p || to < from)
+				return -1;
+			p = end;
+		}
+		long i;
+		for (i=from;i<=to && a->n < MAX_CPU;i++) {
+			a->cpu[a->n++] = (int)i;
+		}
+		while (*p == ',' || *p == ' ')
+			++p;
+	}
+	return 0;
+}
+
+/// @brief 把当前线程绑定到一组 cpu 上
+static void
+bind_cpu(const int *cpu, int n) {
+	if (n <= 0)
+		return;
+#if defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	int i;
+	for (i=0;i<n;i++) {
+		if (cpu[i] < CPU_SETSIZE)
+			CPU_SET(cpu[i], &set);
+	}
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err) {
+		fprintf(stderr, "Bind thread to cpu %d failed : %s\n", cpu[0], strerror(err));
+	}
+#else
+	fprintf(stderr, "Thread affinity is not supported\n");
+#endif
+}
+
+/// @brief 查询 cpu 所在的 NUMA 节点（读取 /sys/devices/system/cpu/cpuN/nodeM），查不到返回 0
+static int
+cpu_node(int cpu) {
+	char path[64];
+	sprintf(path, "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR *dir = opendir(path);
+	if (dir == NULL)
+		return 0;
+	int node = 0;
+	struct dirent *ent;
+	while ((ent = readdir(dir))) {
+		if (strncmp(ent->d_name, "node", 4) == 0 && ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+			node = strtol(ent->d_name + 4, NULL, 10);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
 static void
-wakeup(struct monitor *m, int busy) {
-	if (m->sleep >= m->count - busy) {
-		// signal sleep worker, "spurious wakeup" is harmless
-		pthread_cond_signal(&m->cond);
+bind_thread(struct cpu_affinity *a) {
+	bind_cpu(a->cpu, a->n);
+	if (a->arena >= 0) {
+		malloc_bind_arena(a->arena);
 	}
 }
 
+/* socket 线程的参数 */
+struct socket_parm {
+	struct monitor *m;
+	int id;					// 负责的 socket_server 分片
+};
+
 static void *
 thread_socket(void *p) {
-	struct monitor * m = p;
+	struct socket_parm *sp = p;
+	struct monitor * m = sp->m;
+	bind_thread(&m->socket_cpu);
 	skynet_initthread(THREAD_SOCKET);
 	for (;;) {
-		int r = skynet_socket_poll();
+		int r = skynet_socket_poll(sp->id);
 		if (r==0)
 			break;
 		if (r<0) {
 			CHECK_ABORT
 			continue;	// 一般是还有消息没处理完，直接继续循环
 		}
-		wakeup(m,0);	// 尝试唤醒一个 worker 线程（只有全部worker线程都处于睡眠状态才回去唤醒，否则不做处理）
+		// 投递消息时 skynet_mq_push 已经唤醒了空闲的 worker 线程，这里不需要再唤醒
 	}
 	return NULL;
 }
@@ -88,8 +190,6 @@ free_monitor(struct monitor *m) {
 	for (i=0;i<n;i++) {
 		skynet_monitor_delete(m->m[i]);
 	}
-	pthread_mutex_destroy(&m->mutex);
-	pthread_cond_destroy(&m->cond);
 	skynet_free(m->m);
 	skynet_free(m);
 }
@@ -136,13 +236,13 @@ signal_hup() {
 static void *
 thread_timer(void *p) {
 	struct monitor * m = p;
+	bind_thread(&m->timer_cpu);
 	skynet_initthread(THREAD_TIMER);
 	for (;;) {
 		skynet_updatetime();
 		skynet_socket_updatetime();
 		CHECK_ABORT
-		wakeup(m,m->count-1);
-		usleep(2500);			// 睡眠2.5ms
+		skynet_timer_sleep();	// 等待下一个 tick（timerfd），不支持时睡眠 1/4 个 tick
 		if (SIG) {
 			signal_hup();
 			SIG = 0;
@@ -151,10 +251,8 @@ thread_timer(void *p) {
 	// wakeup socket thread
 	skynet_socket_exit();
 	// wakeup all worker thread
-	pthread_mutex_lock(&m->mutex);
 	m->quit = 1;
-	pthread_cond_broadcast(&m->cond);
-	pthread_mutex_unlock(&m->mutex);
+	skynet_park_wakeall();
 	return NULL;
 }
 
@@ -165,64 +263,117 @@ thread_worker(void *p) {
 	int weight = wp->weight;
 	struct monitor *m = wp->m;
 	struct skynet_monitor *sm = m->m[id];
+	if (wp->cpu >= 0) {
+		bind_cpu(&wp->cpu, 1);
+	}
+	if (wp->arena >= 0) {
+		malloc_bind_arena(wp->arena);	// numa 模式下同一节点的 worker 共用一个 arena
+	}
 	skynet_initthread(THREAD_WORKER);
+	skynet_globalmq_bind(id);		// steal 模式下绑定本线程的本地队列
 	struct message_queue * q = NULL;
+	int spin = skynet_park_spin();
+	int idle = 0;
 	while (!m->quit) {
 		q = skynet_context_message_dispatch(sm, q, weight);	// 从全局队列中取weight个数量的消息进程处理
-		if (q == NULL) {
-			// 全局队列中暂时没有待处理的消息队列，休眠本worker线程
-			if (pthread_mutex_lock(&m->mutex) == 0) {
-				++ m->sleep;
-				// "spurious wakeup" is harmless,
-				// because skynet_context_message_dispatch() can be call at any time.
-				if (!m->quit)
-					pthread_cond_wait(&m->cond, &m->mutex);		// 等待被其他线程唤醒（一般情况是timer线程和socket线程）
-				-- m->sleep;
-				if (pthread_mutex_unlock(&m->mutex)) {
-					fprintf(stderr, "unlock mutex error");
-					exit(1);
-				}
-			}
+		if (q) {
+			idle = 0;
+			continue;
+		}
+		// 全局队列中暂时没有待处理的消息队列，先自旋重试 spin 次，再休眠本worker线程
+		if (idle < spin) {
+			++idle;
+			continue;
+		}
+		idle = 0;
+		skynet_park_prepare(id);
+		// 登记休眠后必须再检查一次，避免错过登记之前刚放入全局队列的服务队列
+		if (m->quit || (q = skynet_globalmq_recheck())) {
+			skynet_park_cancel(id);
+			continue;
 		}
+		skynet_park_wait(id);		// 等待被投递消息的线程唤醒
 	}
 	return NULL;
 }
 
+// 创建 node 节点的 arena，同一节点的线程共用（没有 jemalloc 时返回 -1）
+static int
+node_arena(int *arena, int node) {
+	if (node >= MAX_CPU)
+		return -1;
+	if (arena[node] == -2) {
+		arena[node] = malloc_create_arena();
+	}
+	return arena[node];
+}
+
 /// @brief 启动全部线程
-/// @param thread worker线程数量
+/// @param config 启动配置（worker线程数量，线程绑定的 cpu 和 numa 模式）
 static void
-start(int thread) {
-	pthread_t pid[thread+3];
+start(struct skynet_config * config) {
+	int thread = config->thread;
+	int nsocket = skynet_socket_count();
+	int base = 2 + nsocket;		// worker 线程在 pid 中的起始位置
+	pthread_t pid[thread+base];
 
 	struct monitor *m = skynet_malloc(sizeof(*m));
 	memset(m, 0, sizeof(*m));
 	m->count = thread;
-	m->sleep = 0;
 
-	// 每条 worker 线程分配一个 skynet_monitor 监控
-	m->m = skynet_malloc(thread * sizeof(struct skynet_monitor *));
+	struct cpu_affinity * worker_cpu = skynet_malloc(sizeof(*worker_cpu));
+	if (parse_cpulist(config->socket_cpu, &m->socket_cpu) ||
+		parse_cpulist(config->timer_cpu, &m->timer_cpu) ||
+		parse_cpulist(config->worker_cpu, worker_cpu)) {
+		fprintf(stderr, "Invalid cpu list in config\n");
+		exit(1);
+	}
 	int i;
-	for (i=0;i<thread;i++) {
-		m->m[i] = skynet_monitor_new();
+	if (config->numa && worker_cpu->n == 0) {
+		// numa 模式需要知道每个 worker 所在的节点，没有配置 worker_cpu 时依次绑定到全部在线的 cpu 上
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		for (i=0;i<ncpu && i<MAX_CPU;i++) {
+			worker_cpu->cpu[worker_cpu->n++] = i;
+		}
 	}
-	if (pthread_mutex_init(&m->mutex, NULL)) {
-		fprintf(stderr, "Init mutex error");
-		exit(1);
+	int node[thread];
+	int arena[MAX_CPU];
+	for (i=0;i<MAX_CPU;i++) {
+		arena[i] = -2;	// 未创建
 	}
-	if (pthread_cond_init(&m->cond, NULL)) {
-		fprintf(stderr, "Init cond error");
-		exit(1);
+	if (config->numa) {
+		for (i=0;i<thread;i++) {
+			node[i] = cpu_node(worker_cpu->cpu[i % worker_cpu->n]);
+		}
+		skynet_globalmq_numa(node);
+		if (m->socket_cpu.n > 0) {
+			m->socket_cpu.arena = node_arena(arena, cpu_node(m->socket_cpu.cpu[0]));
+		}
+		if (m->timer_cpu.n > 0) {
+			m->timer_cpu.arena = node_arena(arena, cpu_node(m->timer_cpu.cpu[0]));
+		}
 	}
 
+	// 每条 worker 线程分配一个 skynet_monitor 监控
+	m->m = skynet_malloc(thread * sizeof(struct skynet_monitor *));
+	for (i=0;i<thread;i++) {
+		m->m[i] = skynet_monitor_new();
+	}
 	create_thread(&pid[0], thread_monitor, m);	// 过载线程 1个
 	create_thread(&pid[1], thread_timer, m);	// 定时器线程 1个
-	create_thread(&pid[2], thread_socket, m);	// socket线程 1个
+	struct socket_parm sp[nsocket];
+	for (i=0;i<nsocket;i++) {
+		sp[i].m = m;
+		sp[i].id = i;
+		create_thread(&pid[2+i], thread_socket, &sp[i]);	// socket线程 socket_thread 个，默认 1 个
+	}
 
 	// worker 线程每次处理的工作量权重（是服务队列中消息总数右移的位数，小于 0 的每次只读一条）\
 	 前四个线程每次只处理一条消息 \
      后面的四个每次处理队列中的全部消息 \
      再后面分别是每次 1/2，1/4，1/8
 	// 不同权重的目的是为了尽量让不同的 worker 线程的步骤不一样，从而减轻在全局消息队列那里的锁竞争问题
+	// 只在 dispatch = "weight" （默认）时使用，adaptive 策略下由 skynet_context_message_dispatch 自行计算
 	static int weight[] = { 
 		-1, -1, -1, -1, 0, 0, 0, 0,
 		1, 1, 1, 1, 1, 1, 1, 1, 
@@ -237,14 +388,18 @@ start(int thread) {
 		} else {
 			wp[i].weight = 0;
 		}
-		create_thread(&pid[i+3], thread_worker, &wp[i]);	// worker线程 （业务线程）
+		// 配置了 worker_cpu 时，worker 线程依次绑定到列表中的 cpu 上（每个线程一个）
+		wp[i].cpu = worker_cpu->n > 0 ? worker_cpu->cpu[i % worker_cpu->n] : -1;
+		wp[i].arena = config->numa ? node_arena(arena, node[i]) : -1;
+		create_thread(&pid[i+base], thread_worker, &wp[i]);	// worker线程 （业务线程）
 	}
 
-	for (i=0;i<thread+3;i++) {
+	for (i=0;i<thread+base;i++) {
 		pthread_join(pid[i], NULL); 		// 主线程阻塞
 	}
 
 	free_monitor(m);
+	skynet_free(worker_cpu);
 }
 
 /// @brief 加载 bootstrap 引导模块
@@ -302,20 +457,45 @@ skynet_start(struct skynet_config * config) {
 	skynet_handle_init(config->harbor);
 
 	// 初始化全局消息队列
-	skynet_mq_init();
+	int schedule = MQ_SCHEDULE_GLOBAL;
+	if (strcmp(config->scheduler, "steal") == 0) {
+		schedule = MQ_SCHEDULE_STEAL;
+	} else if (strcmp(config->scheduler, "global") != 0) {
+		fprintf(stderr, "Unknown scheduler %s, use global\n", config->scheduler);
+	}
+	if (config->numa && schedule != MQ_SCHEDULE_STEAL) {
+		// numa 模式依赖每个 worker 的本地队列
+		fprintf(stderr, "NUMA mode need scheduler steal, use steal\n");
+		schedule = MQ_SCHEDULE_STEAL;
+	}
+	skynet_mq_init(config->thread, schedule);
+
+	// 初始化 worker 线程的休眠槽位
+	skynet_park_init(config->thread, config->spin);
 
 	// 初始化 C 模块管理器，设置查找路径，主要用于加载符合Skynet服务模块接口的动态链接库（.so
 	skynet_module_init(config->module_path);
 
 	// 初始化定时器模块（全局时间）
-	skynet_timer_init();
+	// timer_shard 默认与 worker 线程数相同
+	skynet_timer_init(config->timer_shard > 0 ? config->timer_shard : config->thread, strcmp(config->timer_resolution, "ms") == 0);
 
 	// 初始化网络模块（socket管理器）
-	skynet_socket_init();
+	skynet_socket_init(config->socket_thread, config->max_socket);
 
 	// 标记是否开了性能测试
 	skynet_profile_enable(config->profile);
 
+	// 每次调度处理的消息数量策略
+	if (strcmp(config->dispatch, "adaptive") == 0) {
+		if (!config->profile) {
+			fprintf(stderr, "Adaptive dispatch need profile, use weight\n");
+		}
+		skynet_dispatch_timeslice(config->timeslice);
+	} else if (strcmp(config->dispatch, "weight") != 0) {
+		fprintf(stderr, "Unknown dispatch %s, use weight\n", config->dispatch);
+	}
+
 	// 创建并启动 logger C服务
 	struct skynet_context *ctx = skynet_context_new(config->logservice, config->logger);
 	if (ctx == NULL) {
@@ -330,11 +510,12 @@ skynet_start(struct skynet_config * config) {
 	bootstrap(ctx, config->bootstrap);
 
 	// 启动全部线程
-	start(config->thread);
+	start(config);
 
 	// harbor_exit may call socket send, so it should exit before socket_free
 	skynet_harbor_exit();
 	skynet_socket_free();
+	skynet_park_free();
 	if (config->daemon) {
 		daemon_exit(config->daemon);
 	}
@@ -12,7 +12,14 @@
 #include <stdlib.h>
 #include <stdint.h>
 
-typedef void (*timer_execute_func)(void *ud,void *arg);
+#if defined(__linux__)
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <errno.h>
+#define USE_TIMERFD
+#else
+#include <unistd.h>
+#endif
 
 #define TIME_NEAR_SHIFT 8
 #define TIME_NEAR (1 << TIME_NEAR_SHIFT)
@@ -21,6 +28,13 @@ typedef void (*timer_execute_func)(void *ud,void *arg);
 #define TIME_NEAR_MASK (TIME_NEAR-1)
 #define TIME_LEVEL_MASK (TIME_LEVEL-1)
 
+#define TIMER_POOL_CHUNK 256	// 节点池每次扩容的节点数量
+#define TIMER_MAX_SHARD 256		// timer id 的低 8 位是分片编号
+#define TIMER_GEN_MASK 0xffffff	// 节点每次回收时递增的版本号，让旧的 timer id 失效
+#define DISPATCH_BATCH 32		// 同一个服务连续到期的消息一次最多压入的条数
+
+/* timer id : (节点编号 + 1) << 32 | 版本号 << 8 | 分片编号 */
+
 /**/
 struct timer_event {
 	uint32_t handle;
@@ -29,7 +43,12 @@ struct timer_event {
 
 struct timer_node {
 	struct timer_node *next;
+	struct timer_node *prev;	// 双向链表，取消时 O(1) 摘除
+	struct link_list *list;		// 所在的链表，NULL 表示不在时间轮中（空闲或正在派发）
 	uint32_t expire;
+	uint32_t index;				// 在分片节点池中的编号
+	uint32_t gen;				// 版本号
+	struct timer_event event;
 };
 
 struct link_list {
@@ -37,17 +56,32 @@ struct link_list {
 	struct timer_node *tail;
 };
 
+/* 一个时间轮分片，服务按 handle 散列到不同的分片上，各分片独立加锁 */
 struct timer {
 	struct link_list near[TIME_NEAR];
 	struct link_list t[4][TIME_LEVEL];
 	struct spinlock lock;
 	uint32_t time;
+	struct timer_node *freelist;	// 回收的节点，避免每个 timeout 都 malloc/free 一次
+	struct timer_node **chunk;		// 节点池的每一批节点，用于通过编号找到节点
+	int nchunk;
+	int cap;
+	int id;							// 分片编号
+};
+
+struct timer_system {
+	int count;					// 分片数量
+	struct timer **shard;
+	int scale;					// 每个 centisecond 的 tick 数（默认 1 ，毫秒模式为 10）
 	uint32_t starttime;			// skynet 进程启动时间
-	uint64_t current;			// 进程启动到现在的相对时间（由于timer线程会sleep 2.5ms，因此这个时间是个近似时间，精度为2.5ms）
-	uint64_t current_point;
+	uint64_t origin;			// 启动时的 centisecond 部分
+	uint64_t elapsed;			// 启动到现在经过的 tick 数
+	uint64_t current;			// 进程启动到现在的相对时间（centisecond，精度为一个 tick）
+	uint64_t current_point;		// 上次更新时的单调时钟（tick）
+	int fd;						// timerfd ，-1 表示不可用，timer 线程退化为 usleep
 };
 
-static struct timer * TI = NULL;
+static struct timer_system * TI = NULL;
 
 static inline struct timer_node *
 link_clear(struct link_list *list) {
@@ -58,20 +92,34 @@ link_clear(struct link_list *list) {
 	return ret;
 }
 
+// 不能叫 link ，会和 unistd.h 中的 link() 冲突
 static inline void
-link(struct link_list *list,struct timer_node *node) {
+link_node(struct link_list *list,struct timer_node *node) {
+	node->prev = list->tail;
+	node->list = list;
 	list->tail->next = node;
 	list->tail = node;
 	node->next=0;
 }
 
+static inline void
+link_remove(struct timer_node *node) {
+	node->prev->next = node->next;
+	if (node->next) {
+		node->next->prev = node->prev;
+	} else {
+		node->list->tail = node->prev;
+	}
+	node->list = NULL;
+}
+
 static void
 add_node(struct timer *T,struct timer_node *node) {
 	uint32_t time=node->expire;
 	uint32_t current_time=T->time;
 	
 	if ((time|TIME_NEAR_MASK)==(current_time|TIME_NEAR_MASK)) {
-		link(&T->near[time&TIME_NEAR_MASK],node);
+		link_node(&T->near[time&TIME_NEAR_MASK],node);
 	} else {
 		int i;
 		uint32_t mask=TIME_NEAR << TIME_LEVEL_SHIFT;
@@ -82,21 +130,55 @@ add_node(struct timer *T,struct timer_node *node) {
 			mask <<= TIME_LEVEL_SHIFT;
 		}
 
-		link(&T->t[i][((time>>(TIME_NEAR_SHIFT + i*TIME_LEVEL_SHIFT)) & TIME_LEVEL_MASK)],node);	
+		link_node(&T->t[i][((time>>(TIME_NEAR_SHIFT + i*TIME_LEVEL_SHIFT)) & TIME_LEVEL_MASK)],node);	
 	}
 }
 
-static void
-timer_add(struct timer *T,void *arg,size_t sz,int time) {
-	struct timer_node *node = (struct timer_node *)skynet_malloc(sizeof(*node)+sz);
-	memcpy(node+1,arg,sz);
+// 从节点池中取一个节点（需要持有锁），池空时一次分配一批，这些节点不再归还给系统
+static inline struct timer_node *
+node_alloc(struct timer *T) {
+	struct timer_node *node = T->freelist;
+	if (node == NULL) {
+		if (T->nchunk >= T->cap) {
+			T->cap = T->cap ? T->cap * 2 : 16;
+			T->chunk = (struct timer_node **)skynet_realloc(T->chunk, T->cap * sizeof(struct timer_node *));
+		}
+		node = (struct timer_node *)skynet_malloc(sizeof(*node) * TIMER_POOL_CHUNK);
+		int i;
+		for (i=0;i<TIMER_POOL_CHUNK;i++) {
+			node[i].next = &node[i+1];
+			node[i].list = NULL;
+			node[i].index = T->nchunk * TIMER_POOL_CHUNK + i;
+			node[i].gen = 0;
+		}
+		node[TIMER_POOL_CHUNK-1].next = NULL;
+		T->chunk[T->nchunk++] = node;
+		T->freelist = &node[1];
+		return node;
+	}
+	T->freelist = node->next;
+	return node;
+}
 
+// 节点离开时间轮（到期或取消）时，递增版本号使它的 timer id 失效
+static inline void
+node_expire(struct timer_node *node) {
+	node->list = NULL;
+	node->gen = (node->gen + 1) & TIMER_GEN_MASK;
+}
+
+static int64_t
+timer_add(struct timer *T,const struct timer_event *event,int time) {
 	SPIN_LOCK(T);
 
+		struct timer_node *node = node_alloc(T);
+		node->event = *event;
 		node->expire=time+T->time;
 		add_node(T,node);
+		int64_t id = (int64_t)(node->index + 1) << 32 | (int64_t)node->gen << 8 | T->id;
 
 	SPIN_UNLOCK(T);
+	return id;
 }
 
 static void
@@ -132,22 +214,32 @@ timer_shift(struct timer *T) {
 	}
 }
 
-static inline void
+// 派发一串到期的节点，连续到期的同一个服务的消息一次压入消息队列，返回链表的最后一个节点，以便整串归还节点池
+static inline struct timer_node *
 dispatch_list(struct timer_node *current) {
+	struct skynet_message message[DISPATCH_BATCH];
+	uint32_t handle = 0;
+	int n = 0;
+	struct timer_node *last;
 	do {
-		struct timer_event * event = (struct timer_event *)(current+1);
-		struct skynet_message message;
-		message.source = 0;
-		message.session = event->session;
-		message.data = NULL;
-		message.sz = (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
-
-		skynet_context_push(event->handle, &message);
-		
-		struct timer_node * temp = current;
+		struct timer_event * event = &current->event;
+		if (n > 0 && (event->handle != handle || n == DISPATCH_BATCH)) {
+			// 服务已经退出时 push 失败，定时器消息没有数据需要释放
+			skynet_context_push_batch(handle, message, n);
+			n = 0;
+		}
+		handle = event->handle;
+		message[n].source = 0;
+		message[n].session = event->session;
+		message[n].data = NULL;
+		message[n].sz = (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
+		++n;
+
+		last = current;
 		current=current->next;
-		skynet_free(temp);	
 	} while (current);
+	skynet_context_push_batch(handle, message, n);
+	return last;
 }
 
 static inline void
@@ -156,10 +248,16 @@ timer_execute(struct timer *T) {
 	
 	while (T->near[idx].head.next) {
 		struct timer_node *current = link_clear(&T->near[idx]);
+		struct timer_node *node;
+		for (node=current;node;node=node->next) {
+			node_expire(node);	// 派发期间不能再被取消
+		}
 		SPIN_UNLOCK(T);
 		// dispatch_list don't need lock T
-		dispatch_list(current);
+		struct timer_node *last = dispatch_list(current);
 		SPIN_LOCK(T);
+		last->next = T->freelist;
+		T->freelist = current;
 	}
 }
 
@@ -178,8 +276,100 @@ timer_update(struct timer *T) {
 	SPIN_UNLOCK(T);
 }
 
+// 在锁内摘下当前 tick 到期的全部节点，接到 expired 的尾部
+static inline void
+timer_collect(struct timer *T, struct link_list *expired) {
+	struct link_list *list = &T->near[T->time & TIME_NEAR_MASK];
+	if (list->head.next) {
+		struct timer_node *node;
+		for (node=list->head.next;node;node=node->next) {
+			node_expire(node);
+		}
+		expired->tail->next = list->head.next;
+		expired->tail = list->tail;
+		link_clear(list);
+	}
+}
+
+struct timer_dispatch {
+	uint32_t handle;
+	int seq;		// 到期的先后顺序，同一个服务的消息保持这个顺序
+	int session;
+};
+
+static int
+compar_dispatch(const void *a, const void *b) {
+	const struct timer_dispatch *da = a;
+	const struct timer_dispatch *db = b;
+	if (da->handle != db->handle)
+		return da->handle < db->handle ? -1 : 1;
+	return da->seq - db->seq;
+}
+
+// 把到期的节点按服务分组，每个服务只压一次消息队列，返回链表的最后一个节点
+static struct timer_node *
+dispatch_grouped(struct timer_node *current) {
+	int n = 0;
+	struct timer_node *node, *last = NULL;
+	for (node=current;node;node=node->next) {
+		++n;
+		last = node;
+	}
+	struct timer_dispatch *d = (struct timer_dispatch *)skynet_malloc(n * sizeof(*d));
+	int i;
+	for (i=0,node=current;node;node=node->next,i++) {
+		d[i].handle = node->event.handle;
+		d[i].seq = i;
+		d[i].session = node->event.session;
+	}
+	qsort(d, n, sizeof(*d), compar_dispatch);
+	struct skynet_message *message = (struct skynet_message *)skynet_malloc(n * sizeof(*message));
+	for (i=0;i<n;i++) {
+		message[i].source = 0;
+		message[i].session = d[i].session;
+		message[i].data = NULL;
+		message[i].sz = (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
+	}
+	int from = 0;
+	for (i=1;i<=n;i++) {
+		if (i == n || d[i].handle != d[from].handle) {
+			// 服务已经退出时 push 失败，定时器消息没有数据需要释放
+			skynet_context_push_batch(d[from].handle, &message[from], i - from);
+			from = i;
+		}
+	}
+	skynet_free(message);
+	skynet_free(d);
+	return last;
+}
+
+// 时间线程卡顿后一次推进 n 个 tick：只加一次锁，收集全部到期的节点，解锁后按服务分组派发
+static void
+timer_fastforward(struct timer *T, uint32_t n) {
+	struct link_list expired;
+	link_clear(&expired);
+
+	SPIN_LOCK(T);
+	timer_collect(T, &expired);
+	uint32_t i;
+	for (i=0;i<n;i++) {
+		timer_shift(T);
+		timer_collect(T, &expired);
+	}
+	SPIN_UNLOCK(T);
+
+	struct timer_node *current = expired.head.next;
+	if (current) {
+		struct timer_node *last = dispatch_grouped(current);
+		SPIN_LOCK(T);
+		last->next = T->freelist;
+		T->freelist = current;
+		SPIN_UNLOCK(T);
+	}
+}
+
 static struct timer *
-timer_create_timer() {
+timer_create_timer(int id) {
 	struct timer *r=(struct timer *)skynet_malloc(sizeof(struct timer));
 	memset(r,0,sizeof(*r));
 
@@ -197,14 +387,23 @@ timer_create_timer() {
 
 	SPIN_INIT(r)
 
-	r->current = 0;
+	r->freelist = NULL;
+	r->chunk = NULL;
+	r->nchunk = 0;
+	r->cap = 0;
+	r->id = id;
 
 	return r;
 }
 
-int
-skynet_timeout(uint32_t handle, int time, int session) {
-	if (time <= 0) {
+static inline struct timer *
+timer_shard(uint32_t handle) {
+	return TI->shard[handle % TI->count];
+}
+
+static int64_t
+timeout_tick(uint32_t handle, int tick, int session) {
+	if (tick <= 0) {
 		struct skynet_message message;
 		message.source = 0;
 		message.session = session;
@@ -214,14 +413,51 @@ skynet_timeout(uint32_t handle, int time, int session) {
 		if (skynet_context_push(handle, &message)) {
 			return -1;
 		}
+		return 0;
 	} else {
 		struct timer_event event;
 		event.handle = handle;
 		event.session = session;
-		timer_add(TI, &event, sizeof(event), time);
+		return timer_add(timer_shard(handle), &event, tick);
 	}
+}
 
-	return session;
+int64_t
+skynet_timeout(uint32_t handle, int time, int session) {
+	return timeout_tick(handle, time * TI->scale, session);
+}
+
+// 毫秒模式下精确到 tick ，否则向上取整到 centisecond
+int64_t
+skynet_timeout_ms(uint32_t handle, int ms, int session) {
+	return timeout_tick(handle, (int)(((int64_t)ms * TI->scale + 9) / 10), session);
+}
+
+int
+skynet_timeout_cancel(uint32_t handle, int64_t id) {
+	if (id <= 0)
+		return 0;
+	int shard = (int)(id & (TIMER_MAX_SHARD - 1));
+	uint32_t gen = (uint32_t)(id >> 8) & TIMER_GEN_MASK;
+	uint32_t index = (uint32_t)(id >> 32) - 1;
+	if (shard >= TI->count)
+		return 0;
+	struct timer *T = TI->shard[shard];
+	int ret = 0;
+	SPIN_LOCK(T);
+	if (index < (uint32_t)T->nchunk * TIMER_POOL_CHUNK) {
+		struct timer_node *node = &T->chunk[index / TIMER_POOL_CHUNK][index % TIMER_POOL_CHUNK];
+		// 版本号不同说明节点已经到期或者被复用；只能取消自己的 timer
+		if (node->list && node->gen == gen && node->event.handle == handle) {
+			link_remove(node);
+			node_expire(node);
+			node->next = T->freelist;
+			T->freelist = node;
+			ret = 1;
+		}
+	}
+	SPIN_UNLOCK(T);
+	return ret;
 }
 
 // centisecond: 1/100 second
@@ -233,13 +469,15 @@ systime(uint32_t *sec, uint32_t *cs) {
 	*cs = (uint32_t)(ti.tv_nsec / 10000000);
 }
 
+// 单调时钟，单位为 tick（centisecond ，毫秒模式下为 millisecond）
 static uint64_t
 gettime() {
 	uint64_t t;
 	struct timespec ti;
 	clock_gettime(CLOCK_MONOTONIC, &ti);
-	t = (uint64_t)ti.tv_sec * 100;
-	t += ti.tv_nsec / 10000000;
+	uint64_t tick = 100 * TI->scale;	// tick per second
+	t = (uint64_t)ti.tv_sec * tick;
+	t += ti.tv_nsec / (1000000000 / tick);
 	return t;
 }
 
@@ -252,14 +490,39 @@ skynet_updatetime(void) {
 	} else if (cp != TI->current_point) {
 		uint32_t diff = (uint32_t)(cp - TI->current_point);
 		TI->current_point = cp;
-		TI->current += diff;
-		int i;
-		for (i=0;i<diff;i++) {
-			timer_update(TI);
+		TI->elapsed += diff;
+		TI->current = TI->origin + TI->elapsed / TI->scale;
+		int j;
+		if (diff == 1) {
+			for (j=0;j<TI->count;j++) {
+				timer_update(TI->shard[j]);
+			}
+		} else {
+			// 落后了多个 tick（卡顿或者系统调度），每个分片一次追上
+			for (j=0;j<TI->count;j++) {
+				timer_fastforward(TI->shard[j], diff);
+			}
 		}
 	}
 }
 
+void
+skynet_timer_sleep(void) {
+#ifdef USE_TIMERFD
+	if (TI->fd >= 0) {
+		uint64_t expirations;
+		// 每个 tick 的边界唤醒一次，被信号打断（EINTR）时直接返回
+		if (read(TI->fd, &expirations, sizeof(expirations)) < 0 && errno != EINTR && errno != EAGAIN) {
+			skynet_error(NULL, "timerfd read error : %s", strerror(errno));
+			close(TI->fd);
+			TI->fd = -1;
+		}
+		return;
+	}
+#endif
+	usleep(TI->scale > 1 ? 250 : 2500);	// 一个 tick 内检查 4 次
+}
+
 uint32_t
 skynet_starttime(void) {
 	return TI->starttime;
@@ -270,13 +533,57 @@ skynet_now(void) {
 	return TI->current;
 }
 
+// 创建按 tick 边界对齐的周期性 timerfd ，失败时返回 -1
+static int
+timer_fd(int scale) {
+#ifdef USE_TIMERFD
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	long interval = 10000000 / scale;	// nanosec per tick
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	struct itimerspec its;
+	its.it_interval.tv_sec = 0;
+	its.it_interval.tv_nsec = interval;
+	// 第一次在下一个 tick 边界之后触发，这样每次醒来 gettime() 都恰好前进一个 tick
+	its.it_value.tv_sec = now.tv_sec;
+	its.it_value.tv_nsec = (now.tv_nsec / interval + 1) * interval;
+	if (its.it_value.tv_nsec >= 1000000000) {
+		its.it_value.tv_sec += its.it_value.tv_nsec / 1000000000;
+		its.it_value.tv_nsec %= 1000000000;
+	}
+	if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+#else
+	return -1;
+#endif
+}
+
 void 
-skynet_timer_init(void) {
-	TI = timer_create_timer();
+skynet_timer_init(int shard, int ms) {
+	struct timer_system *ts = (struct timer_system *)skynet_malloc(sizeof(*ts));
+	memset(ts, 0, sizeof(*ts));
+	ts->count = shard > 0 ? shard : 1;
+	if (ts->count > TIMER_MAX_SHARD) {
+		ts->count = TIMER_MAX_SHARD;
+	}
+	ts->shard = (struct timer **)skynet_malloc(ts->count * sizeof(struct timer *));
+	int i;
+	for (i=0;i<ts->count;i++) {
+		ts->shard[i] = timer_create_timer(i);
+	}
+	ts->scale = ms ? 10 : 1;
 	uint32_t current = 0;
-	systime(&TI->starttime, &current);
-	TI->current = current;
-	TI->current_point = gettime();
+	systime(&ts->starttime, &current);
+	ts->origin = current;
+	ts->current = current;
+	TI = ts;
+	ts->current_point = gettime();
+	ts->fd = timer_fd(ts->scale);
 }
 
 // for profile
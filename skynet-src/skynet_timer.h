@@ -3,11 +3,18 @@
 
 #include <stdint.h>
 
-int skynet_timeout(uint32_t handle, int time, int session);
+// return timer id for skynet_timeout_cancel, 0 if the response is sent at once (time <= 0), -1 for error
+int64_t skynet_timeout(uint32_t handle, int time, int session);
+// same as skynet_timeout, time in millisecond. it's rounded up to centisecond unless timer_resolution is "ms"
+int64_t skynet_timeout_ms(uint32_t handle, int ms, int session);
+// return 1 if the timer is removed before it fires (the response will never come), 0 if it has fired or id is invalid
+int skynet_timeout_cancel(uint32_t handle, int64_t id);
 void skynet_updatetime(void);
+void skynet_timer_sleep(void);	// block timer thread until next tick
 uint32_t skynet_starttime(void);
 uint64_t skynet_thread_time(void);	// for profile, in micro second
 
-void skynet_timer_init(void);
+// shard : timer wheel count, services are hashed by handle ; ms : tick in millisecond instead of centisecond
+void skynet_timer_init(int shard, int ms);
 
 #endif
@@ -18,6 +18,10 @@ struct socket_info {
 	uint64_t write;
 	uint64_t rtime;
 	uint64_t wtime;
+	uint64_t wcall;
+	uint64_t wbuf;
+	uint64_t rhit;
+	uint64_t rmiss;
 	int64_t wbuffer;
 	uint8_t reading;
 	uint8_t writing;
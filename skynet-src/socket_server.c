@@ -1,3 +1,7 @@
+#if defined(__linux__)
+#define _GNU_SOURCE		// for recvmmsg/sendmmsg
+#endif
+
 #include "skynet.h"
 
 #include "socket_server.h"
@@ -7,6 +11,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/tcp.h>
 #include <unistd.h>
 #include <errno.h>
@@ -16,11 +21,27 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
+#include <sched.h>
+
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#endif
 
 #define MAX_INFO 128
-// MAX_SOCKET will be 2^MAX_SOCKET_P
+// 每个分片默认最多 2^MAX_SOCKET_P 个 socket ，可以在创建时指定
 #define MAX_SOCKET_P 16
+// slot 表按页分配，每页 2^SLOT_PAGE_P 个 socket
+#define SLOT_PAGE_P 10
+#define SLOT_PAGE (1<<SLOT_PAGE_P)
+// id 中留给 tag 的最少位数，slot 重用时 tag 递增，用来区分新旧 id
+#define MIN_TAG_BITS 8
 #define MAX_EVENT 64
+// 监听套接字的一次就绪事件上最多连续 accept 的次数，避免新连接风暴时饿死其它 fd
+#define MAX_ACCEPT_BATCH 64
 #define MIN_READ_BUFFER 64
 
 /* socket 连接状态 */
@@ -35,13 +56,13 @@
 #define SOCKET_TYPE_PACCEPT 8
 #define SOCKET_TYPE_BIND 9
 
-#define MAX_SOCKET (1<<MAX_SOCKET_P)
-
 #define PRIORITY_HIGH 0
 #define PRIORITY_LOW 1
 
-#define HASH_ID(id) (((unsigned)id) % MAX_SOCKET)
-#define ID_TAG16(id) ((id>>MAX_SOCKET_P) & 0xffff)
+// socket id 从低到高依次是：分片（socket 线程）编号 shard_bits 位，slot 索引 slot_bits 位，其余为 tag
+#define HASH_ID(ss, id) ((((unsigned)id) >> (ss)->shard_bits) & ((1u << (ss)->slot_bits) - 1))
+#define ID_TAG(ss, id) (((unsigned)id) >> ((ss)->shard_bits + (ss)->slot_bits))
+#define ID_TAG16(ss, id) (ID_TAG(ss, id) & 0xffff)
 
 #define PROTOCOL_TCP 0
 #define PROTOCOL_UDP 1
@@ -52,6 +73,18 @@
 
 #define MAX_UDP_PACKAGE 65535
 
+// 一次 recvmmsg/sendmmsg 最多处理的 udp 包数量
+#define UDP_BATCH 16
+
+#if defined(__linux__)
+#define UDP_MMSG
+#include <netinet/udp.h>
+// 编译时定义 USE_UDP_GRO 打开 udp 接收合包，合并的包在 forward_message_udp 中按分段大小拆开
+#if defined(USE_UDP_GRO) && defined(UDP_GRO)
+#define UDP_RECV_GRO
+#endif
+#endif
+
 // EAGAIN and EWOULDBLOCK may be not the same value.
 #if (EAGAIN != EWOULDBLOCK)
 #define AGAIN_WOULDBLOCK EAGAIN : case EWOULDBLOCK
@@ -61,6 +94,16 @@
 
 #define WARNING_SIZE (1024*1024)
 
+// 一次 writev 最多合并的 buffer 数量
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define SEND_IOV_MAX IOV_MAX
+#else
+#define SEND_IOV_MAX 1024
+#endif
+
+// 一次 sendfile 最多发送的字节数
+#define SENDFILE_CHUNK (1 << 30)
+
 #define USEROBJECT ((size_t)(-1))
 
 struct write_buffer {
@@ -69,6 +112,7 @@ struct write_buffer {
 	char *ptr;
 	size_t sz;
 	bool userobject;
+	bool file;		// 是 write_buffer_file ，数据在文件里，sz 为剩余的字节数
 };
 
 struct write_buffer_udp {
@@ -76,6 +120,14 @@ struct write_buffer_udp {
 	uint8_t udp_address[UDP_ADDRESS_SIZE];
 };
 
+/* 由 socket 线程用 sendfile 直接从文件发送，不经过内存 buffer */
+struct write_buffer_file {
+	struct write_buffer buffer;
+	int fd;				// 文件描述符，发送完或者 socket 关闭时由 socket 线程关闭
+	off_t offset;		// 下一次发送的文件偏移
+	off_t start;
+};
+
 struct wb_list {
 	struct write_buffer * head;
 	struct write_buffer * tail;
@@ -86,6 +138,10 @@ struct socket_stat {
 	uint64_t wtime;
 	uint64_t read;
 	uint64_t write;
+	uint64_t wcall;		// 发送的系统调用次数
+	uint64_t wbuf;		// 这些系统调用一共提交的 buffer 数量，wbuf/wcall 为平均每次合并的 buffer 数
+	uint64_t rhit;		// 读缓冲区从缓存池中取得的次数
+	uint64_t rmiss;		// 缓存池为空，重新分配读缓冲区的次数
 };
 
 /* socket 结构，用于标识一条链接 */
@@ -105,33 +161,50 @@ struct socket {
 	bool closing;					// fd 的 close 标记
 	ATOM_INT udpconnecting;			// udp 正在连接
 	int64_t warn_size;				// 报警阈值
+	int64_t high_mark;				// 待发送字节数的高水位，超过时通知服务，0 为不使用水位（只按 WARNING_SIZE 倍数报警）
+	int64_t low_mark;				// 低水位，超过高水位之后降到这里再通知服务
+	bool overflow;					// 已经超过高水位，还没有降到低水位
 	union {	
 		int size;					// 如果是 tcp 连接，用 size 表示每次读取的字节数
 		uint8_t udp_address[UDP_ADDRESS_SIZE];	// udp 用 udp_address 表示地址
 	} p;
 	struct spinlock dw_lock;		// 自旋锁
+	unsigned tag;					// 这个 slot 上一次分配出去的 id 的 tag
+	int listen_parent;				// SO_REUSEPORT 监听组中其它分片上的监听套接字，向服务报告时使用的 id（组内第一个），否则为 -1
+	int listen_next;				// 监听组中下一个监听套接字的 id ，start/pause/close 沿链转发，没有为 -1
 	int dw_offset;					// 已经写入的大小
 	const void * dw_buffer;			// dw 待发送的数据缓存，优先级很高
 	size_t dw_size;					// dw 写出的总大小
 };
 
-/* 全局唯一的 socket 管理器 */
+/* socket 管理器，每个 socket 线程一个（分片） */
 struct socket_server {
 	volatile uint64_t time;					// 时间，由 timer 线程更新
+	int shard;								// 分片编号
+	int shard_bits;							// socket id 中分片编号占用的位数
+	struct socket_server **group;			// 全部分片，accept 的新连接轮流分配到各个分片上
+	int group_n;
+	ATOM_INT accept_rr;
 	int reserve_fd;							// for EMFILE
-	int recvctrl_fd;						// 接收命令的管道套接字
-	int sendctrl_fd;						// 发送命令的管道套接字
+	int recvctrl_fd;						// 命令通知的读端（Linux 下为 eventfd，和 sendctrl_fd 相同）
+	int sendctrl_fd;						// 命令通知的写端
 	int checkctrl;							// 用来标记是否要检查控制台命令的标志			
+	struct ctrl_ring *ctrl;					// 命令队列
 	poll_fd event_fd;						// Linux下为 epoll 套接字，MacOS下 kqueue 句柄
-	ATOM_INT alloc_id;						// 已分配的id，不断累加
+	ATOM_INT alloc_id;						// 分配 slot 的游标，在已分配的页中循环查找空闲 slot
+	int slot_bits;							// id 中 slot 索引占用的位数，决定 socket 数量上限
+	ATOM_INT slot_n;						// 已分配的 slot 数量（整页）
+	ATOM_POINTER *page;						// slot 页表，页一旦分配直到 socket_server_release 才释放
+	struct spinlock page_lock;				// 分配新页时加锁
 	int event_n;							// 本次调用 poll 方法得到的就绪的 fd 个数
 	int event_index;						// 目前已经处理的就绪 fd 索引（当 event_index == event_n 时即一轮轮询处理结束） 
+	int accept_n;							// 当前监听套接字的就绪事件上已经连续 accept 的次数
+	bool idle_report;						// 上次阻塞之后返回过消息，阻塞前要先返回 SOCKET_IDLE
 	struct socket_object_interface soi;		// userobject 接口
 	struct event ev[MAX_EVENT];				// 事件轮询返回的当前触发的事件数组
-	struct socket slot[MAX_SOCKET];			// 全部的 socket 对象（固定容量对象池，即单 skynet 进程支持的连接上限是 65535）
 	char buffer[MAX_INFO];					// 临时缓冲区
 	uint8_t udpbuffer[MAX_UDP_PACKAGE];		// udp 数据缓冲区
-	fd_set rfds;							// 使用 select 监听的描述符集合
+	struct udp_batch *udp;					// recvmmsg 批量读取的 udp 包，第一次收到 udp 数据时创建
 };
 
 struct request_open {
@@ -152,6 +225,13 @@ struct request_send_udp {
 	uint8_t address[UDP_ADDRESS_SIZE];
 };
 
+struct request_sendfile {
+	int id;
+	int fd;
+	int64_t offset;
+	int64_t sz;
+};
+
 struct request_setudp {
 	int id;
 	uint8_t address[UDP_ADDRESS_SIZE];
@@ -166,6 +246,8 @@ struct request_close {
 struct request_listen {
 	int id;
 	int fd;		// 监听套接字fd
+	int parent;	// SO_REUSEPORT 监听组中向服务报告的 id ，组内第一个和普通监听为 -1
+	int next;	// 监听组中下一个监听套接字的 id
 	uintptr_t opaque;
 	char host[1];
 };
@@ -187,6 +269,12 @@ struct request_setopt {
 	int value;
 };
 
+struct request_watermark {
+	int id;
+	int64_t high;
+	int64_t low;
+};
+
 struct request_udp {
 	int id;
 	int fd;
@@ -199,14 +287,17 @@ struct request_udp {
 
 	S Start socket
 	B Bind socket
+	I Import socket accepted by another shard
 	L Listen socket
 	K Close socket
 	O Connect to (Open)
 	X Exit
 	D Send package (high)
 	P Send package (low)
+	F Send file (high)
 	A Send UDP package
 	T Set opt
+	M Set write watermark
 	U Create UDP socket
 	C set udp address
 	Q query info
@@ -219,23 +310,96 @@ struct request_package {
 		struct request_open open;					// O
 		struct request_send send;
 		struct request_send_udp send_udp;
+		struct request_sendfile sendfile;			// F
 		struct request_close close;
 		struct request_listen listen;				// L
 		struct request_bind bind;
 		struct request_resumepause resumepause;
 		struct request_setopt setopt;
+		struct request_watermark watermark;			// M
 		struct request_udp udp;
 		struct request_setudp set_udp;
 	} u;
 	uint8_t dummy[256];		// 预留 256 字节
 };
 
+/* 命令队列：多个服务线程写入，socket 线程读出的有界无锁环形队列
+ 每个格子带一个序号，写入者用 CAS 抢占 tail 位置，写完数据后再更新序号；读出者按序号判断格子是否可读。
+ 只有队列由空变为非空时才写一次 eventfd 唤醒 socket 线程，socket 线程一次把队列中的命令处理完 */
+#define CTRL_RING_SIZE 4096
+
+struct ctrl_cell {
+	ATOM_SIZET seq;
+	uint8_t type;
+	uint8_t len;
+	char buffer[sizeof(((struct request_package *)0)->u)];
+};
+
+/* socket 线程之间转发的命令（分片间的 'I' 和监听组的 K/R/S）不能在队列满时等待，
+ 两个 socket 线程互相等对方的队列会死锁，所以放进一个无界的链表 */
+struct ctrl_node {
+	struct ctrl_node *next;
+	uint8_t type;
+	uint8_t len;
+	char buffer[1];
+};
+
+struct ctrl_ring {
+	ATOM_SIZET tail;			// 写入位置，多个写入者竞争
+	char pad1[64 - sizeof(ATOM_SIZET)];
+	ATOM_INT signal;			// 已经发出过唤醒，socket 线程清空队列后复位
+	char pad2[64 - sizeof(ATOM_INT)];
+	ATOM_POINTER inbox;			// 其它 socket 线程转发来的命令，后进先出的链表
+	char pad3[64 - sizeof(ATOM_POINTER)];
+	size_t head;				// 读出位置，只有 socket 线程访问
+	struct ctrl_node *local;	// 从 inbox 取出并按先进先出排好的命令，只有 socket 线程访问
+	struct ctrl_cell cell[CTRL_RING_SIZE];
+};
+
+/* 读缓冲区缓存池，所有分片共用
+ 按 2 的幂分级，和 p.size 的翻倍/减半对应。socket 线程取出，服务处理完数据后由工作线程放回。
+ 放回时只知道数据长度，所以交给服务的缓冲区大小总是数据长度向上取整到所在级别（见 read_buffer_fit） */
+#define READ_POOL_CLASS 12							// MIN_READ_BUFFER << 11 == 128K，更大的直接分配
+#define READ_POOL_BYTES (1024 * 1024)				// 每一级缓存的总字节数上限
+
+struct read_pool_node {
+	struct read_pool_node *next;
+};
+
+struct read_pool_class {
+	struct spinlock lock;
+	struct read_pool_node *head;
+	int count;
+	int max;
+};
+
+static struct read_pool_class READ_POOL[READ_POOL_CLASS];
+
 union sockaddr_all {
 	struct sockaddr s;
 	struct sockaddr_in v4;
 	struct sockaddr_in6 v6;
 };
 
+#ifdef UDP_MMSG
+
+/* 一次 recvmmsg 读到的一批 udp 包，逐个作为 SOCKET_UDP 交给服务，读完之前只属于 id 这一个 socket */
+struct udp_batch {
+	int id;				// 这批包所属的 socket id
+	int n;				// 读到的包数量
+	int index;			// 下一个要交出去的包
+	int offset;			// GRO 合并的包中已经交出去的长度
+	struct mmsghdr msg[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	union sockaddr_all addr[UDP_BATCH];
+#ifdef UDP_RECV_GRO
+	char control[UDP_BATCH][CMSG_SPACE(sizeof(int))];
+#endif
+	uint8_t buffer[UDP_BATCH][MAX_UDP_PACKAGE];
+};
+
+#endif
+
 struct send_object {
 	const void * buffer;
 	size_t sz;
@@ -333,7 +497,9 @@ send_object_init_from_sendbuffer(struct socket_server *ss, struct send_object *s
 
 static inline void
 write_buffer_free(struct socket_server *ss, struct write_buffer *wb) {
-	if (wb->userobject) {
+	if (wb->file) {
+		close(((struct write_buffer_file *)wb)->fd);
+	} else if (wb->userobject) {
 		ss->soi.free((void *)wb->buffer);
 	} else {
 		FREE((void *)wb->buffer);
@@ -347,18 +513,82 @@ socket_keepalive(int fd) {
 	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (void *)&keepalive , sizeof(keepalive));  
 }
 
+static inline void
+clear_wb_list(struct wb_list *list) {
+	list->head = NULL;
+	list->tail = NULL;
+}
+
+// 还没有分配页的 slot 都指向它，它永远是无效的
+static struct socket INVALID_SLOT = { .id = -1 };
+
+static inline struct socket *
+slot_index(struct socket_server *ss, int index) {
+	struct socket *page = (struct socket *)ATOM_LOAD(&ss->page[index >> SLOT_PAGE_P]);
+	if (page == NULL)
+		return &INVALID_SLOT;
+	return &page[index & (SLOT_PAGE - 1)];
+}
+
+// id 对应的 socket 对象，可能在任意线程中调用
+static inline struct socket *
+get_socket(struct socket_server *ss, int id) {
+	return slot_index(ss, HASH_ID(ss, id));
+}
+
+// socket id 所在的分片
+static inline struct socket_server *
+id_shard(struct socket_server *ss, int id) {
+	if (ss->group_n <= 1)
+		return ss;
+	return ss->group[((unsigned)id & ((1u << ss->shard_bits) - 1)) % ss->group_n];
+}
+
+// 分配一页新的 slot ，已经分配满返回 0
 static int
-reserve_id(struct socket_server *ss) {
-	int i;
-	for (i=0;i<MAX_SOCKET;i++) {
-		int id = ATOM_FINC(&(ss->alloc_id))+1;
-		if (id < 0) {
-			id = ATOM_FAND(&(ss->alloc_id), 0x7fffffff) & 0x7fffffff;
+slot_grow(struct socket_server *ss, int slot_n) {
+	int ret = 1;
+	spinlock_lock(&ss->page_lock);
+	if (ATOM_LOAD(&ss->slot_n) == slot_n) {
+		if (slot_n >= (1 << ss->slot_bits)) {
+			ret = 0;
+		} else {
+			struct socket *page = MALLOC(SLOT_PAGE * sizeof(struct socket));
+			memset(page, 0, SLOT_PAGE * sizeof(struct socket));
+			int i;
+			for (i=0;i<SLOT_PAGE;i++) {
+				struct socket *s = &page[i];
+				ATOM_INIT(&s->type, SOCKET_TYPE_INVALID);
+				s->id = -1;
+				s->fd = -1;
+				clear_wb_list(&s->high);
+				clear_wb_list(&s->low);
+				spinlock_init(&s->dw_lock);
+			}
+			ATOM_STORE(&ss->page[slot_n >> SLOT_PAGE_P], (uintptr_t)page);
+			ATOM_STORE(&ss->slot_n, slot_n + SLOT_PAGE);
 		}
-		struct socket *s = &ss->slot[HASH_ID(id)];
+	}
+	spinlock_unlock(&ss->page_lock);
+	return ret;
+}
+
+// 从游标开始在前 slot_n 个 slot 中最多查找 limit 次
+static int
+reserve_slot(struct socket_server *ss, int slot_n, int limit) {
+	unsigned tag_mask = 0x7fffffffu >> (ss->shard_bits + ss->slot_bits);
+	int i;
+	for (i=0;i<limit;i++) {
+		int index = (int)((unsigned)ATOM_FINC(&ss->alloc_id) % slot_n);
+		struct socket *s = slot_index(ss, index);
 		int type_invalid = ATOM_LOAD(&s->type);
 		if (type_invalid == SOCKET_TYPE_INVALID) {
 			if (ATOM_CAS(&s->type, type_invalid, SOCKET_TYPE_RESERVE)) {
+				unsigned tag = (s->tag + 1) & tag_mask;
+				if (tag == 0)
+					tag = 1;
+				s->tag = tag;
+				int id = (int)((tag << ss->slot_bits | (unsigned)index) << ss->shard_bits | (unsigned)ss->shard);
 				s->id = id;
 				s->protocol = PROTOCOL_UNKNOWN;
 				// socket_server_udp_connect may inc s->udpconncting directly (from other thread, before new_fd), 
@@ -375,14 +605,236 @@ reserve_id(struct socket_server *ss) {
 	return -1;
 }
 
-static inline void
-clear_wb_list(struct wb_list *list) {
-	list->head = NULL;
-	list->tail = NULL;
+static int
+reserve_id(struct socket_server *ss) {
+	for (;;) {
+		int slot_n = ATOM_LOAD(&ss->slot_n);
+		// 在已分配的页中查找空闲 slot ，找了一页还没有找到就再分配一页，使 slot 表保持不太满
+		int id = reserve_slot(ss, slot_n, slot_n < SLOT_PAGE ? slot_n : SLOT_PAGE);
+		if (id >= 0)
+			return id;
+		if (!slot_grow(ss, slot_n)) {
+			// 已经到达上限，最后把全部 slot 找一遍
+			return reserve_slot(ss, slot_n, slot_n);
+		}
+	}
+}
+
+static void
+slot_release(struct socket_server *ss) {
+	int slot_n = ATOM_LOAD(&ss->slot_n);
+	int i;
+	for (i=0;i<slot_n;i+=SLOT_PAGE) {
+		FREE((void *)ATOM_LOAD(&ss->page[i >> SLOT_PAGE_P]));
+	}
+	FREE(ss->page);
+	spinlock_destroy(&ss->page_lock);
+}
+
+#ifdef __linux__
+
+static int
+ctrl_fd_create(int fd[2]) {
+	int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0)
+		return 1;
+	fd[0] = fd[1] = efd;
+	return 0;
+}
+
+static void
+ctrl_fd_close(int fd[2]) {
+	close(fd[0]);
+}
+
+static void
+ctrl_fd_notify(int fd) {
+	uint64_t v = 1;
+	while (write(fd, &v, sizeof(v)) < 0 && errno == EINTR) {}
+}
+
+static void
+ctrl_fd_clear(int fd) {
+	uint64_t v;
+	while (read(fd, &v, sizeof(v)) < 0 && errno == EINTR) {}
+}
+
+#else
+
+static int
+ctrl_fd_create(int fd[2]) {
+	if (pipe(fd))
+		return 1;
+	sp_nonblocking(fd[0]);
+	sp_nonblocking(fd[1]);
+	return 0;
+}
+
+static void
+ctrl_fd_close(int fd[2]) {
+	close(fd[0]);
+	close(fd[1]);
+}
+
+static void
+ctrl_fd_notify(int fd) {
+	char v = 0;
+	while (write(fd, &v, sizeof(v)) < 0 && errno == EINTR) {}
+}
+
+static void
+ctrl_fd_clear(int fd) {
+	char tmp[128];
+	while (read(fd, tmp, sizeof(tmp)) > 0) {}
+}
+
+#endif
+
+static struct ctrl_ring *
+ctrl_ring_create() {
+	struct ctrl_ring *r = MALLOC(sizeof(*r));
+	ATOM_INIT(&r->tail, 0);
+	ATOM_INIT(&r->signal, 0);
+	ATOM_INIT(&r->inbox, (uintptr_t)NULL);
+	r->head = 0;
+	r->local = NULL;
+	size_t i;
+	for (i=0;i<CTRL_RING_SIZE;i++) {
+		ATOM_INIT(&r->cell[i].seq, i);
+	}
+	return r;
+}
+
+static void
+ctrl_node_free(struct ctrl_node *n) {
+	while (n) {
+		struct ctrl_node *next = n->next;
+		FREE(n);
+		n = next;
+	}
+}
+
+static void
+ctrl_ring_release(struct ctrl_ring *r) {
+	ctrl_node_free(r->local);
+	ctrl_node_free((struct ctrl_node *)ATOM_LOAD(&r->inbox));
+	FREE(r);
+}
+
+static void
+read_pool_init() {
+	int i;
+	for (i=0;i<READ_POOL_CLASS;i++) {
+		struct read_pool_class *c = &READ_POOL[i];
+		spinlock_init(&c->lock);
+		c->head = NULL;
+		c->count = 0;
+		c->max = READ_POOL_BYTES / (MIN_READ_BUFFER << i);
+	}
+}
+
+static void
+read_pool_release() {
+	int i;
+	for (i=0;i<READ_POOL_CLASS;i++) {
+		struct read_pool_class *c = &READ_POOL[i];
+		while (c->head) {
+			struct read_pool_node *n = c->head;
+			c->head = n->next;
+			FREE(n);
+		}
+		c->count = 0;
+		spinlock_destroy(&c->lock);
+	}
+}
+
+// 能放下 sz 字节的最小一级，超出缓存池管理的范围返回 -1
+static inline int
+read_pool_class(int sz) {
+	int i;
+	for (i=0;i<READ_POOL_CLASS;i++) {
+		if (sz <= (MIN_READ_BUFFER << i))
+			return i;
+	}
+	return -1;
+}
+
+static struct read_pool_node *
+read_pool_pop(int i) {
+	struct read_pool_class *c = &READ_POOL[i];
+	spinlock_lock(&c->lock);
+	struct read_pool_node *n = c->head;
+	if (n) {
+		c->head = n->next;
+		--c->count;
+	}
+	spinlock_unlock(&c->lock);
+	return n;
+}
+
+static void
+read_pool_push(int i, void *buffer) {
+	struct read_pool_class *c = &READ_POOL[i];
+	struct read_pool_node *n = buffer;
+	spinlock_lock(&c->lock);
+	if (c->count < c->max) {
+		n->next = c->head;
+		c->head = n;
+		++c->count;
+		n = NULL;
+	}
+	spinlock_unlock(&c->lock);
+	if (n) {
+		FREE(n);
+	}
+}
+
+// sz 为 p.size ，总是 2 的幂
+static char *
+read_buffer_alloc(struct socket *s, int sz) {
+	int i = read_pool_class(sz);
+	if (i >= 0) {
+		struct read_pool_node *n = read_pool_pop(i);
+		if (n) {
+			++s->stat.rhit;
+			return (char *)n;
+		}
+	}
+	++s->stat.rmiss;
+	return MALLOC(sz);
+}
+
+/* 读到的数据不到缓冲区的一半时，换成刚好能放下数据的那一级缓冲区，
+ 保证交给服务的缓冲区大小总是等于数据长度所在级别的大小，放回时只需要数据长度 */
+static char *
+read_buffer_fit(char *buffer, int sz, int n) {
+	int i = read_pool_class(n);
+	if (i < 0 || (MIN_READ_BUFFER << i) >= sz)
+		return buffer;
+	struct read_pool_node *tmp = read_pool_pop(i);
+	if (tmp == NULL) {
+		return skynet_realloc(buffer, MIN_READ_BUFFER << i);
+	}
+	memcpy(tmp, buffer, n);
+	// p.size 可能已经超出缓存池管理的范围，交给 socket_server_free_buffer 处理
+	socket_server_free_buffer(buffer, sz);
+	return (char *)tmp;
+}
+
+void
+socket_server_free_buffer(void *buffer, int sz) {
+	if (buffer == NULL)
+		return;
+	int i = read_pool_class(sz);
+	if (sz <= 0 || i < 0) {
+		FREE(buffer);
+		return;
+	}
+	read_pool_push(i, buffer);
 }
 
 struct socket_server * 
-socket_server_create(uint64_t time) {
+socket_server_create(uint64_t time, int shard, int shard_bits, int slot_bits) {
 	// 创建epoll套接字（Linux环境）（skynet 使用 LT epoll）
 	poll_fd efd = sp_create();
 	if (sp_invalid(efd)) {
@@ -390,9 +842,9 @@ socket_server_create(uint64_t time) {
 		return NULL;
 	}
 
-	// 创建命令接收管道套接字（这里未设置非阻塞）
+	// 创建命令通知的描述符，命令本身放在 ctrl_ring 中
 	int fd[2];
-	if (pipe(fd)) {
+	if (ctrl_fd_create(fd)) {
 		sp_release(efd);
 		skynet_error(NULL, "socket-server: create socket pair failed.");
 		return NULL;
@@ -403,38 +855,59 @@ socket_server_create(uint64_t time) {
 	3、将一个专门用于接收事件修改命令的套接字加入到 epoll 的监听中，当需要进行操作时，向套接字中写入命令，接收端会变得可读，线程将会从 epoll_wait 中被唤醒。
 	*/
 
-	// 使用epoll管理管道读端（Linux环境）
+	// 使用epoll管理通知的读端（Linux环境）
 	if (sp_add(efd, fd[0], NULL)) {
 		// add recvctrl_fd to event poll
 		skynet_error(NULL, "socket-server: can't add server fd to event pool.");
-		close(fd[0]);
-		close(fd[1]);
+		ctrl_fd_close(fd);
 		sp_release(efd);
 		return NULL;
 	}
 
+	if (shard == 0) {
+		read_pool_init();
+	}
+
 	struct socket_server *ss = MALLOC(sizeof(*ss));
 	ss->time = time;
+	ss->shard = shard;
+	ss->shard_bits = shard_bits;
+	ss->group = NULL;
+	ss->group_n = 0;
+	ATOM_INIT(&ss->accept_rr, 0);
 	ss->event_fd = efd;
 	ss->recvctrl_fd = fd[0];
 	ss->sendctrl_fd = fd[1];
 	ss->checkctrl = 1;
+	ss->ctrl = ctrl_ring_create();
+	ss->udp = NULL;
 	ss->reserve_fd = dup(1);	// reserve an extra fd for EMFILE
 
-	// socket 对象初始化填充
-	for (int i=0;i<MAX_SOCKET;i++) {
-		struct socket *s = &ss->slot[i];
-		ATOM_INIT(&s->type, SOCKET_TYPE_INVALID);
-		clear_wb_list(&s->high);
-		clear_wb_list(&s->low);
-		spinlock_init(&s->dw_lock);
+	// slot 表按需分页，先分配第一页
+	if (slot_bits <= 0) {
+		slot_bits = MAX_SOCKET_P;
+	}
+	if (slot_bits < SLOT_PAGE_P) {
+		slot_bits = SLOT_PAGE_P;
+	}
+	if (slot_bits > 31 - MIN_TAG_BITS - shard_bits) {
+		slot_bits = 31 - MIN_TAG_BITS - shard_bits;
+	}
+	ss->slot_bits = slot_bits;
+	int npage = 1 << (slot_bits - SLOT_PAGE_P);
+	ss->page = MALLOC(npage * sizeof(ATOM_POINTER));
+	for (int i=0;i<npage;i++) {
+		ATOM_INIT(&ss->page[i], 0);
 	}
+	ATOM_INIT(&ss->slot_n, 0);
+	spinlock_init(&ss->page_lock);
+	slot_grow(ss, 0);
 	ATOM_INIT(&ss->alloc_id , 0);
 	ss->event_n = 0;
 	ss->event_index = 0;
+	ss->accept_n = 0;
+	ss->idle_report = false;
 	memset(&ss->soi, 0, sizeof(ss->soi));
-	FD_ZERO(&ss->rfds);
-	assert(ss->recvctrl_fd < FD_SETSIZE);
 
 	return ss;
 }
@@ -525,12 +998,22 @@ force_close(struct socket_server *ss, struct socket *s, struct socket_lock *l, s
 	socket_unlock(l);
 }
 
+void
+socket_server_group(struct socket_server **group, int n) {
+	int i;
+	for (i=0;i<n;i++) {
+		group[i]->group = group;
+		group[i]->group_n = n;
+	}
+}
+
 void 
 socket_server_release(struct socket_server *ss) {
 	int i;
 	struct socket_message dummy;
-	for (i=0;i<MAX_SOCKET;i++) {
-		struct socket *s = &ss->slot[i];
+	int slot_n = ATOM_LOAD(&ss->slot_n);
+	for (i=0;i<slot_n;i++) {
+		struct socket *s = slot_index(ss, i);
 		struct socket_lock l;
 		socket_lock_init(s, &l);
 		if (ATOM_LOAD(&s->type) != SOCKET_TYPE_RESERVE) {
@@ -538,11 +1021,17 @@ socket_server_release(struct socket_server *ss) {
 		}
 		spinlock_destroy(&s->dw_lock);
 	}
-	close(ss->sendctrl_fd);
-	close(ss->recvctrl_fd);
+	int fd[2] = { ss->recvctrl_fd, ss->sendctrl_fd };
+	ctrl_fd_close(fd);
+	ctrl_ring_release(ss->ctrl);
+	FREE(ss->udp);
 	sp_release(ss->event_fd);
 	if (ss->reserve_fd >= 0)
 		close(ss->reserve_fd);
+	if (ss->shard == 0) {
+		read_pool_release();
+	}
+	slot_release(ss);
 	FREE(ss);
 }
 
@@ -573,7 +1062,7 @@ enable_read(struct socket_server *ss, struct socket *s, bool enable) {
 /// @brief 构建新的 socket 实例（取一个空闲的 socket 进行填充）
 static struct socket *
 new_fd(struct socket_server *ss, int id, int fd, int protocol, uintptr_t opaque, bool reading) {
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	assert(ATOM_LOAD(&s->type) == SOCKET_TYPE_RESERVE);
 
 	if (sp_add(ss->event_fd, fd, s)) {
@@ -586,12 +1075,17 @@ new_fd(struct socket_server *ss, int id, int fd, int protocol, uintptr_t opaque,
 	s->reading = true;
 	s->writing = false;
 	s->closing = false;
-	ATOM_INIT(&s->sending , ID_TAG16(id) << 16 | 0);
+	ATOM_INIT(&s->sending , ID_TAG16(ss, id) << 16 | 0);
 	s->protocol = protocol;
 	s->p.size = MIN_READ_BUFFER;
 	s->opaque = opaque;
+	s->listen_parent = -1;
+	s->listen_next = -1;
 	s->wb_size = 0;
 	s->warn_size = 0;
+	s->high_mark = 0;
+	s->low_mark = 0;
+	s->overflow = false;
 	check_wb_list(&s->high);
 	check_wb_list(&s->low);
 	s->dw_buffer = NULL;
@@ -700,7 +1194,7 @@ _failed:
 		close(sock);
 	freeaddrinfo( ai_list );
 _failed_getaddrinfo:
-	ATOM_STORE(&ss->slot[HASH_ID(id)].type, SOCKET_TYPE_INVALID);
+	ATOM_STORE(&get_socket(ss, id)->type, SOCKET_TYPE_INVALID);
 	return SOCKET_ERR;
 }
 
@@ -736,12 +1230,78 @@ close_write(struct socket_server *ss, struct socket *s, struct socket_lock *l, s
 	}
 }
 
+static ssize_t
+file_send(int sock, struct write_buffer_file *wf, size_t n) {
+#ifdef __linux__
+	return sendfile(sock, wf->fd, &wf->offset, n);
+#else
+	char tmp[0x4000];
+	if (n > sizeof(tmp))
+		n = sizeof(tmp);
+	ssize_t rd = pread(wf->fd, tmp, n, wf->offset);
+	if (rd <= 0)
+		return rd;
+	ssize_t sz = write(sock, tmp, rd);
+	if (sz > 0)
+		wf->offset += sz;
+	return sz;
+#endif
+}
+
+// 发送队列头部的文件，发送完返回 0 ，需要等待可写返回 -1
+static int
+send_list_file(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_lock *l, struct socket_message *result) {
+	struct write_buffer_file *wf = (struct write_buffer_file *)list->head;
+	while (wf->buffer.sz > 0) {
+		size_t n = wf->buffer.sz > SENDFILE_CHUNK ? SENDFILE_CHUNK : wf->buffer.sz;
+		ssize_t sz = file_send(s->fd, wf, n);
+		if (sz < 0) {
+			switch(errno) {
+			case EINTR:
+				continue;
+			case AGAIN_WOULDBLOCK:
+				return -1;
+			}
+			return close_write(ss, s, l, result);
+		}
+		if (sz == 0) {
+			// 文件比要发送的长度短，剩下的数据补不上了，只能关闭写端
+			errno = EIO;
+			return close_write(ss, s, l, result);
+		}
+		stat_write(ss,s,(int)sz);
+		s->stat.wcall++;
+		s->stat.wbuf++;
+		s->wb_size -= sz;
+		wf->buffer.sz -= sz;
+	}
+	list->head = wf->buffer.next;
+	write_buffer_free(ss, &wf->buffer);
+	return 0;
+}
+
 static int
 send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_lock *l, struct socket_message *result) {
+	struct iovec iov[SEND_IOV_MAX];
 	while (list->head) {
+		if (list->head->file) {
+			int r = send_list_file(ss, s, list, l, result);
+			if (r != 0)
+				return r;
+			continue;
+		}
+		// 把队列前面的若干个 buffer 合并成一次 writev ，遇到文件为止
+		int n = 0;
 		struct write_buffer * tmp = list->head;
+		while (tmp && n < SEND_IOV_MAX && !tmp->file) {
+			iov[n].iov_base = tmp->ptr;
+			iov[n].iov_len = tmp->sz;
+			++n;
+			tmp = tmp->next;
+		}
+		ssize_t sz;
 		for (;;) {
-			ssize_t sz = write(s->fd, tmp->ptr, tmp->sz);
+			sz = writev(s->fd, iov, n);
 			if (sz < 0) {
 				switch(errno) {
 				case EINTR:
@@ -751,17 +1311,25 @@ send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 				}
 				return close_write(ss, s, l, result);
 			}
-			stat_write(ss,s,(int)sz);
-			s->wb_size -= sz;
-			if (sz != tmp->sz) {
+			break;
+		}
+		stat_write(ss,s,(int)sz);
+		s->stat.wcall++;
+		s->stat.wbuf += n;
+		s->wb_size -= sz;
+		// 释放已经完整写出的 buffer，最后一个只写了一部分的留在队列头部
+		int i;
+		for (i=0;i<n;i++) {
+			tmp = list->head;
+			if ((size_t)sz < tmp->sz) {
 				tmp->ptr += sz;
 				tmp->sz -= sz;
 				return -1;
 			}
-			break;
+			sz -= tmp->sz;
+			list->head = tmp->next;
+			write_buffer_free(ss,tmp);
 		}
-		list->head = tmp->next;
-		write_buffer_free(ss,tmp);
 	}
 	list->tail = NULL;
 
@@ -801,6 +1369,69 @@ drop_udp(struct socket_server *ss, struct socket *s, struct wb_list *list, struc
 	write_buffer_free(ss,tmp);
 }
 
+#ifdef UDP_MMSG
+
+static int
+send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
+	struct mmsghdr msg[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	union sockaddr_all sa[UDP_BATCH];
+	while (list->head) {
+		// 地址类型匹配的连续若干个包合并成一次 sendmmsg
+		int n = 0;
+		struct write_buffer * tmp = list->head;
+		while (tmp && n < UDP_BATCH) {
+			struct write_buffer_udp * udp = (struct write_buffer_udp *)tmp;
+			socklen_t sasz = udp_socket_address(s, udp->udp_address, &sa[n]);
+			if (sasz == 0)
+				break;
+			iov[n].iov_base = tmp->ptr;
+			iov[n].iov_len = tmp->sz;
+			memset(&msg[n].msg_hdr, 0, sizeof(msg[n].msg_hdr));
+			msg[n].msg_hdr.msg_name = &sa[n].s;
+			msg[n].msg_hdr.msg_namelen = sasz;
+			msg[n].msg_hdr.msg_iov = &iov[n];
+			msg[n].msg_hdr.msg_iovlen = 1;
+			++n;
+			tmp = tmp->next;
+		}
+		if (n == 0) {
+			skynet_error(NULL, "socket-server : udp (%d) type mismatch.", s->id);
+			drop_udp(ss, s, list, list->head);
+			return -1;
+		}
+		int r = sendmmsg(s->fd, msg, n, 0);
+		if (r < 0) {
+			switch(errno) {
+			case EINTR:
+			case AGAIN_WOULDBLOCK:
+				return -1;
+			}
+			skynet_error(NULL, "socket-server : udp (%d) sendmmsg error %s.",s->id, strerror(errno));
+			drop_udp(ss, s, list, list->head);
+			return -1;
+		}
+		int i;
+		for (i=0;i<r;i++) {
+			tmp = list->head;
+			stat_write(ss,s,tmp->sz);
+			s->wb_size -= tmp->sz;
+			list->head = tmp->next;
+			write_buffer_free(ss,tmp);
+		}
+		if (r < n) {
+			if (list->head == NULL)
+				list->tail = NULL;
+			return -1;
+		}
+	}
+	list->tail = NULL;
+
+	return -1;
+}
+
+#else
+
 static int
 send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
 	while (list->head) {
@@ -834,6 +1465,8 @@ send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 	return -1;
 }
 
+#endif
+
 static int
 send_list(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_lock *l, struct socket_message *result) {
 	if (s->protocol == PROTOCOL_TCP) {
@@ -848,6 +1481,10 @@ list_uncomplete(struct wb_list *s) {
 	struct write_buffer *wb = s->head;
 	if (wb == NULL)
 		return 0;
+	if (wb->file) {
+		struct write_buffer_file *wf = (struct write_buffer_file *)wb;
+		return wf->offset != wf->start;
+	}
 	
 	return (void *)wb->ptr != wb->buffer;
 }
@@ -874,6 +1511,20 @@ send_buffer_empty(struct socket *s) {
 	return (s->high.head == NULL && s->low.head == NULL);
 }
 
+// 超过高水位后待发送的数据降到低水位，通知服务（ud 为 0 ，和发完数据时的 SOCKET_WARNING 一样）
+static inline int
+send_drained(struct socket *s, struct socket_message *result) {
+	if (s->overflow && s->wb_size <= s->low_mark) {
+		s->overflow = false;
+		result->opaque = s->opaque;
+		result->id = s->id;
+		result->ud = 0;
+		result->data = NULL;
+		return SOCKET_WARNING;
+	}
+	return -1;
+}
+
 /*
 	Each socket has two write buffer list, high priority and low priority.
 
@@ -910,10 +1561,10 @@ send_buffer_(struct socket_server *ss, struct socket *s, struct socket_lock *l,
 			// step 3
 			if (list_uncomplete(&s->low)) {
 				raise_uncomplete(s);
-				return -1;
+				return send_drained(s, result);
 			}
 			if (s->low.head)
-				return -1;
+				return send_drained(s, result);
 		} 
 		// step 4
 		assert(send_buffer_empty(s) && s->wb_size == 0);
@@ -930,8 +1581,9 @@ send_buffer_(struct socket_server *ss, struct socket *s, struct socket_lock *l,
 			return report_error(s, result, "disable write failed");
 		}
 
-		if(s->warn_size > 0){
+		if(s->warn_size > 0 || s->overflow){
 			s->warn_size = 0;
+			s->overflow = false;
 			result->opaque = s->opaque;
 			result->id = s->id;
 			result->ud = 0;
@@ -940,7 +1592,7 @@ send_buffer_(struct socket_server *ss, struct socket *s, struct socket_lock *l,
 		}
 	}
 
-	return -1;
+	return send_drained(s, result);
 }
 
 static int
@@ -952,6 +1604,7 @@ send_buffer(struct socket_server *ss, struct socket *s, struct socket_lock *l, s
 		struct write_buffer * buf = MALLOC(sizeof(*buf));
 		struct send_object so;
 		buf->userobject = send_object_init(ss, &so, (void *)s->dw_buffer, s->dw_size);
+		buf->file = false;
 		buf->ptr = (char*)so.buffer+s->dw_offset;
 		buf->sz = so.sz - s->dw_offset;
 		buf->buffer = (void *)s->dw_buffer;
@@ -976,6 +1629,7 @@ append_sendbuffer_(struct socket_server *ss, struct wb_list *s, struct request_s
 	struct write_buffer * buf = MALLOC(size);
 	struct send_object so;
 	buf->userobject = send_object_init(ss, &so, request->buffer, request->sz);
+	buf->file = false;
 	buf->ptr = (char*)so.buffer;
 	buf->sz = so.sz;
 	buf->buffer = request->buffer;
@@ -1014,7 +1668,7 @@ append_sendbuffer_low(struct socket_server *ss,struct socket *s, struct request_
 static int
 trigger_write(struct socket_server *ss, struct request_send * request, struct socket_message *result) {
 	int id = request->id;
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	if (socket_invalid(s, id))
 		return -1;
 	if (enable_write(ss, s, true)) {
@@ -1023,6 +1677,31 @@ trigger_write(struct socket_server *ss, struct request_send * request, struct so
 	return -1;
 }
 
+static inline int
+send_warning(struct socket *s, struct socket_message *result) {
+	if (s->high_mark > 0) {
+		// 设置了水位，只在超过高水位时通知一次，等降到低水位时再通知（见 send_drained）
+		if (!s->overflow && s->wb_size >= s->high_mark) {
+			s->overflow = true;
+			result->opaque = s->opaque;
+			result->id = s->id;
+			result->ud = s->wb_size%1024 == 0 ? s->wb_size/1024 : s->wb_size/1024 + 1;
+			result->data = NULL;
+			return SOCKET_WARNING;
+		}
+		return -1;
+	}
+	if (s->wb_size >= WARNING_SIZE && s->wb_size >= s->warn_size) {
+		s->warn_size = s->warn_size == 0 ? WARNING_SIZE *2 : s->warn_size*2;
+		result->opaque = s->opaque;
+		result->id = s->id;
+		result->ud = s->wb_size%1024 == 0 ? s->wb_size/1024 : s->wb_size/1024 + 1;
+		result->data = NULL;
+		return SOCKET_WARNING;
+	}
+	return -1;
+}
+
 /*
 	When send a package , we can assign the priority : PRIORITY_HIGH or PRIORITY_LOW
 
@@ -1033,7 +1712,7 @@ trigger_write(struct socket_server *ss, struct request_send * request, struct so
 static int
 send_socket(struct socket_server *ss, struct request_send * request, struct socket_message *result, int priority, const uint8_t *udp_address) {
 	int id = request->id;
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	struct send_object so;
 	send_object_init(ss, &so, request->buffer, request->sz);
 	uint8_t type = ATOM_LOAD(&s->type);
@@ -1091,15 +1770,51 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 			append_sendbuffer_udp(ss,s,priority,request,udp_address);
 		}
 	}
-	if (s->wb_size >= WARNING_SIZE && s->wb_size >= s->warn_size) {
-		s->warn_size = s->warn_size == 0 ? WARNING_SIZE *2 : s->warn_size*2;
-		result->opaque = s->opaque;
-		result->id = s->id;
-		result->ud = s->wb_size%1024 == 0 ? s->wb_size/1024 : s->wb_size/1024 + 1;
-		result->data = NULL;
-		return SOCKET_WARNING;
+	return send_warning(s, result);
+}
+
+/// @brief 'F'网络命令处理函数，把文件追加到高优先级队列，由 socket 线程 sendfile 发送
+static int
+sendfile_socket(struct socket_server *ss, struct request_sendfile * request, struct socket_message *result) {
+	int id = request->id;
+	struct socket * s = get_socket(ss, id);
+	uint8_t type = ATOM_LOAD(&s->type);
+	if (type == SOCKET_TYPE_INVALID || s->id != id
+		|| type == SOCKET_TYPE_HALFCLOSE_WRITE
+		|| type == SOCKET_TYPE_PACCEPT
+		|| type == SOCKET_TYPE_PLISTEN
+		|| type == SOCKET_TYPE_LISTEN
+		|| s->protocol != PROTOCOL_TCP
+		|| s->closing) {
+		close(request->fd);
+		return -1;
 	}
-	return -1;
+	if (request->sz <= 0) {
+		close(request->fd);
+		return -1;
+	}
+	int empty = send_buffer_empty(s);
+	struct write_buffer_file *wf = MALLOC(sizeof(*wf));
+	wf->buffer.next = NULL;
+	wf->buffer.buffer = NULL;
+	wf->buffer.ptr = NULL;
+	wf->buffer.sz = (size_t)request->sz;
+	wf->buffer.userobject = false;
+	wf->buffer.file = true;
+	wf->fd = request->fd;
+	wf->offset = wf->start = (off_t)request->offset;
+	struct wb_list *list = &s->high;
+	if (list->head == NULL) {
+		list->head = list->tail = &wf->buffer;
+	} else {
+		list->tail->next = &wf->buffer;
+		list->tail = &wf->buffer;
+	}
+	s->wb_size += wf->buffer.sz;
+	if (empty && enable_write(ss, s, true)) {
+		return report_error(s, result, "enable write failed");
+	}
+	return send_warning(s, result);
 }
 
 /// @brief 'L'网络命令处理函数（由于在具体的服务中已经创建了相关监听套接字，这里只把监听套接字加入到 epoll 管理中，并创建 socket 结构变量）
@@ -1110,12 +1825,27 @@ listen_socket(struct socket_server *ss, struct request_listen * request, struct
 	int listen_fd = request->fd;
 	struct socket *s = new_fd(ss, id, listen_fd, PROTOCOL_TCP, request->opaque, false);
 	if (s == NULL) {
+		if (request->parent >= 0) {
+			// 服务不知道这个 id ，只少了一个分担 accept 的监听套接字
+			close(listen_fd);
+			get_socket(ss, id)->type = SOCKET_TYPE_INVALID;
+			skynet_error(NULL, "socket-server: reuseport listener %d of %d failed", id, request->parent);
+			return -1;
+		}
 		goto _failed;
 	}
+	s->listen_parent = request->parent;
+	s->listen_next = request->next;
+	// 一次就绪事件上会循环 accept 到 EAGAIN
+	sp_nonblocking(listen_fd);
 
 	// 设置为 SOCKET_TYPE_PLISTEN 状态，这是一个中间状态，此时这个监听套接字还不能工作（因为没有调用accept()，也没添加到轮询器管理）
 	// 等待 'R' 命令时这个监听套接字开始工作，对应 lua 层的socket.start()
 	ATOM_STORE(&s->type , SOCKET_TYPE_PLISTEN);
+	if (s->listen_parent >= 0) {
+		// 监听组中的其它监听套接字，只由组内第一个向服务报告
+		return -1;
+	}
 	result->opaque = request->opaque;
 	result->id = id;
 	result->ud = 0;
@@ -1144,7 +1874,7 @@ _failed:
 	result->id = id;
 	result->ud = 0;
 	result->data = "reach skynet socket number limit";
-	ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
+	get_socket(ss, id)->type = SOCKET_TYPE_INVALID;
 
 	return SOCKET_ERR;
 }
@@ -1172,6 +1902,27 @@ halfclose_read(struct socket *s) {
 	return ATOM_LOAD(&s->type) == SOCKET_TYPE_HALFCLOSE_READ;
 }
 
+static void forward_request(struct socket_server *ss, struct request_package *request, char type, int len);
+
+// SO_REUSEPORT 监听组：服务只持有组内第一个监听套接字的 id ，start/pause/close 沿链转给下一个监听套接字所在的分片
+static void
+listen_forward(struct socket_server *ss, int next, int type, uintptr_t opaque, int shutdown) {
+	if (next < 0)
+		return;
+	struct request_package request;
+	struct socket_server *target = id_shard(ss, next);
+	if (type == 'K') {
+		request.u.close.id = next;
+		request.u.close.shutdown = shutdown;
+		request.u.close.opaque = opaque;
+		forward_request(target, &request, 'K', sizeof(request.u.close));
+	} else {
+		request.u.resumepause.id = next;
+		request.u.resumepause.opaque = opaque;
+		forward_request(target, &request, type, sizeof(request.u.resumepause));
+	}
+}
+
 // SOCKET_CLOSE can be raised (only once) in one of two conditions.
 // See https://github.com/cloudwu/skynet/issues/1346 for more discussion.
 // 1. close socket by self, See close_socket()
@@ -1180,7 +1931,7 @@ halfclose_read(struct socket *s) {
 static int
 close_socket(struct socket_server *ss, struct request_close *request, struct socket_message *result) {
 	int id = request->id;
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	if (socket_invalid(s, id)) {
 		// The socket is closed, ignore
 		return -1;
@@ -1188,6 +1939,15 @@ close_socket(struct socket_server *ss, struct request_close *request, struct soc
 	struct socket_lock l;
 	socket_lock_init(s, &l);
 
+	if (s->listen_next >= 0 || s->listen_parent >= 0) {
+		listen_forward(ss, s->listen_next, 'K', request->opaque, request->shutdown);
+		s->listen_next = -1;
+		if (s->listen_parent >= 0) {
+			force_close(ss, s, &l, result);
+			return -1;
+		}
+	}
+
 	int shutdown_read = halfclose_read(s);
 
 	if (request->shutdown || nomore_sending_data(s)) {
@@ -1206,6 +1966,19 @@ close_socket(struct socket_server *ss, struct request_close *request, struct soc
 	return -1;
 }
 
+// 其他分片 accept 的新连接，在本分片的线程中加入 epoll ，等待服务 start
+static int
+import_socket(struct socket_server *ss, struct request_bind *request) {
+	struct socket *s = new_fd(ss, request->id, request->fd, PROTOCOL_TCP, request->opaque, false);
+	if (s == NULL) {
+		// 服务已经收到了这个 id ，之后 start 时会得到 invalid socket 错误
+		close(request->fd);
+		return -1;
+	}
+	ATOM_STORE(&s->type , SOCKET_TYPE_PACCEPT);
+	return -1;
+}
+
 static int
 bind_socket(struct socket_server *ss, struct request_bind *request, struct socket_message *result) {
 	int id = request->id;
@@ -1230,7 +2003,7 @@ resume_socket(struct socket_server *ss, struct request_resumepause *request, str
 	result->opaque = request->opaque;
 	result->ud = 0;
 	result->data = NULL;
-	struct socket *s = &ss->slot[HASH_ID(id)];
+	struct socket *s = get_socket(ss, id);
 	if (socket_invalid(s, id)) {
 		result->data = "invalid socket";
 		return SOCKET_ERR;
@@ -1246,10 +2019,13 @@ resume_socket(struct socket_server *ss, struct request_resumepause *request, str
 		result->data = "enable read failed";
 		return SOCKET_ERR;
 	}
+	listen_forward(ss, s->listen_next, 'R', request->opaque, 0);
 	uint8_t type = ATOM_LOAD(&s->type);
 	if (type == SOCKET_TYPE_PACCEPT || type == SOCKET_TYPE_PLISTEN) {
 		ATOM_STORE(&s->type , (type == SOCKET_TYPE_PACCEPT) ? SOCKET_TYPE_CONNECTED : SOCKET_TYPE_LISTEN);
 		s->opaque = request->opaque;
+		if (s->listen_parent >= 0)
+			return -1;
 		result->data = "start";
 		return SOCKET_OPEN;
 	} else if (type == SOCKET_TYPE_CONNECTED) {
@@ -1265,56 +2041,60 @@ resume_socket(struct socket_server *ss, struct request_resumepause *request, str
 static int
 pause_socket(struct socket_server *ss, struct request_resumepause *request, struct socket_message *result) {
 	int id = request->id;
-	struct socket *s = &ss->slot[HASH_ID(id)];
+	struct socket *s = get_socket(ss, id);
 	if (socket_invalid(s, id)) {
 		return -1;
 	}
+	listen_forward(ss, s->listen_next, 'S', request->opaque, 0);
 	if (enable_read(ss, s, false)) {
 		return report_error(s, result, "enable read failed");
 	}
 	return -1;
 }
 
-static void
-setopt_socket(struct socket_server *ss, struct request_setopt *request) {
+static int
+watermark_socket(struct socket_server *ss, struct request_watermark *request, struct socket_message *result) {
 	int id = request->id;
-	struct socket *s = &ss->slot[HASH_ID(id)];
+	struct socket *s = get_socket(ss, id);
 	if (socket_invalid(s, id)) {
-		return;
+		return -1;
 	}
-	int v = request->value;
-	setsockopt(s->fd, IPPROTO_TCP, request->what, &v, sizeof(v));
+	s->high_mark = request->high;
+	s->low_mark = request->low;
+	if (s->high_mark <= 0) {
+		s->overflow = false;
+		return -1;
+	}
+	// 设置时可能已经超过高水位，或者之前的超出状态在新的低水位下已经解除
+	if (s->overflow)
+		return send_drained(s, result);
+	return send_warning(s, result);
 }
 
 static void
-block_readpipe(int pipefd, void *buffer, int sz) {
-	for (;;) {
-		int n = read(pipefd, buffer, sz);
-		if (n<0) {
-			if (errno == EINTR)
-				continue;
-			skynet_error(NULL, "socket-server : read pipe error %s.",strerror(errno));
-			return;
-		}
-		// must atomic read from a pipe
-		assert(n == sz);
+setopt_socket(struct socket_server *ss, struct request_setopt *request) {
+	int id = request->id;
+	struct socket *s = get_socket(ss, id);
+	if (socket_invalid(s, id)) {
 		return;
 	}
+	int v = request->value;
+	setsockopt(s->fd, IPPROTO_TCP, request->what, &v, sizeof(v));
 }
 
-/// @brief 检查命令管道中是否有命令待处理
+/// @brief 检查命令队列中是否有命令待处理（只读内存，不需要系统调用）
 static int
 has_cmd(struct socket_server *ss) {
-	struct timeval tv = {0,0};
-	int retval;
-
-	FD_SET(ss->recvctrl_fd, &ss->rfds);
-	// 这里的 select 仅仅是用来轮询文件描述符的状态，检查接收命令的管道的读端是否可读
-	retval = select(ss->recvctrl_fd+1, &ss->rfds, NULL, NULL, &tv);
-	if (retval == 1) {
+	struct ctrl_ring *r = ss->ctrl;
+	struct ctrl_cell *c = &r->cell[r->head % CTRL_RING_SIZE];
+	if (r->local || ATOM_LOAD(&c->seq) == r->head + 1 || ATOM_LOAD(&r->inbox))
 		return 1;
-	}
-	return 0;
+	if (ATOM_LOAD(&r->signal) == 0)
+		return 0;
+	// 队列已空，复位唤醒标记后再检查一次，避免写入者看到旧标记而没有唤醒
+	ATOM_STORE(&r->signal, 0);
+	ATOM_FENCE();
+	return ATOM_LOAD(&c->seq) == r->head + 1 || ATOM_LOAD(&r->inbox);
 }
 
 static void
@@ -1329,17 +2109,21 @@ add_udp_socket(struct socket_server *ss, struct request_udp *udp) {
 	struct socket *ns = new_fd(ss, id, udp->fd, protocol, udp->opaque, true);
 	if (ns == NULL) {
 		close(udp->fd);
-		ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
+		get_socket(ss, id)->type = SOCKET_TYPE_INVALID;
 		return;
 	}
 	ATOM_STORE(&ns->type , SOCKET_TYPE_CONNECTED);
 	memset(ns->p.udp_address, 0, sizeof(ns->p.udp_address));
+#ifdef UDP_RECV_GRO
+	int enable = 1;
+	setsockopt(udp->fd, SOL_UDP, UDP_GRO, &enable, sizeof(enable));
+#endif
 }
 
 static int
 set_udp_address(struct socket_server *ss, struct request_setudp *request, struct socket_message *result) {
 	int id = request->id;
-	struct socket *s = &ss->slot[HASH_ID(id)];
+	struct socket *s = get_socket(ss, id);
 	if (socket_invalid(s, id)) {
 		return -1;
 	}
@@ -1358,12 +2142,12 @@ set_udp_address(struct socket_server *ss, struct request_setudp *request, struct
 }
 
 static inline void
-inc_sending_ref(struct socket *s, int id) {
+inc_sending_ref(struct socket_server *ss, struct socket *s, int id) {
 	if (s->protocol != PROTOCOL_TCP)
 		return;
 	for (;;) {
 		unsigned long sending = ATOM_LOAD(&s->sending);
-		if ((sending >> 16) == ID_TAG16(id)) {
+		if ((sending >> 16) == ID_TAG16(ss, id)) {
 			if ((sending & 0xffff) == 0xffff) {
 				// s->sending may overflow (rarely), so busy waiting here for socket thread dec it. see issue #794
 				continue;
@@ -1381,7 +2165,7 @@ inc_sending_ref(struct socket *s, int id) {
 
 static inline void
 dec_sending_ref(struct socket_server *ss, int id) {
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	// Notice: udp may inc sending while type == SOCKET_TYPE_RESERVE
 	if (s->id == id && s->protocol == PROTOCOL_TCP) {
 		assert((ATOM_LOAD(&s->sending) & 0xffff) != 0);
@@ -1395,16 +2179,42 @@ dec_sending_ref(struct socket_server *ss, int id) {
 /// @return 返回-1表示命令执行成功且不需要通知关联的服务; 非-1则需要通知关联的服务
 static int
 ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
-	int fd = ss->recvctrl_fd;
 	// the length of message is one byte, so 256 buffer size is enough.
 	uint8_t buffer[256];	// 数据体
-	uint8_t header[2];		// 数据头
 
-	// 先读数据头，得到命令类型和数据体长度，再读数据体
-	block_readpipe(fd, header, sizeof(header));
-	int type = header[0];
-	int len = header[1];
-	block_readpipe(fd, buffer, len);
+	struct ctrl_ring *r = ss->ctrl;
+	int type, len;
+	if (r->local == NULL && ATOM_LOAD(&r->inbox)) {
+		// 先取走其它 socket 线程转发来的命令，反转成先进先出。
+		// 它们发生在服务看到相关 id 之前，比队列中的命令（例如 accept 之后的 start）先处理
+		uintptr_t head;
+		do {
+			head = ATOM_LOAD(&r->inbox);
+		} while (!ATOM_CAS_POINTER(&r->inbox, head, (uintptr_t)NULL));
+		struct ctrl_node *n = (struct ctrl_node *)head;
+		while (n) {
+			struct ctrl_node *next = n->next;
+			n->next = r->local;
+			r->local = n;
+			n = next;
+		}
+	}
+	if (r->local) {
+		struct ctrl_node *n = r->local;
+		r->local = n->next;
+		type = n->type;
+		len = n->len;
+		memcpy(buffer, n->buffer, len);
+		FREE(n);
+	} else {
+		// 取出队头的命令，复制出来后马上释放格子给写入者
+		struct ctrl_cell *c = &r->cell[r->head % CTRL_RING_SIZE];
+		type = c->type;
+		len = c->len;
+		memcpy(buffer, c->buffer, len);
+		ATOM_STORE(&c->seq, r->head + CTRL_RING_SIZE);
+		++r->head;
+	}
 
 	// ctrl command only exist in local fd, so don't worry about endian.
 	switch (type) {
@@ -1414,6 +2224,8 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 		return pause_socket(ss,(struct request_resumepause *)buffer, result);
 	case 'B':
 		return bind_socket(ss,(struct request_bind *)buffer, result);
+	case 'I':
+		return import_socket(ss,(struct request_bind *)buffer);
 	case 'L':
 		return listen_socket(ss,(struct request_listen *)buffer, result);
 	case 'K':
@@ -1436,6 +2248,12 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 		dec_sending_ref(ss, request->id);
 		return ret;
 	}
+	case 'F': {
+		struct request_sendfile * request = (struct request_sendfile *) buffer;
+		int ret = sendfile_socket(ss, request, result);
+		dec_sending_ref(ss, request->id);
+		return ret;
+	}
 	case 'A': {
 		struct request_send_udp * rsu = (struct request_send_udp *)buffer;
 		return send_socket(ss, &rsu->send, result, PRIORITY_HIGH, rsu->address);
@@ -1445,6 +2263,8 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 	case 'T':
 		setopt_socket(ss, (struct request_setopt *)buffer);
 		return -1;
+	case 'M':
+		return watermark_socket(ss, (struct request_watermark *)buffer, result);
 	case 'U':
 		add_udp_socket(ss, (struct request_udp *)buffer);
 		return -1;
@@ -1460,10 +2280,10 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 static int
 forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
 	int sz = s->p.size;
-	char * buffer = MALLOC(sz);
+	char * buffer = read_buffer_alloc(s, sz);
 	int n = (int)read(s->fd, buffer, sz);
 	if (n<0) {
-		FREE(buffer);
+		socket_server_free_buffer(buffer, sz);
 		switch(errno) {
 		case EINTR:
 		case AGAIN_WOULDBLOCK:
@@ -1474,7 +2294,7 @@ forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lo
 		return -1;
 	}
 	if (n==0) {
-		FREE(buffer);
+		socket_server_free_buffer(buffer, sz);
 		if (s->closing) {
 			// Rare case : if s->closing is true, reading event is disable, and SOCKET_CLOSE is raised.
 			if (nomore_sending_data(s)) {
@@ -1498,11 +2318,12 @@ forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lo
 
 	if (halfclose_read(s)) {
 		// discard recv data (Rare case : if socket is HALFCLOSE_READ, reading event is disable.)
-		FREE(buffer);
+		socket_server_free_buffer(buffer, sz);
 		return -1;
 	}
 
 	stat_read(ss,s,n);
+	buffer = read_buffer_fit(buffer, sz, n);
 
 	result->opaque = s->opaque;
 	result->id = s->id;
@@ -1537,6 +2358,113 @@ gen_udp_address(int protocol, union sockaddr_all *sa, uint8_t * udp_address) {
 	return addrsz;
 }
 
+#ifdef UDP_MMSG
+
+static int
+udp_batch_recv(struct socket *s, struct udp_batch *b) {
+	int i;
+	for (i=0;i<UDP_BATCH;i++) {
+		struct msghdr *h = &b->msg[i].msg_hdr;
+		b->iov[i].iov_base = b->buffer[i];
+		b->iov[i].iov_len = MAX_UDP_PACKAGE;
+		memset(h, 0, sizeof(*h));
+		h->msg_name = &b->addr[i].s;
+		h->msg_namelen = sizeof(b->addr[i]);
+		h->msg_iov = &b->iov[i];
+		h->msg_iovlen = 1;
+#ifdef UDP_RECV_GRO
+		h->msg_control = b->control[i];
+		h->msg_controllen = sizeof(b->control[i]);
+#endif
+	}
+	b->id = s->id;
+	b->index = 0;
+	b->offset = 0;
+	b->n = recvmmsg(s->fd, b->msg, UDP_BATCH, MSG_DONTWAIT, NULL);
+	return b->n;
+}
+
+// GRO 合并的包中每个分段的大小，没有合并返回 0
+static int
+udp_gro_size(struct msghdr *h) {
+#ifdef UDP_RECV_GRO
+	struct cmsghdr *cm;
+	for (cm = CMSG_FIRSTHDR(h); cm; cm = CMSG_NXTHDR(h, cm)) {
+		if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+			int size;
+			memcpy(&size, CMSG_DATA(cm), sizeof(size));
+			return size;
+		}
+	}
+#endif
+	return 0;
+}
+
+static int
+forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
+	struct udp_batch *b = ss->udp;
+	if (b == NULL) {
+		b = ss->udp = MALLOC(sizeof(*b));
+		b->id = -1;
+		b->n = 0;
+		b->index = 0;
+	}
+	for (;;) {
+		if (b->id != s->id || b->index >= b->n) {
+			// 上一批已经交完，再读一批
+			if (udp_batch_recv(s, b) < 0) {
+				b->n = 0;
+				switch(errno) {
+				case EINTR:
+				case AGAIN_WOULDBLOCK:
+					return -1;
+				}
+				int error = errno;
+				// close when error
+				force_close(ss, s, l, result);
+				result->data = strerror(error);
+				return SOCKET_ERR;
+			}
+		}
+		struct msghdr *h = &b->msg[b->index].msg_hdr;
+		union sockaddr_all *sa = &b->addr[b->index];
+		uint8_t *buffer = b->buffer[b->index] + b->offset;
+		int n = (int)b->msg[b->index].msg_len - b->offset;
+		int segment = udp_gro_size(h);
+		if (segment > 0 && n > segment) {
+			n = segment;
+			b->offset += segment;
+		} else {
+			++b->index;
+			b->offset = 0;
+		}
+		stat_read(ss,s,n);
+
+		uint8_t * data;
+		if (h->msg_namelen == sizeof(sa->v4)) {
+			if (s->protocol != PROTOCOL_UDP)
+				continue;
+			data = MALLOC(n + 1 + 2 + 4);
+			gen_udp_address(PROTOCOL_UDP, sa, data + n);
+		} else {
+			if (s->protocol != PROTOCOL_UDPv6)
+				continue;
+			data = MALLOC(n + 1 + 2 + 16);
+			gen_udp_address(PROTOCOL_UDPv6, sa, data + n);
+		}
+		memcpy(data, buffer, n);
+
+		result->opaque = s->opaque;
+		result->id = s->id;
+		result->ud = n;
+		result->data = (char *)data;
+
+		return SOCKET_UDP;
+	}
+}
+
+#else
+
 static int
 forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
 	union sockaddr_all sa;
@@ -1578,6 +2506,8 @@ forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_lo
 	return SOCKET_UDP;
 }
 
+#endif
+
 /// @brief 正在连接状态的 socket 后续处理（建立连接成功/失败）
 /// @return SOCKET_OPEN: 成功;  SOCKET_ERR: 失败
 static int
@@ -1635,11 +2565,14 @@ static int
 report_accept(struct socket_server *ss, struct socket *s, struct socket_message *result) {
 	union sockaddr_all u;
 	socklen_t len = sizeof(u);
+	// SO_REUSEPORT 监听组中的连接由内核分到各个分片的监听套接字上，就地处理，以组内第一个的 id 报告给服务
+	int listen_id = s->listen_parent >= 0 ? s->listen_parent : s->id;
+	bool reuseport = s->listen_parent >= 0 || s->listen_next >= 0;
 	int client_fd = accept(s->fd, &u.s, &len);
 	if (client_fd < 0) {
 		if (errno == EMFILE || errno == ENFILE) {
 			result->opaque = s->opaque;
-			result->id = s->id;
+			result->id = listen_id;
 			result->ud = 0;
 			result->data = strerror(errno);
 
@@ -1657,24 +2590,38 @@ report_accept(struct socket_server *ss, struct socket *s, struct socket_message
 			return 0;
 		}
 	}
-	int id = reserve_id(ss);
+	// 新连接轮流放到各个分片上，由对应的 socket 线程负责读写
+	struct socket_server *target = ss;
+	if (ss->group_n > 1 && !reuseport) {
+		target = ss->group[(unsigned)ATOM_FINC(&ss->accept_rr) % ss->group_n];
+	}
+	int id = reserve_id(target);
 	if (id < 0) {
 		close(client_fd);
 		return 0;
 	}
 	socket_keepalive(client_fd);
 	sp_nonblocking(client_fd);
-	struct socket *ns = new_fd(ss, id, client_fd, PROTOCOL_TCP, s->opaque, false);
-	if (ns == NULL) {
-		close(client_fd);
-		return 0;
+	if (target != ss) {
+		// 交给目标分片的线程加入它的 epoll ，服务之后对这个 id 的命令都排在这个请求之后
+		struct request_package request;
+		request.u.bind.opaque = s->opaque;
+		request.u.bind.id = id;
+		request.u.bind.fd = client_fd;
+		forward_request(target, &request, 'I', sizeof(request.u.bind));
+	} else {
+		struct socket *ns = new_fd(ss, id, client_fd, PROTOCOL_TCP, s->opaque, false);
+		if (ns == NULL) {
+			close(client_fd);
+			return 0;
+		}
+		ATOM_STORE(&ns->type , SOCKET_TYPE_PACCEPT);
 	}
 	// accept new one connection
 	stat_read(ss,s,1);
 
-	ATOM_STORE(&ns->type , SOCKET_TYPE_PACCEPT);
 	result->opaque = s->opaque;
-	result->id = s->id;
+	result->id = listen_id;
 	result->ud = id;
 	result->data = NULL;
 
@@ -1710,10 +2657,10 @@ clear_closed_event(struct socket_server *ss, struct socket_message * result, int
 /// @param result [out]结果数据
 /// @param more 是否还有事件待处理，一次事件轮询得到所有事件处理完后将被置为0
 /// @return 处理结果类型
-int 
-socket_server_poll(struct socket_server *ss, struct socket_message * result, int * more) {
+static int
+server_poll(struct socket_server *ss, struct socket_message * result, int * more) {
 	for (;;) {
-		// 处理网络命令（这里没有理解到，为什么已经使用epoll管理了命令管道fd，触发后不直接调用，反而再使用select检查后再调用的意义）
+		// 处理网络命令：每轮事件轮询之后先把命令队列中的命令处理完，检查队列只需要读内存
 		if (ss->checkctrl) {
 			if (has_cmd(ss)) {
 				int type = ctrl_cmd(ss, result);
@@ -1729,12 +2676,17 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 
 		// 一轮事件轮询的所有事件处理完毕以后的操作
 		if (ss->event_index == ss->event_n) {
+			if (ss->idle_report) {
+				// 让上层先投递攒下的消息
+				return SOCKET_IDLE;
+			}
 			ss->event_n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT);		// 开启下一轮轮询
 			ss->checkctrl = 1;
 			if (more) {
 				*more = 0;
 			}
 			ss->event_index = 0;
+			ss->accept_n = 0;
 			if (ss->event_n <= 0) {
 				ss->event_n = 0;
 				int err = errno;
@@ -1749,8 +2701,10 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 		struct event *e = &ss->ev[ss->event_index++];
 		struct socket *s = e->s;
 		if (s == NULL) {
-			// 如果是命令管道fd触发的事件，将会到达这里，直接转到下次循环先执行管道中的网络命令
-			// dispatch pipe message at beginning
+			// 如果是命令通知触发的事件，将会到达这里，清除通知后转到下次循环先执行队列中的网络命令
+			// dispatch ctrl commands at beginning
+			ctrl_fd_clear(ss->recvctrl_fd);
+			ss->checkctrl = 1;
 			continue;
 		}
 		struct socket_lock l;
@@ -1761,8 +2715,16 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 		case SOCKET_TYPE_LISTEN: {
 			int ok = report_accept(ss, s, result);
 			if (ok > 0) {
+				// 同一个就绪事件上继续 accept ，直到 EAGAIN 或者达到 MAX_ACCEPT_BATCH
+				if (++ss->accept_n < MAX_ACCEPT_BATCH) {
+					--ss->event_index;
+				} else {
+					ss->accept_n = 0;
+				}
 				return SOCKET_ACCEPT;
-			} if (ok < 0 ) {
+			}
+			ss->accept_n = 0;
+			if (ok < 0 ) {
 				return SOCKET_ERR;
 			}
 			// when ok == 0, retry
@@ -1831,21 +2793,55 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 	}
 }
 
+// 返回过消息之后，阻塞等待新的事件之前先返回一次 SOCKET_IDLE ，让上层投递攒下的消息
+int
+socket_server_poll(struct socket_server *ss, struct socket_message * result, int * more) {
+	int type = server_poll(ss, result, more);
+	ss->idle_report = (type != SOCKET_IDLE);
+	return type;
+}
+
 static void
 send_request(struct socket_server *ss, struct request_package *request, char type, int len) {
-	request->header[6] = (uint8_t)type;
-	request->header[7] = (uint8_t)len;
-	const char * req = (const char *)request + offsetof(struct request_package, header[6]);
+	struct ctrl_ring *r = ss->ctrl;
+	struct ctrl_cell *c;
+	size_t pos;
 	for (;;) {
-		ssize_t n = write(ss->sendctrl_fd, req, len+2);
-		if (n<0) {
-			if (errno != EINTR) {
-				skynet_error(NULL, "socket-server : send ctrl command error %s.", strerror(errno));
-			}
-			continue;
+		pos = ATOM_LOAD(&r->tail);
+		c = &r->cell[pos % CTRL_RING_SIZE];
+		size_t seq = ATOM_LOAD(&c->seq);
+		if (seq == pos) {
+			if (ATOM_CAS_SIZET(&r->tail, pos, pos + 1))
+				break;
+		} else if ((intptr_t)(seq - pos) < 0) {
+			// 队列满了，等 socket 线程处理
+			sched_yield();
 		}
-		assert(n == len+2);
-		return;
+	}
+	c->type = (uint8_t)type;
+	c->len = (uint8_t)len;
+	memcpy(c->buffer, &request->u, len);
+	ATOM_STORE(&c->seq, pos + 1);
+	if (ATOM_LOAD(&r->signal) == 0 && ATOM_CAS(&r->signal, 0, 1)) {
+		ctrl_fd_notify(ss->sendctrl_fd);
+	}
+}
+
+// socket 线程发给其它分片的命令，不会因为对方的队列满了而等待
+static void
+forward_request(struct socket_server *ss, struct request_package *request, char type, int len) {
+	struct ctrl_ring *r = ss->ctrl;
+	struct ctrl_node *n = MALLOC(sizeof(*n) + len);
+	n->type = (uint8_t)type;
+	n->len = (uint8_t)len;
+	memcpy(n->buffer, &request->u, len);
+	uintptr_t head;
+	do {
+		head = ATOM_LOAD(&r->inbox);
+		n->next = (struct ctrl_node *)head;
+	} while (!ATOM_CAS_POINTER(&r->inbox, head, (uintptr_t)n));
+	if (ATOM_LOAD(&r->signal) == 0 && ATOM_CAS(&r->signal, 0, 1)) {
+		ctrl_fd_notify(ss->sendctrl_fd);
 	}
 }
 
@@ -1894,7 +2890,7 @@ can_direct_write(struct socket *s, int id) {
 int 
 socket_server_send(struct socket_server *ss, struct socket_sendbuffer *buf) {
 	int id = buf->id;
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	if (socket_invalid(s, id) || s->closing) {
 		free_buffer(ss, buf);
 		return -1;
@@ -1953,7 +2949,7 @@ socket_server_send(struct socket_server *ss, struct socket_sendbuffer *buf) {
 		socket_unlock(&l);
 	}
 
-	inc_sending_ref(s, id);
+	inc_sending_ref(ss, s, id);
 
 	struct request_package request;
 	request.u.send.id = id;
@@ -1968,13 +2964,13 @@ int
 socket_server_send_lowpriority(struct socket_server *ss, struct socket_sendbuffer *buf) {
 	int id = buf->id;
 
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	if (socket_invalid(s, id)) {
 		free_buffer(ss, buf);
 		return -1;
 	}
 
-	inc_sending_ref(s, id);
+	inc_sending_ref(ss, s, id);
 
 	struct request_package request;
 	request.u.send.id = id;
@@ -1984,6 +2980,39 @@ socket_server_send_lowpriority(struct socket_server *ss, struct socket_sendbuffe
 	return 0;
 }
 
+// 文件描述符 fd 的所有权交给 socket 线程，sz < 0 表示发送到文件末尾
+int
+socket_server_sendfile(struct socket_server *ss, int id, int fd, int64_t offset, int64_t sz) {
+	struct socket * s = get_socket(ss, id);
+	if (socket_invalid(s, id) || s->closing || offset < 0) {
+		close(fd);
+		return -1;
+	}
+	if (sz < 0) {
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size < offset) {
+			close(fd);
+			return -1;
+		}
+		sz = st.st_size - offset;
+	}
+	if (sz == 0) {
+		close(fd);
+		return 0;
+	}
+
+	// 和 'D' 一样增加 sending 引用，之后的 send 不会越过这个文件直接写
+	inc_sending_ref(ss, s, id);
+
+	struct request_package request;
+	request.u.sendfile.id = id;
+	request.u.sendfile.fd = fd;
+	request.u.sendfile.offset = offset;
+	request.u.sendfile.sz = sz;
+	send_request(ss, &request, 'F', sizeof(request.u.sendfile));
+	return 0;
+}
+
 void
 socket_server_exit(struct socket_server *ss) {
 	struct request_package request;
@@ -2012,7 +3041,7 @@ socket_server_shutdown(struct socket_server *ss, uintptr_t opaque, int id) {
 // return -1 means failed
 // or return AF_INET or AF_INET6
 static int
-do_bind(const char *host, int port, int protocol, int *family) {
+do_bind(const char *host, int port, int protocol, int *family, bool reuseport) {
 	int fd;
 	int status;
 	int reuse = 1;
@@ -2045,6 +3074,11 @@ do_bind(const char *host, int port, int protocol, int *family) {
 	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&reuse, sizeof(int))==-1) {
 		goto _failed;
 	}
+#ifdef SO_REUSEPORT
+	if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&reuse, sizeof(int))==-1) {
+		goto _failed;
+	}
+#endif
 	status = bind(fd, (struct sockaddr *)ai_list->ai_addr, ai_list->ai_addrlen);
 	if (status != 0)
 		goto _failed;
@@ -2059,9 +3093,9 @@ _failed_fd:
 }
 
 static int
-do_listen(const char * host, int port, int backlog) {
+do_listen(const char * host, int port, int backlog, bool reuseport) {
 	int family = 0;
-	int listen_fd = do_bind(host, port, IPPROTO_TCP, &family);
+	int listen_fd = do_bind(host, port, IPPROTO_TCP, &family, reuseport);
 	if (listen_fd < 0) {
 		return -1;
 	}
@@ -2082,7 +3116,7 @@ do_listen(const char * host, int port, int backlog) {
 /// @return 
 int 
 socket_server_listen(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int backlog) {
-	int fd = do_listen(addr, port, backlog);
+	int fd = do_listen(addr, port, backlog, false);
 	if (fd < 0) {
 		return -1;
 	}
@@ -2095,10 +3129,71 @@ socket_server_listen(struct socket_server *ss, uintptr_t opaque, const char * ad
 	request.u.listen.opaque = opaque;
 	request.u.listen.id = id;
 	request.u.listen.fd = fd;
+	request.u.listen.parent = -1;
+	request.u.listen.next = -1;
 	send_request(ss, &request, 'L', sizeof(request.u.listen));
 	return id;
 }
 
+/// @brief 在每个分片上各开一个 SO_REUSEPORT 监听套接字，由内核把新连接分到各个 socket 线程上 accept
+/// @brief 返回的 id 是 ss 上的那个，其它的对服务不可见，start/pause/close 会转发给它们
+int
+socket_server_listen_reuseport(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int backlog) {
+#ifdef SO_REUSEPORT
+	int n = ss->group_n > 1 ? ss->group_n : 1;
+	if (n == 1)
+		return socket_server_listen(ss, opaque, addr, port, backlog);
+	int *fd = MALLOC(n * 2 * sizeof(int));
+	int *id = fd + n;
+	int i;
+	for (i=0;i<n;i++) {
+		fd[i] = -1;
+		id[i] = -1;
+	}
+	for (i=0;i<n;i++) {
+		struct socket_server *target = ss->group[(ss->shard + i) % n];
+		fd[i] = do_listen(addr, port, backlog, true);
+		if (fd[i] < 0)
+			goto _failed;
+		if (port == 0) {
+			// 第一个监听套接字由系统分配端口，其它的绑定到同一个端口上
+			union sockaddr_all u;
+			socklen_t slen = sizeof(u);
+			if (getsockname(fd[i], &u.s, &slen) != 0)
+				goto _failed;
+			port = ntohs((u.s.sa_family == AF_INET) ? u.v4.sin_port : u.v6.sin6_port);
+		}
+		id[i] = reserve_id(target);
+		if (id[i] < 0)
+			goto _failed;
+	}
+	// 先让其它分片加入监听套接字，保证转发过去的 start 排在 'L' 之后
+	struct request_package request;
+	for (i=n-1;i>=0;i--) {
+		request.u.listen.opaque = opaque;
+		request.u.listen.id = id[i];
+		request.u.listen.fd = fd[i];
+		request.u.listen.parent = i == 0 ? -1 : id[0];
+		request.u.listen.next = i == n-1 ? -1 : id[i+1];
+		send_request(ss->group[(ss->shard + i) % n], &request, 'L', sizeof(request.u.listen));
+	}
+	int ret = id[0];
+	FREE(fd);
+	return ret;
+_failed:
+	for (i=0;i<n;i++) {
+		if (fd[i] >= 0)
+			close(fd[i]);
+		if (id[i] >= 0)
+			ATOM_STORE(&get_socket(ss->group[(ss->shard + i) % n], id[i])->type, SOCKET_TYPE_INVALID);
+	}
+	FREE(fd);
+	return -1;
+#else
+	return socket_server_listen(ss, opaque, addr, port, backlog);
+#endif
+}
+
 int
 socket_server_bind(struct socket_server *ss, uintptr_t opaque, int fd) {
 	struct request_package request;
@@ -2137,6 +3232,29 @@ socket_server_nodelay(struct socket_server *ss, int id) {
 	send_request(ss, &request, 'T', sizeof(request.u.setopt));
 }
 
+// high <= 0 turns off the watermark, low is clamped to [0, high]
+void
+socket_server_watermark(struct socket_server *ss, int id, int64_t high, int64_t low) {
+	if (low > high)
+		low = high;
+	if (low < 0)
+		low = 0;
+	struct request_package request;
+	request.u.watermark.id = id;
+	request.u.watermark.high = high;
+	request.u.watermark.low = low;
+	send_request(ss, &request, 'M', sizeof(request.u.watermark));
+}
+
+// 在服务线程中查询是否超过了高水位，只是一个提示，以随后的 SOCKET_WARNING 消息为准
+int
+socket_server_overflow(struct socket_server *ss, int id) {
+	struct socket * s = get_socket(ss, id);
+	if (socket_invalid(s, id))
+		return 0;
+	return s->overflow;
+}
+
 void 
 socket_server_userobject(struct socket_server *ss, struct socket_object_interface *soi) {
 	ss->soi = *soi;
@@ -2150,7 +3268,7 @@ socket_server_udp(struct socket_server *ss, uintptr_t opaque, const char * addr,
 	int family;
 	if (port != 0 || addr != NULL) {
 		// bind
-		fd = do_bind(addr, port, IPPROTO_UDP, &family);
+		fd = do_bind(addr, port, IPPROTO_UDP, &family, false);
 		if (fd < 0) {
 			return -1;
 		}
@@ -2181,7 +3299,7 @@ socket_server_udp(struct socket_server *ss, uintptr_t opaque, const char * addr,
 int 
 socket_server_udp_send(struct socket_server *ss, const struct socket_udp_address *addr, struct socket_sendbuffer *buf) {
 	int id = buf->id;
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	if (socket_invalid(s, id)) {
 		free_buffer(ss, buf);
 		return -1;
@@ -2242,7 +3360,7 @@ socket_server_udp_send(struct socket_server *ss, const struct socket_udp_address
 
 int
 socket_server_udp_connect(struct socket_server *ss, int id, const char * addr, int port) {
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	if (socket_invalid(s, id)) {
 		return -1;
 	}
@@ -2368,6 +3486,10 @@ query_info(struct socket *s, struct socket_info *si) {
 	si->write = s->stat.write;
 	si->rtime = s->stat.rtime;
 	si->wtime = s->stat.wtime;
+	si->wcall = s->stat.wcall;
+	si->wbuf = s->stat.wbuf;
+	si->rhit = s->stat.rhit;
+	si->rmiss = s->stat.rmiss;
 	si->wbuffer = s->wb_size;
 	si->reading = s->reading;
 	si->writing = s->writing;
@@ -2379,8 +3501,9 @@ struct socket_info *
 socket_server_info(struct socket_server *ss) {
 	int i;
 	struct socket_info * si = NULL;
-	for (i=0;i<MAX_SOCKET;i++) {
-		struct socket * s = &ss->slot[i];
+	int slot_n = ATOM_LOAD(&ss->slot_n);
+	for (i=0;i<slot_n;i++) {
+		struct socket * s = slot_index(ss, i);
 		int id = s->id;
 		struct socket_info temp;
 		if (query_info(s, &temp) && s->id == id) {
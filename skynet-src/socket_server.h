@@ -13,6 +13,7 @@
 #define SOCKET_EXIT 5		// 退出 socket 线程
 #define SOCKET_UDP 6		// 接收 udp 数据
 #define SOCKET_WARNING 7	// socket 警告
+#define SOCKET_IDLE 10		// 返回过消息之后，即将阻塞等待新的事件
 
 // Only for internal use
 #define SOCKET_RST 8
@@ -27,7 +28,11 @@ struct socket_message {
 	char * data;
 };
 
-struct socket_server * socket_server_create(uint64_t time);
+// shard is stored in the low shard_bits of every socket id created by this server
+// the server holds at most 2^slot_bits sockets (0 for default 65536), slots are allocated by pages on demand
+struct socket_server * socket_server_create(uint64_t time, int shard, int shard_bits, int slot_bits);
+// let listen sockets of these servers spread accepted connections across all of them
+void socket_server_group(struct socket_server **group, int n);
 void socket_server_release(struct socket_server *);
 void socket_server_updatetime(struct socket_server *, uint64_t time);
 int socket_server_poll(struct socket_server *, struct socket_message *result, int *more);
@@ -41,14 +46,21 @@ void socket_server_pause(struct socket_server *, uintptr_t opaque, int id);
 // return -1 when error
 int socket_server_send(struct socket_server *, struct socket_sendbuffer *buffer);
 int socket_server_send_lowpriority(struct socket_server *, struct socket_sendbuffer *buffer);
+// send sz bytes of file fd from offset (sz < 0 means to the end of file), the socket thread owns fd and closes it
+int socket_server_sendfile(struct socket_server *, int id, int fd, int64_t offset, int64_t sz);
 
 // ctrl command below returns id
 int socket_server_listen(struct socket_server *, uintptr_t opaque, const char * addr, int port, int backlog);
+// one SO_REUSEPORT listener per shard, the returned id stands for the whole group
+int socket_server_listen_reuseport(struct socket_server *, uintptr_t opaque, const char * addr, int port, int backlog);
 int socket_server_connect(struct socket_server *, uintptr_t opaque, const char * addr, int port);
 int socket_server_bind(struct socket_server *, uintptr_t opaque, int fd);
 
 // for tcp
 void socket_server_nodelay(struct socket_server *, int id);
+// SOCKET_WARNING is raised once when the unsent bytes reach high, and again (ud = 0) when they fall to low
+void socket_server_watermark(struct socket_server *, int id, int64_t high, int64_t low);
+int socket_server_overflow(struct socket_server *, int id);
 
 struct socket_udp_address;
 
@@ -74,4 +86,7 @@ void socket_server_userobject(struct socket_server *, struct socket_object_inter
 
 struct socket_info * socket_server_info(struct socket_server *);
 
+// return the buffer of a SOCKET_DATA (tcp) message to the read buffer pool, sz is the size of data (result->ud)
+void socket_server_free_buffer(void *buffer, int sz);
+
 #endif
@@ -78,6 +78,35 @@ skynet.start(function()
 
 	info("Timeout : %s", reqs.timeout)
 
+	-- cancel the timeout of select
+
+	local function sessions()
+		local t = {}
+		skynet.task(t)
+		local n = 0
+		for _ in pairs(t) do
+			n = n + 1
+		end
+		return n
+	end
+
+	skynet.sleep(110)	-- wait for the responses of the requests above
+	local n = sessions()
+	for req, resp in skynet.request { slave, "lua", "ping", 0, "FAST" } : select(100) do
+		info("%s", resp[1])
+	end
+	-- the timer is removed in core, no session is left for it
+	assert(sessions() == n)
+
+	local reqs = skynet.request { slave, "lua", "ping", 20 , "SLOW" }
+	for req, resp in reqs:select(10) do
+		info("%s", resp[1])
+	end
+	assert(reqs.timeout)
+	skynet.sleep(20)
+	assert(sessions() == n)
+	info("Cancel timeout : ok")
+
 	-- call in select
 	for req, resp in skynet.request
 		{ slave, "lua", "ping", 20, "CALL 20" }
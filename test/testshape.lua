@@ -0,0 +1,98 @@
+local skynet = require "skynet"
+
+local mode = ...
+
+if mode == "slave" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(session,_, ...)
+		if session ~= 0 then
+			skynet.ret(skynet.pack(...))
+		end
+	end)
+end)
+
+else
+
+local function equal(a, b)
+	if type(a) ~= "table" or type(b) ~= "table" then
+		return a == b
+	end
+	for k,v in pairs(a) do
+		if not equal(v, b[k]) then
+			return false
+		end
+	end
+	for k in pairs(b) do
+		if a[k] == nil then
+			return false
+		end
+	end
+	return true
+end
+
+local function packsize(...)
+	local msg, sz = skynet.packshape(...)
+	local str = skynet.tostring(msg, sz)
+	skynet.trash(msg, sz)
+	return #str, str
+end
+
+local function roundtrip(...)
+	local msg, sz = skynet.packshape(...)
+	return skynet.unpack(msg, sz)
+end
+
+skynet.start(function()
+	local slave = skynet.newservice(SERVICE_NAME, "slave")
+
+	-- 同一个 key 集合出现足够多次后才登记 shape ，之前和 skynet.pack 的结果一样
+	local obj = { name = "alice", hp = 100, pos = { x = 1, y = 2 } }
+	local plain = skynet.packstring(obj)
+	local first = select(2, packsize(obj))
+	assert(first == plain)
+	local sz
+	for i = 1, 16 do
+		sz = packsize(obj)
+	end
+	assert(sz < #plain)
+	skynet.error(string.format("shape size %d -> %d", #plain, sz))
+	assert(equal(roundtrip(obj), obj))
+
+	-- 不能用 shape 编码的 table 退回普通编码
+	local fallback = {
+		{ 1, 2, 3 },
+		{ [1] = "a", b = "b" },
+		{ [true] = 1, x = 2 },
+		{},
+		setmetatable({}, { __pairs = function(t) return next, { a = 1 }, nil end }),
+	}
+	local many = {}
+	for i = 1, 20 do
+		many["k" .. i] = i
+	end
+	table.insert(fallback, many)
+	for _, t in ipairs(fallback) do
+		for i = 1, 16 do
+			local r = roundtrip(t, "tail")
+			assert(equal(r, getmetatable(t) and { a = 1 } or t))
+			assert(select(2, roundtrip(t, "tail")) == "tail")
+		end
+	end
+
+	-- 不同 key 集合的 map 只出现一次，不登记
+	for i = 1, 1000 do
+		local map = { ["user" .. i] = i }
+		assert(select(2, packsize(map)) == skynet.packstring(map))
+	end
+
+	-- 本进程内的服务收到后用 skynet.unpack 解包
+	local r = skynet.callshape(slave, obj, "more")
+	assert(equal(r, obj))
+	skynet.sendshape(slave, obj)
+
+	skynet.error("Test shape ok")
+	skynet.exit()
+end)
+
+end
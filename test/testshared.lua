@@ -0,0 +1,104 @@
+local skynet = require "skynet"
+
+local mode = ...
+
+if mode == "slave" then
+
+local holder
+
+local CMD = {}
+
+function CMD.sum(obj)
+	local s = 0
+	for i = 1, #obj.list do
+		s = s + obj.list[i].value
+	end
+	return s
+end
+
+function CMD.keep(obj)
+	holder = obj
+	return holder.name
+end
+
+function CMD.drop()
+	holder = nil
+	collectgarbage()
+	return true
+end
+
+function CMD.exit()
+	skynet.exit()
+end
+
+skynet.start(function()
+	skynet.dispatch("lua", function(session, _, cmd, ...)
+		local r = CMD[cmd](...)
+		if session ~= 0 then
+			skynet.ret(skynet.pack(r))
+		end
+	end)
+end)
+
+else
+
+-- 等共享对象的数量回到 n ，最多等 1 秒
+local function wait_count(n, what)
+	for i = 1, 100 do
+		if skynet.sharedinfo() == n then
+			skynet.error(what, "ok")
+			return
+		end
+		skynet.sleep(1)
+	end
+	error(string.format("%s : %d shared objects left, expect %d", what, skynet.sharedinfo(), n))
+end
+
+skynet.start(function()
+	local base = skynet.sharedinfo()
+	local list = {}
+	for i = 1, 1000 do
+		list[i] = { id = i, value = i * 2, name = "item" .. i }
+	end
+	local obj = skynet.shared { name = "snapshot", list = list }
+	assert(skynet.sharedinfo() == base + 1)
+
+	local slave = skynet.newservice(SERVICE_NAME, "slave")
+
+	-- 接收方读取后不保留
+	assert(skynet.callshared(slave, "sum", obj) == 1001000)
+
+	-- 接收方保留到 drop
+	assert(skynet.callshared(slave, "keep", obj) == "snapshot")
+
+	-- 子 table 和字符串是复制出来的，不能再发送
+	assert(not pcall(skynet.sendshared, slave, "keep", obj.list))
+
+	-- 发给不处理它的 C 服务、不存在的地址，引用随消息释放
+	skynet.sendshared(".logger", obj)
+	skynet.sendshared(".nonexistent", obj)
+
+	-- 消息持有引用，不能拷贝给多个服务，发送失败时引用随消息释放
+	local core = require "skynet.sharetable.core"
+	assert(skynet.redirect_batch({ slave, slave }, 0, "shared", 0, core.pack("keep", obj)) == false)
+
+	-- 发给已经退出的服务
+	local dead = skynet.newservice(SERVICE_NAME, "slave")
+	skynet.send(dead, "lua", "exit")
+	for i = 1, 10 do
+		skynet.sendshared(dead, "keep", obj)
+	end
+
+	obj = nil
+	collectgarbage()
+	skynet.sleep(10)
+	assert(skynet.sharedinfo() == base + 1)	-- slave 还持有
+
+	assert(skynet.call(slave, "lua", "drop"))
+	wait_count(base, "Test shared")
+
+	skynet.send(slave, "lua", "exit")
+	skynet.exit()
+end)
+
+end
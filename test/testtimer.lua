@@ -24,7 +24,29 @@ local function test()
 	end
 end
 
+-- timer_resolution = "ms" 时精确到毫秒，否则向上取整到 centisecond
+local function test_ms()
+	local ms = skynet.getenv "timer_resolution" == "ms"
+	for i=1,5 do
+		local t = skynet.hpc()
+		skynet.sleep_ms(3)
+		local elapsed = (skynet.hpc() - t) / 1000000
+		print("test sleep_ms 3", elapsed)
+		if ms then
+			assert(elapsed < 10)
+		end
+	end
+	local co = coroutine.running()
+	local t = skynet.hpc()
+	skynet.timeout_ms(5, function()
+		print("test timeout_ms 5", (skynet.hpc() - t) / 1000000)
+		skynet.wakeup(co)
+	end)
+	skynet.wait(co)
+end
+
 skynet.start(function()
+	test_ms()
 	skynet.trace_timeout(true)	-- trun on trace for timeout, skynet.task will returns more info.
 	test()
 
@@ -0,0 +1,72 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+
+local PORT = 8003
+local HIGH = 256 * 1024
+local CHUNK = string.rep("x", 64 * 1024)
+local TOTAL = 1024	-- 写 64M
+
+skynet.start(function()
+	local listen_id = socket.listen("127.0.0.1", PORT)
+	local server
+	socket.start(listen_id, function(id)
+		server = id
+	end)
+
+	local client = socket.open("127.0.0.1", PORT)
+	assert(client)
+	-- 接收方暂停读，让发送方的写队列堆起来
+	socket.pause(client)
+	while not server do
+		skynet.sleep(1)
+	end
+	socket.start(server)
+
+	local warning = {}
+	socket.warning(server, function(id, size)
+		table.insert(warning, size)
+	end)
+	socket.watermark(server, HIGH, nil, true)
+
+	local written = 0
+	local done
+	skynet.fork(function()
+		for i = 1, TOTAL do
+			socket.write(server, CHUNK)
+			written = written + 1
+		end
+		done = true
+	end)
+
+	-- 写队列到达高水位后 socket.write 阻塞，写入的数量不再增长
+	local last
+	repeat
+		last = written
+		skynet.sleep(20)
+	until last == written
+	assert(not done and written < TOTAL)
+	assert(warning[1] and warning[1] > 0)
+	skynet.error(string.format("Blocked after %d KB", written * #CHUNK // 1024))
+
+	-- socket.read 恢复读取，写队列降到低水位后阻塞的写继续
+	local n = 0
+	while n < TOTAL * #CHUNK do
+		local data = assert(socket.read(client))
+		n = n + #data
+	end
+	assert(done)
+	assert(n == TOTAL * #CHUNK)
+	local wake = false
+	for _, size in ipairs(warning) do
+		if size == 0 then
+			wake = true
+		end
+	end
+	assert(wake)
+
+	socket.close(client)
+	socket.close(server)
+	socket.close(listen_id)
+	skynet.error("Test watermark ok")
+	skynet.exit()
+end)